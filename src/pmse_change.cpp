@@ -147,7 +147,7 @@ void UpdateChange::rollback() {
         log() << e.what();
     }
 }
-InsertIndexChange::InsertIndexChange(persistent_ptr<PmseTree> tree,
+InsertIndexChange::InsertIndexChange(PmseTree* tree,
                                      pool_base pop, BSONObj key,
                                      RecordId loc, bool dupsAllowed,
                                      const IndexDescriptor* desc)
@@ -158,26 +158,22 @@ void InsertIndexChange::commit() {}
 
 void InsertIndexChange::rollback() {
     try {
-        transaction::exec_tx(_pop, [this] {
-            IndexKeyEntry entry(_key.getOwned(), _loc);
-            _tree->remove(_pop, entry, _dupsAllowed, _desc->keyPattern());
-        });
+        IndexKeyEntry entry(_key.getOwned(), _loc);
+        _tree->remove(_pop, entry, _dupsAllowed, _desc->keyPattern());
     } catch (std::exception &e) {
         log() << e.what();
     }
 }
 
-RemoveIndexChange::RemoveIndexChange(persistent_ptr<PmseTree> tree, pool_base pop, BSONObj key, RecordId loc,
+RemoveIndexChange::RemoveIndexChange(PmseTree* tree, pool_base pop, BSONObj key, RecordId loc,
                                      bool dupsAllowed, BSONObj ordering)
         : _tree(tree), _pop(pop), _key(key), _loc(loc),
           _dupsAllowed(dupsAllowed), _ordering(ordering) {}
 void RemoveIndexChange::commit() {}
 void RemoveIndexChange::rollback() {	
     try {
-        transaction::exec_tx(_pop, [this] {
-            IndexKeyEntry entry(_key.getOwned(), _loc);
-            _tree->insert(_pop, entry, _ordering, _dupsAllowed);
-        });
+        IndexKeyEntry entry(_key.getOwned(), _loc);
+        _tree->insert(_pop, entry, _ordering, _dupsAllowed);
     } catch (std::exception &e) {
         log() << e.what();
     }
@@ -112,13 +112,13 @@ class UpdateChange : public RecoveryUnit::Change {
 
 class InsertIndexChange : public RecoveryUnit::Change {
  public:
-    InsertIndexChange(persistent_ptr<PmseTree> tree, pool_base pop,
+    InsertIndexChange(PmseTree* tree, pool_base pop,
                       BSONObj key, RecordId loc, bool dupsAllowed,
                       const IndexDescriptor* desc);
     virtual void rollback();
     virtual void commit();
  private:
-    persistent_ptr<PmseTree> _tree;
+    PmseTree* _tree;
     pool_base _pop;
     BSONObj _key;
     RecordId _loc;
@@ -128,12 +128,12 @@ class InsertIndexChange : public RecoveryUnit::Change {
 
 class RemoveIndexChange : public RecoveryUnit::Change {
  public:
-    RemoveIndexChange(persistent_ptr<PmseTree> tree, pool_base pop, BSONObj key, RecordId loc,
+    RemoveIndexChange(PmseTree* tree, pool_base pop, BSONObj key, RecordId loc,
                       bool dupsAllowed, BSONObj ordering);
     virtual void rollback();
     virtual void commit();
  private:
-    persistent_ptr<PmseTree> _tree;
+    PmseTree* _tree;
     pool_base _pop;
     BSONObj _key;
     RecordId _loc;
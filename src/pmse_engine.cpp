@@ -34,10 +34,16 @@
 
 #include "pmse_engine.h"
 #include "pmse_record_store.h"
+#include "pmse_server_parameters.h"
 #include "pmse_sorted_data_interface.h"
+#include "pmse_spare_pools.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstdlib>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "mongo/platform/basic.h"
 #include "mongo/base/disallow_copying.h"
@@ -45,7 +51,9 @@
 #include "mongo/db/storage/record_store.h"
 #include "mongo/stdx/memory.h"
 #include "mongo/db/catalog/collection_options.h"
+#include "mongo/stdx/thread.h"
 #include "mongo/util/log.h"
+#include "mongo/util/timer.h"
 
 #include <boost/algorithm/string/predicate.hpp>
 
@@ -55,6 +63,14 @@ PmseEngine::PmseEngine(std::string dbpath) : _dbPath(dbpath) {
     if(!boost::algorithm::ends_with(dbpath, "/")) {
         _dbPath = _dbPath +"/";
     }
+    /*
+     * Process wide setting, set before any pool is opened and left on, so
+     * pools reopened after idle close are faulted in as well.
+     */
+    int prefault = pmsePrefaultAtOpen ? 1 : 0;
+    if (prefault && pmemobj_ctl_set(nullptr, "prefault.at_open", &prefault) != 0) {
+        log() << "Cannot enable prefault: " << pmemobj_errormsg();
+    }
     std::string path = _dbPath + _kIdentFilename.toString();
     if (!boost::filesystem::exists(path)) {
         pop = pool<ListRoot>::create(path, "pmse_identlist", 4 * PMEMOBJ_MIN_POOL,
@@ -67,12 +83,21 @@ PmseEngine::PmseEngine(std::string dbpath) : _dbPath(dbpath) {
 
     try {
         auto root = pop.get_root();
-        if (!root->list_root_ptr) {
+        if (!root->catalog_root_ptr) {
             transaction::exec_tx(pop, [this, &root] {
-                root->list_root_ptr = make_persistent<PmseList>(pop);
+                auto catalog = make_persistent<PmseIdentCatalog>(pop);
+                if (root->list_root_ptr) {
+                    root->list_root_ptr->setPool(pop);
+                    catalog->migrateFrom(root->list_root_ptr);
+                    root->list_root_ptr->clear();
+                    delete_persistent<PmseList>(root->list_root_ptr);
+                    root->list_root_ptr = nullptr;
+                    log() << "Ident catalog migrated";
+                }
+                root->catalog_root_ptr = catalog;
             });
         }
-        _identList = root->list_root_ptr;
+        _identList = root->catalog_root_ptr;
     } catch (std::exception& e) {
         log() << "Error while creating PMSE engine:" << e.what();
     }
@@ -83,12 +108,114 @@ PmseEngine::PmseEngine(std::string dbpath) : _dbPath(dbpath) {
         _needCheck = false;
     }
     _identList->resetState();
+    openPools();
+    if (pmsePoolIdleTimeoutSecs > 0) {
+        _idlePoolCloser = stdx::make_unique<PmseIdlePoolCloser>(&_poolHandler,
+                                                                pmsePoolIdleTimeoutSecs);
+        _idlePoolCloser->go();
+    }
+    if (pmseIndexMaintenanceIntervalSecs > 0) {
+        _poolMaintenance = stdx::make_unique<PmsePoolMaintenance>(&_poolHandler,
+                                                                  pmseIndexMaintenanceIntervalSecs);
+        _poolMaintenance->go();
+    }
+    if (pmseSparePools > 0) {
+        _sparePools = stdx::make_unique<PmseSparePools>(_dbPath, pmseSparePools);
+        _sparePools->go();
+    }
+}
+
+/*
+ * Opens pools of all known idents in parallel, so mongod does not pay
+ * for opening (and optionally faulting in) pools on the first queries.
+ * Pools which cannot be opened here are left for lazy open on first use.
+ */
+void PmseEngine::openPools() {
+    if (pmseStartupOpenThreads <= 0)
+        return;
+    Timer timer;
+    std::vector<std::string> idents;
+    for (auto& ident : _identList->getKeys()) {
+        bool status;
+        std::string ns = _identList->find(ident.c_str(), status);
+        /*
+         * Startup log and its indexes are recreated on first open. Indexes
+         * created by older versions have no namespace stored in catalog.
+         */
+        if (!status || ns.empty() || ns == "local.startup_log")
+            continue;
+        idents.push_back(ident);
+    }
+
+    std::atomic<size_t> next = {0};
+    std::vector<stdx::thread> threads;
+    size_t threadsCount = std::min(static_cast<size_t>(pmseStartupOpenThreads), idents.size());
+    for (size_t i = 0; i < threadsCount; i++) {
+        threads.emplace_back([this, &idents, &next] {
+            for (size_t j = next.fetch_add(1); j < idents.size(); j = next.fetch_add(1)) {
+                openIdentPools(idents[j]);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    log() << "Opened " << _poolHandler.size() << " pools in " << timer.millis() << " ms";
+}
+
+/*
+ * Layout of ident pool, index idents have "index-" in their last path
+ * component, anything else is a record store.
+ */
+std::string PmseEngine::identLayout(const std::string& ident) {
+    size_t slash = ident.rfind('/');
+    std::string name = slash == std::string::npos ? ident : ident.substr(slash + 1);
+    return boost::algorithm::starts_with(name, "index-") ? "pmse_index" : "pmse_mapper";
+}
+
+void PmseEngine::openIdentPools(const std::string& ident) {
+    std::string path = _dbPath + ident;
+    std::string layout = identLayout(ident);
+    /*
+     * Open ident file and partitions of collection if it has them.
+     */
+    for (uint64_t i = 0; boost::filesystem::exists(path); i++) {
+        PMEMobjpool* pop = pmemobj_open(path.c_str(), layout.c_str());
+        if (!pop) {
+            log() << "Cannot open " << path << ": " << pmemobj_errormsg();
+            break;
+        }
+        _poolHandler.add(i == 0 ? ident : PmseRecordStore::partitionIdent(ident, i),
+                         pool_base(pop), path, layout);
+        path = PmseRecordStore::partitionPath(_dbPath, ident, i + 1);
+    }
+}
+
+/*
+ * Moves formatted spare pool in place of new ident or partition file, so
+ * store constructor only opens it. Partition pools of record store are
+ * the same as its first pool.
+ */
+void PmseEngine::claimSparePool(PmseSparePools::Kind kind, const std::string& path) {
+    if (_sparePools && !boost::filesystem::exists(path)) {
+        _sparePools->claim(kind, path);
+    }
 }
 
 PmseEngine::~PmseEngine() {
-    for (auto p : _poolHandler) {
-        p.second.close();
+    if (_sparePools) {
+        _sparePools->shutdown();
+        _sparePools->wait();
     }
+    if (_poolMaintenance) {
+        _poolMaintenance->shutdown();
+        _poolMaintenance->wait();
+    }
+    if (_idlePoolCloser) {
+        _idlePoolCloser->shutdown();
+        _idlePoolCloser->wait();
+    }
+    _poolHandler.closeAll();
     pop.close();
 }
 
@@ -98,6 +225,13 @@ Status PmseEngine::createRecordStore(OperationContext* opCtx, StringData ns, Str
     auto status = Status::OK();
     try {
         _identList->insertKV(ident.toString().c_str(), ns.toString().c_str());
+        if (!options.capped && !PmseRecordStore::isSystemCollection(ns)) {
+            claimSparePool(PmseSparePools::kRecordStore, _dbPath + ident.toString());
+            for (int i = 1; i < pmseRecordStorePartitions; i++) {
+                claimSparePool(PmseSparePools::kRecordStore,
+                               PmseRecordStore::newPartitionPath(_dbPath, ident, i));
+            }
+        }
         auto record_store = stdx::make_unique<PmseRecordStore>(ns, ident, options, _dbPath, &_poolHandler);
     } catch(std::exception &e) {
         status = Status(ErrorCodes::OutOfDiskSpace, e.what());
@@ -109,16 +243,7 @@ std::unique_ptr<RecordStore> PmseEngine::getRecordStore(OperationContext* opCtx,
                                                         StringData ns,
                                                         StringData ident,
                                                         const CollectionOptions& options) {
-    persistent_ptr<PmseMap<InitData>> _mapper;
-    pool<root> mapPoolOld;
-    try {
-        mapPoolOld = pool<root>((_poolHandler).at(ident.toString()));
-    } catch (std::exception &e) {}
-
-    if (mapPoolOld.get_handle()) {
-        _mapper = mapPoolOld.get_root()->kvmap_root_ptr;
-        _mapper->storeCounters();
-    }
+    PmseRecordStore::storeCounters(ident, &_poolHandler);
     _identList->update(ident.toString().c_str(), ns.toString().c_str());
     return stdx::make_unique<PmseRecordStore>(ns, ident, options, _dbPath,
                                               &_poolHandler, (_needCheck ? true : false));
@@ -129,7 +254,10 @@ Status PmseEngine::createSortedDataInterface(OperationContext* opCtx,
                                              const IndexDescriptor* desc) {
     stdx::lock_guard<stdx::mutex> lock(_pmutex);
     try {
-        _identList->insertKV(ident.toString().c_str(), "");
+        _identList->insertKV(ident.toString().c_str(), desc->parentNS().c_str());
+        if (!PmseRecordStore::isSystemCollection(desc->parentNS())) {
+            claimSparePool(PmseSparePools::kIndex, _dbPath + ident.toString());
+        }
         auto sorted_data_interface = PmseSortedDataInterface(ident, desc, _dbPath, &_poolHandler);
     } catch (std::exception &e) {
         return Status(ErrorCodes::OutOfDiskSpace, e.what());
@@ -147,10 +275,8 @@ Status PmseEngine::dropIdent(OperationContext* opCtx, StringData ident) {
     stdx::lock_guard<stdx::mutex> lock(_pmutex);
     boost::filesystem::path path(_dbPath);
     _identList->deleteKV(ident.toString().c_str());
-    if (_poolHandler.count(ident.toString()) > 0) {
-        _poolHandler[ident.toString()].close();
-        _poolHandler.erase(ident.toString());
-    }
+    _poolHandler.remove(ident.toString());
+    PmseRecordStore::dropPartitions(_dbPath, ident, &_poolHandler);
     boost::filesystem::remove_all(path.string() + ident.toString());
     return Status::OK();
 }
@@ -50,8 +50,11 @@
 #include <unordered_set>
 #include <vector>
 
+#include "pmse_ident_catalog.h"
 #include "pmse_list.h"
+#include "pmse_pool_manager.h"
 #include "pmse_recovery_unit.h"
+#include "pmse_spare_pools.h"
 
 #include "mongo/db/storage/kv/kv_engine.h"
 
@@ -145,14 +148,21 @@ class PmseEngine : public KVEngine {
     void setJournalListener(JournalListener* jl) final {}
 
  private:
+    void openPools();
+    static std::string identLayout(const std::string& ident);
+    void openIdentPools(const std::string& ident);
+    void claimSparePool(PmseSparePools::Kind kind, const std::string& path);
     stdx::mutex _pmutex;
     bool _needCheck;
-    std::map<std::string, pool_base> _poolHandler;
+    PmsePoolManager _poolHandler;
     std::shared_ptr<void> _catalogInfo;
     std::string _dbPath;
     const StringData _kIdentFilename = "pmkv.pm";
     pool<ListRoot> pop;
-    persistent_ptr<PmseList> _identList;
+    persistent_ptr<PmseIdentCatalog> _identList;
+    std::unique_ptr<PmseSparePools> _sparePools;
+    std::unique_ptr<PmseIdlePoolCloser> _idlePoolCloser;
+    std::unique_ptr<PmsePoolMaintenance> _poolMaintenance;
 };
 }  // namespace mongo
 
@@ -0,0 +1,331 @@
+/*
+ * Copyright 2014-2020, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
+
+#include "pmse_ident_catalog.h"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "mongo/stdx/mutex.h"
+
+#include "pmse_tree.h"
+
+namespace mongo {
+
+PmseIdentCatalog::PmseIdentCatalog(pool<ListRoot> obj)
+    : _afterSafeShutdown(true), pool_obj(obj) {
+    _size = 0;
+    _graveyard = 0;
+    _tableGraveyard = 0;
+    _pendingLink = 0;
+    _pendingValue = 0;
+    _graveyardEpoch = 0;
+    _table = allocateTable(IDENT_CATALOG_BUCKETS);
+}
+
+/*
+ * FNV-1a
+ */
+uint64_t PmseIdentCatalog::hashKey(const char key[]) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *key; key++) {
+        hash ^= static_cast<unsigned char>(*key);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint64_t PmseIdentCatalog::load(const uint64_t& location) {
+    return __atomic_load_n(&location, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Records link to set once transaction commits, each change sets one.
+ */
+void PmseIdentCatalog::publish(uint64_t& location, uint64_t value) {
+    _pendingLink = reinterpret_cast<char*>(&location) - reinterpret_cast<char*>(pool_obj.handle());
+    _pendingValue = value;
+}
+
+void PmseIdentCatalog::publishPending() {
+    uint64_t* location = direct<uint64_t>(_pendingLink);
+    if (!location)
+        return;
+    __atomic_store_n(location, _pendingValue.get_ro(), __ATOMIC_RELEASE);
+    pool_obj.persist(location, sizeof(*location));
+    _pendingLink = 0;
+    pool_obj.persist(_pendingLink);
+}
+
+/*
+ * Runs body in transaction and publishes its link. Entries it buried
+ * are retired only then, readers entering later cannot reach them.
+ */
+void PmseIdentCatalog::change(const std::function<void()>& body) {
+    reclaim();
+    uint64_t graveyard = _graveyard;
+    uint64_t tableGraveyard = _tableGraveyard;
+    transaction::exec_tx(pool_obj, body);
+    publishPending();
+    if (_graveyard != graveyard || _tableGraveyard != tableGraveyard)
+        _graveyardEpoch = PmseEpochs::retire();
+}
+
+uint64_t PmseIdentCatalog::allocateTable(uint64_t bucketCount) {
+    PMEMoid oid = pmemobj_tx_zalloc(sizeof(Table) + bucketCount * sizeof(uint64_t), 0);
+    if (OID_IS_NULL(oid)) {
+        throw pmem::transaction_alloc_error("Can't allocate ident catalog table");
+    }
+    direct<Table>(oid.off)->bucketCount = bucketCount;
+    return oid.off;
+}
+
+uint64_t PmseIdentCatalog::allocateEntry(uint64_t hash, const char key[], const char value[]) {
+    uint32_t keySize = strlen(key) + 1;
+    uint32_t valueSize = strlen(value) + 1;
+    PMEMoid oid = pmemobj_tx_zalloc(sizeof(Entry) + keySize + valueSize, 0);
+    if (OID_IS_NULL(oid)) {
+        throw pmem::transaction_alloc_error("Can't allocate ident catalog entry");
+    }
+    Entry* entry = direct<Entry>(oid.off);
+    entry->hash = hash;
+    entry->keySize = keySize;
+    entry->valueSize = valueSize;
+    memcpy(entry->data, key, keySize);
+    memcpy(entry->data + keySize, value, valueSize);
+    return oid.off;
+}
+
+/*
+ * Returns entry with given key or nullptr. If link is given it is set to
+ * location (bucket or next field of previous entry) pointing to entry.
+ */
+PmseIdentCatalog::Entry* PmseIdentCatalog::lookup(const char key[], uint64_t hash, uint64_t** link) {
+    Table* table = direct<Table>(load(_table.get_ro()));
+    uint64_t* location = &table->buckets[hash % table->bucketCount];
+    for (uint64_t offset = load(*location); offset; offset = load(*location)) {
+        Entry* entry = direct<Entry>(offset);
+        if (entry->hash == hash && strcmp(entry->data, key) == 0) {
+            if (link)
+                *link = location;
+            return entry;
+        }
+        location = &entry->next;
+    }
+    return nullptr;
+}
+
+void PmseIdentCatalog::insertEntry(uint64_t offset) {
+    Table* table = direct<Table>(_table.get_ro());
+    Entry* entry = direct<Entry>(offset);
+    uint64_t& bucket = table->buckets[entry->hash % table->bucketCount];
+    entry->next = bucket;
+    publish(bucket, offset);
+}
+
+void PmseIdentCatalog::bury(Entry* entry) {
+    pmemobj_tx_add_range_direct(&entry->graveNext, sizeof(entry->graveNext));
+    entry->graveNext = _graveyard;
+    _graveyard = pmemobj_oid(entry).off;
+}
+
+/*
+ * Builds twice bigger table from copies of all entries and new entry at
+ * given offset, so readers which still walk the old table see it
+ * unchanged.
+ */
+void PmseIdentCatalog::grow(uint64_t offset) {
+    uint64_t oldOffset = _table;
+    Table* old = direct<Table>(oldOffset);
+    uint64_t newOffset = allocateTable(old->bucketCount * 2);
+    Table* table = direct<Table>(newOffset);
+    for (uint64_t i = 0; i < old->bucketCount; i++) {
+        for (Entry* entry = direct<Entry>(old->buckets[i]); entry; entry = direct<Entry>(entry->next)) {
+            uint64_t copy = allocateEntry(entry->hash, entry->data, entry->data + entry->keySize);
+            uint64_t& bucket = table->buckets[entry->hash % table->bucketCount];
+            direct<Entry>(copy)->next = bucket;
+            bucket = copy;
+            bury(entry);
+        }
+    }
+    Entry* entry = direct<Entry>(offset);
+    uint64_t& bucket = table->buckets[entry->hash % table->bucketCount];
+    entry->next = bucket;
+    bucket = offset;
+    pmemobj_tx_add_range_direct(&old->graveNext, sizeof(old->graveNext));
+    old->graveNext = _tableGraveyard;
+    _tableGraveyard = oldOffset;
+    publish(_table.get_rw(), newOffset);
+}
+
+void PmseIdentCatalog::insertKV(const char key[], const char value[]) {
+    stdx::lock_guard<pmem::obj::mutex> lock(_pmutex);
+    change([this, key, value] {
+        uint64_t hash = hashKey(key);
+        uint64_t* link;
+        Entry* old = lookup(key, hash, &link);
+        uint64_t offset = allocateEntry(hash, key, value);
+        if (old) {
+            direct<Entry>(offset)->next = old->next;
+            publish(*link, offset);
+            bury(old);
+            return;
+        }
+        _size = _size + 1;
+        if (_size > direct<Table>(_table)->bucketCount * 2) {
+            grow(offset);
+        } else {
+            insertEntry(offset);
+        }
+    });
+}
+
+void PmseIdentCatalog::deleteKV(const char key[]) {
+    stdx::lock_guard<pmem::obj::mutex> lock(_pmutex);
+    change([this, key] {
+        uint64_t* link;
+        Entry* entry = lookup(key, hashKey(key), &link);
+        if (!entry)
+            return;
+        publish(*link, entry->next);
+        bury(entry);
+        _size = _size - 1;
+    });
+}
+
+void PmseIdentCatalog::update(const char key[], const char value[]) {
+    stdx::lock_guard<pmem::obj::mutex> lock(_pmutex);
+    change([this, key, value] {
+        uint64_t hash = hashKey(key);
+        uint64_t* link;
+        Entry* old = lookup(key, hash, &link);
+        if (!old || strcmp(old->data + old->keySize, value) == 0)
+            return;
+        uint64_t offset = allocateEntry(hash, key, value);
+        direct<Entry>(offset)->next = old->next;
+        publish(*link, offset);
+        bury(old);
+    });
+}
+
+bool PmseIdentCatalog::hasKey(const char key[]) {
+    PmseEpochs::Guard guard;
+    return lookup(key, hashKey(key), nullptr) != nullptr;
+}
+
+std::vector<std::string> PmseIdentCatalog::getKeys() {
+    stdx::lock_guard<pmem::obj::mutex> lock(_pmutex);
+    std::vector<std::string> names;
+    names.reserve(_size);
+    Table* table = direct<Table>(_table);
+    for (uint64_t i = 0; i < table->bucketCount; i++) {
+        for (Entry* entry = direct<Entry>(table->buckets[i]); entry; entry = direct<Entry>(entry->next)) {
+            names.push_back(entry->data);
+        }
+    }
+    return names;
+}
+
+std::string PmseIdentCatalog::find(const char key[], bool &status) {
+    PmseEpochs::Guard guard;
+    Entry* entry = lookup(key, hashKey(key), nullptr);
+    status = entry != nullptr;
+    return entry ? entry->data + entry->keySize : "";
+}
+
+/*
+ * Nobody can read catalog while it is opened, so link left by crash is
+ * set and replaced entries and tables can be freed now.
+ */
+void PmseIdentCatalog::setPool(pool<ListRoot> pool_obj) {
+    this->pool_obj = pool_obj;
+    publishPending();
+    freeGraveyard();
+}
+
+/*
+ * Graveyard is freed once readers which could still walk buried entries
+ * left, called by writer before its change.
+ */
+void PmseIdentCatalog::reclaim() {
+    if ((_graveyard || _tableGraveyard) && _graveyardEpoch < PmseEpochs::safe())
+        freeGraveyard();
+}
+
+void PmseIdentCatalog::freeGraveyard() {
+    if (!_graveyard && !_tableGraveyard)
+        return;
+    transaction::exec_tx(pool_obj, [this] {
+        for (uint64_t offset = _graveyard; offset;) {
+            Entry* entry = direct<Entry>(offset);
+            offset = entry->graveNext;
+            pmemobj_tx_free(pmemobj_oid(entry));
+        }
+        for (uint64_t offset = _tableGraveyard; offset;) {
+            Table* table = direct<Table>(offset);
+            offset = table->graveNext;
+            pmemobj_tx_free(pmemobj_oid(table));
+        }
+        _graveyard = 0;
+        _tableGraveyard = 0;
+    });
+}
+
+void PmseIdentCatalog::migrateFrom(persistent_ptr<PmseList> list) {
+    for (auto& key : list->getKeys()) {
+        bool status;
+        std::string value = list->find(key.c_str(), status);
+        insertKV(key.c_str(), value.c_str());
+    }
+    _afterSafeShutdown = list->isAfterSafeShutdown();
+}
+
+bool PmseIdentCatalog::isAfterSafeShutdown() {
+    return _afterSafeShutdown;
+}
+
+void PmseIdentCatalog::resetState() {
+    transaction::exec_tx(pool_obj, [this] {
+        _afterSafeShutdown = false;
+    });
+}
+
+void PmseIdentCatalog::safeShutdown() {
+    transaction::exec_tx(pool_obj, [this] {
+        _afterSafeShutdown = true;
+    });
+}
+
+}  // namespace mongo
@@ -0,0 +1,137 @@
+/*
+ * Copyright 2014-2020, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_PMSE_IDENT_CATALOG_H_
+#define SRC_PMSE_IDENT_CATALOG_H_
+
+#include <libpmemobj.h>
+#include <libpmemobj++/mutex.hpp>
+#include <libpmemobj++/p.hpp>
+#include <libpmemobj++/persistent_ptr.hpp>
+#include <libpmemobj++/pool.hpp>
+#include <libpmemobj++/transaction.hpp>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "pmse_list.h"
+
+using namespace pmem::obj;
+
+namespace mongo {
+
+const uint64_t IDENT_CATALOG_BUCKETS = 1024;
+
+/*
+ * Persistent hash map ident -> value with variable length strings.
+ * Writers are serialized with mutex and use transactions, readers
+ * (hasKey, find) do not lock. Buckets and chains are linked by offsets
+ * within pool. Transaction of a change only records the one link it
+ * needs to set, which is stored with an atomic store after commit, so
+ * readers never see memory of aborted transaction. Link recorded when
+ * a crash came before it was stored is set when the catalog is opened.
+ * Entries are never modified after they are published: update replaces
+ * entry and replaced or deleted entries are moved to graveyard, which is
+ * freed by the next change once no reader entered before it was filled.
+ */
+class PmseIdentCatalog {
+ public:
+    explicit PmseIdentCatalog(pool<ListRoot> obj);
+    PmseIdentCatalog() = delete;
+    ~PmseIdentCatalog() = default;
+    void insertKV(const char key[], const char value[]);
+    void deleteKV(const char key[]);
+    void update(const char key[], const char value[]);
+    bool hasKey(const char key[]);
+    std::vector<std::string> getKeys();
+    std::string find(const char key[], bool &status);
+    void setPool(pool<ListRoot> pool_obj);
+    bool isAfterSafeShutdown();
+    void safeShutdown();
+    void resetState();
+
+    /*
+     * Copies content of old list based catalog, must be called in the
+     * transaction which creates this catalog.
+     */
+    void migrateFrom(persistent_ptr<PmseList> list);
+
+ private:
+    struct Entry {
+        uint64_t next;       // offset of next entry in bucket
+        uint64_t graveNext;  // offset of next entry in graveyard
+        uint64_t hash;
+        uint32_t keySize;    // with terminating zero
+        uint32_t valueSize;  // with terminating zero
+        char data[];         // key followed by value
+    };
+
+    struct Table {
+        uint64_t graveNext;
+        uint64_t bucketCount;
+        uint64_t buckets[];
+    };
+
+    static uint64_t hashKey(const char key[]);
+    template<typename T>
+    T* direct(uint64_t offset) const {
+        return offset ? reinterpret_cast<T*>(reinterpret_cast<char*>(pool_obj.handle()) + offset)
+                      : nullptr;
+    }
+    static uint64_t load(const uint64_t& location);
+    void publish(uint64_t& location, uint64_t value);
+    void publishPending();
+    void change(const std::function<void()>& body);
+    uint64_t allocateTable(uint64_t bucketCount);
+    uint64_t allocateEntry(uint64_t hash, const char key[], const char value[]);
+    Entry* lookup(const char key[], uint64_t hash, uint64_t** link);
+    void insertEntry(uint64_t offset);
+    void bury(Entry* entry);
+    void grow(uint64_t offset);
+    void reclaim();
+    void freeGraveyard();
+
+    p<bool> _afterSafeShutdown = true;
+    p<uint64_t> _table;
+    p<uint64_t> _size;
+    p<uint64_t> _graveyard;
+    p<uint64_t> _tableGraveyard;
+    pool<ListRoot> pool_obj;
+    pmem::obj::mutex _pmutex;
+    p<uint64_t> _pendingLink;      // offset of link to set after commit
+    p<uint64_t> _pendingValue;
+    p<uint64_t> _graveyardEpoch;   // epoch of last burial, this run only
+};
+
+}  // namespace mongo
+#endif  // SRC_PMSE_IDENT_CATALOG_H_
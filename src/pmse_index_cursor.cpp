@@ -34,105 +34,88 @@
 
 #include "pmse_index_cursor.h"
 
-#include <shared_mutex>
 #include <limits>
 #include <list>
 
+#include "mongo/platform/bits.h"
 #include "mongo/util/log.h"
+#include "mongo/util/time_support.h"
 
 namespace mongo {
 
 PmseCursor::PmseCursor(OperationContext* txn, bool isForward,
-                       persistent_ptr<PmseTree> tree, const BSONObj& ordering,
-                       const bool unique)
+                       PmseTree* tree, const BSONObj& ordering,
+                       const bool unique, PmsePoolPin pin)
     : _forward(isForward),
       _ordering(ordering),
-      _first(tree->_first),
-      _last(tree->_last),
+      _pin(pin),
       _tree(tree),
       _locateFoundDataEnd(false),
       _eofRestore(false) {}
 
     // Find entry in tree which is equal or bigger to input entry
     // Locates input cursor on that entry
-    // Sets _locateFoundDataEnd when result is after last entry in tree
-bool PmseCursor::lower_bound(IndexKeyEntry entry, CursorObject& cursor, std::list<pmem::obj::shared_mutex*>& locks) {
-    uint64_t i = 0;
-    int64_t cmp;
-    persistent_ptr<PmseTreeNode> current = _tree->_root;
-    (current->_pmutex).lock_shared();
-    persistent_ptr<PmseTreeNode> child;
-    while (!current->is_leaf) {
-        i = 0;
-        while (i < current->num_keys) {
-            IndexEntryComparison c(Ordering::make(_ordering));
-            cmp = c.compare(entry, IndexKeyEntry(current->keys[i].getBSON(), RecordId(current->keys[i].loc)));
-            if (cmp >= 0) {
-                i++;
-            } else {
-                break;
-            }
-        }
-        child = current->children_array[i];
-        child->_pmutex.lock_shared();
-        current->_pmutex.unlock_shared();
-        current = child;
+    // Sets _locateFoundDataEnd when result is after last entry in tree,
+    // cursor is then on last entry
+bool PmseCursor::lower_bound(StringData query, CursorObject& cursor, std::list<PmseLatch*>& locks) {
+    persistent_ptr<PmseTreeNode> current = _tree->lockLeaf(query);
+    if (!current) {
+        _locateFoundDataEnd = true;
+        cursor.node = nullptr;
+        return false;
     }
-    locks.push_back(&(current->_pmutex));
-    i = 0;
-    IndexEntryComparison c(Ordering::make(_ordering));
+    locks.push_back(&_tree->_index->latch(current));
 
-    while (i < current->num_keys && c.compare(entry, IndexKeyEntry(current->keys[i].getBSON(), RecordId(current->keys[i].loc))) > 0) {
-            i++;
+    uint64_t i = _tree->insertionPosition(current, query);
+    if (i < current->num_keys) {
+        cursor.node = current;
+        cursor.index = i;
+        return true;
     }
     // Iterated to end of node without finding bigger value
-    // It means: return next
-    if (i == current->num_keys) {
-        if (current->next) {
-            cursor.node = current->next;
-            cursor.index = 0;
-            return true;
-        }
-        else{
-            _locateFoundDataEnd = true;
-            return false;
-        }
-    }
+    // It means: return first entry of following leaves
+    cursor.node = current->next;
+    if (cursor.node)
+        lockShared(cursor.node, locks);
+    skipEmpty(cursor, true, locks);
+    if (cursor.node)
+        return true;
+    // Cursor goes to last entry of tree, if there is any
+    _locateFoundDataEnd = true;
     cursor.node = current;
-    cursor.index = i;
-    return true;
+    skipEmpty(cursor, false, locks);
+    return false;
+}
+
+/*
+ * Moves cursor from empty leaves, left by removals until rebalance, to
+ * the nearest entry in given direction. Node becomes null at tree end.
+ */
+void PmseCursor::skipEmpty(CursorObject& cursor, bool forward, std::list<PmseLatch*>& locks) {
+    while (cursor.node && cursor.node->num_keys == 0) {
+        cursor.node = forward ? cursor.node->next : cursor.node->previous;
+        if (cursor.node)
+            lockShared(cursor.node, locks);
+    }
+    if (cursor.node)
+        cursor.index = forward ? 0 : cursor.node->num_keys - 1;
 }
 
 bool PmseCursor::atOrPastEndPointAfterSeeking() {
     if (_isEOF)
         return true;
-    if (!_endState)
-        return false;
-    int cmp;
-    cmp = (_cursor.node->keys[_cursor.index]).getBSON().woCompare(_endState->query.key, _ordering, false);
-    if (cmp == 0) {
-        if ((_cursor.node->keys[_cursor.index]).loc < _endState->query.loc.repr()) {
-            cmp = -1;
-        } else if ((_cursor.node->keys[_cursor.index]).loc > _endState->query.loc.repr()) {
-            cmp = 1;
-            } else {
-                cmp = 0;
-            }
-    }
-    if (_forward) {
-        // We may have landed after the end point.
-        return cmp > 0;
-    } else {
-        // We may have landed before the end point.
-        return cmp < 0;
-    }
+    return atEndPoint();
+}
+
+std::string PmseCursor::makeQuery(const BSONObj& key, KeyString::Discriminator discriminator) {
+    KeyString ks(KeyString::Version::V1, key, _tree->_index->ordering, discriminator);
+    return std::string(ks.getBuffer(), ks.getSize());
 }
 
-void PmseCursor::locate(const BSONObj& key, const RecordId& loc, std::list<pmem::obj::shared_mutex*>& locks) {
+void PmseCursor::locate(StringData query, std::list<PmseLatch*>& locks) {
     bool locateFound;
     CursorObject locateCursor;
     _isEOF = false;
-    const auto query = IndexKeyEntry(key, loc);
     locateFound = lower_bound(query, locateCursor, locks);
     if (_forward) {
         if (_locateFoundDataEnd) {
@@ -146,16 +129,16 @@ void PmseCursor::locate(const BSONObj& key, const RecordId& loc, std::list<pmem:
     } else {  // manage backward
         if (_locateFoundDataEnd) {
             _locateFoundDataEnd = false;
-            _cursor.node = _last;
-            _cursor.index = _last->num_keys-1;
+            _cursor.node = locateCursor.node;
+            _cursor.index = locateCursor.index;
+            if (!_cursor.node) {
+                _isEOF = true;
+                return;
+            }
         } else {
             _cursor.node = locateCursor.node;
             _cursor.index = locateCursor.index;
-            int cmp;
-            IndexEntryComparison c(Ordering::make(_ordering));
-            cmp = c.compare(IndexKeyEntry(_cursor.node->keys[_cursor.index].getBSON(), RecordId(_cursor.node->keys[_cursor.index].loc)), query);
-
-            if (cmp) {
+            if (!_cursor.node->entryEqualsAt(_cursor.index, query)) {
                 moveToNext(locks);
                 if(!_cursor.node) {
                     _isEOF = true;
@@ -168,95 +151,149 @@ void PmseCursor::locate(const BSONObj& key, const RecordId& loc, std::list<pmem:
         _isEOF = true;
 }
 
-void PmseCursor::seekEndCursor() {
-    CursorObject endCursor;
-    bool found;
-
-    if (!_endState || !_tree->_root)
-        return;
-    std::list<pmem::obj::shared_mutex*> locks;
-    found = lower_bound(_endState->query, endCursor, locks);
-    if (_locateFoundDataEnd) {
-        _locateFoundDataEnd = false;
-        endCursor.node = nullptr;
-        unlockTree(locks);
+void PmseCursor::setEndPosition(const BSONObj& key, bool inclusive) {
+    dropBatch();
+    if (key.isEmpty()) {
+        // This means scan to end of index.
+        _endState = boost::none;
         return;
     }
-    if (!_forward) {
-        // lower_bound lands us on or after query. Reverse cursors must be on or before.
-        if ( (endCursor.node == _first) && (endCursor.index == 0) ) {
-            unlockTree(locks);
+
+    _endState = EndState(makeQuery(stripFieldNames(key),
+                                   _forward == inclusive ? KeyString::kExclusiveAfter
+                                                         : KeyString::kExclusiveBefore));
+}
+
+/*
+ * Copies entries following cursor in its leaf while the leaf is latched,
+ * so next() returns them without descending the tree. Leaf to be read
+ * after them is prefetched.
+ *
+ * Duplicates of one key share the leaf prefix, which then holds the whole
+ * key, posting leaf keeps its key once. Prefix differing from end position
+ * decides the end for all entries at once, and entries whose key lies in
+ * prefix are marked to reuse key decoded before, so runs of equal keys
+ * are scanned by RecordId only. Posting leaf is copied in pieces.
+ */
+void PmseCursor::fillBatch() {
+    dropBatch();
+    markPosition();
+    persistent_ptr<PmseTreeNode> node = _cursor.node;
+    const int64_t step = _forward ? 1 : -1;
+    StringData prefix = node->entriesPrefix();
+    bool checkEnd = false;
+    if (_endState) {
+        int cmp = prefix.compare(StringData(_endState->query).substr(0, prefix.size()));
+        if (_forward ? cmp > 0 : cmp < 0) {
+            _batchAtEnd = true;
             return;
         }
-        int cmp;
-            cmp = (endCursor.node->keys[endCursor.index]).getBSON().woCompare(_endState->query.key, _ordering, false);
-            if (cmp == 0) {
-                if ((endCursor.node->keys[endCursor.index]).loc < _endState->query.loc.repr()) {
-                    cmp = -1;
-                } else if ((endCursor.node->keys[endCursor.index]).loc > _endState->query.loc.repr()) {
-                    cmp = 1;
-                } else {
-                    cmp = 0;
-                }
-            }
-        if (cmp > 0) {
-            if (endCursor.index > 0) {
-                endCursor.index--;
-            } else {
-                /*
-                 * Move to prev node - if it exist
-                 */
-                if (endCursor.node->previous != nullptr) {
-                    endCursor.node = endCursor.node->previous;
-                    endCursor.index = endCursor.node->num_keys - 1;
-                } else {
-                    endCursor.node = nullptr;
-                }
+        checkEnd = cmp == 0;
+    }
+    for (int64_t i = _cursor.index + step; i >= 0 && i < static_cast<int64_t>(node->num_keys) &&
+             _batch.size() < MAX_LEAF_SLOTS; i += step) {
+        if (checkEnd) {
+            int cmp = node->compareAt(i, _endState->query);
+            if (_forward ? cmp > 0 : cmp < 0) {
+                _batchAtEnd = true;
+                return;
             }
         }
+        uint64_t keySize = node->keySizeAt(i);
+        StringData typeBits = node->typeBitsAt(i);
+        bool sameKey = !_batch.empty() && keySize <= prefix.size() &&
+            keySize == _batch.back().keySize && typeBits == _batch.back().typeBits;
+        _batch.push_back({node->entryStringAt(i), typeBits.toString(), keySize, sameKey});
     }
-    if ( found ) {
-        _endPosition = IndexKeyEntry(endCursor.node->keys[endCursor.index].getBSON(),
-                                    RecordId(endCursor.node->keys[endCursor.index].loc));
+    persistent_ptr<PmseTreeNode> sibling = _forward ? node->next : node->previous;
+    if (sibling) {
+        const char* data = reinterpret_cast<const char*>(sibling.get());
+        for (uint64_t offset = 0; offset < _tree->_root->nodeSize; offset += CACHE_LINE_SIZE) {
+            __builtin_prefetch(data + offset);
+        }
     }
-    unlockTree(locks);
 }
 
+void PmseCursor::dropBatch() {
+    _batch.clear();
+    _batchPosition = 0;
+    _batchAtEnd = false;
+    _batchKey = BSONObj();
+}
 
-void PmseCursor::setEndPosition(const BSONObj& key, bool inclusive) {
-    if (key.isEmpty()) {
-        // This means scan to end of index.
-        _endState = boost::none;
-        return;
+/* End query sorts between entries, so cursor on entry past it is at end */
+bool PmseCursor::atEndPoint() {
+    if (!_endState)
+        return false;
+    int cmp = _cursor.node->compareAt(_cursor.index, _endState->query);
+    if (_forward) {
+        // We may have landed after the end point.
+        return cmp > 0;
+    } else {
+        // We may have landed before the end point.
+        return cmp < 0;
     }
+}
 
-    _endState = EndState(stripFieldNames(key),
-                         _forward == inclusive ? RecordId::max() : RecordId::min());
-    seekEndCursor();
+/*
+ * Cursor stays on its leaf when no writer unlocked the leaf latch since
+ * the position was taken. Stripes are shared, so unrelated writes only
+ * make this fall back to locate.
+ */
+bool PmseCursor::resume(std::list<PmseLatch*>& locks) {
+    if (!_positioned)
+        return false;
+    PmseLatch& latch = _tree->_index->latch(_cursor.node);
+    latch.lock_shared();
+    if (latch.version() != _leafVersion) {
+        latch.unlock_shared();
+        return false;
+    }
+    locks.push_back(&latch);
+    _isEOF = false;
+    return true;
 }
 
-bool PmseCursor::atEndPoint() {
-    if (_endPosition &&
-        (IndexKeyEntry_PM::compareEntries(_endPosition.get(), _cursor.node->keys[_cursor.index], _ordering) == 0))
-        return true;
-    return false;
+/* Remembers latched leaf under cursor for resume */
+void PmseCursor::markPosition() {
+    _leafVersion = _tree->_index->latch(_cursor.node).version();
+    _positioned = true;
 }
 
 boost::optional<IndexKeyEntry> PmseCursor::next(
                 RequestedInfo parts = kKeyAndLoc) {
-    std::list<pmem::obj::shared_mutex *> locks;
+    if (_batchPosition < _batch.size()) {
+        BatchEntry& batched = _batch[_batchPosition++];
+        bool wantKey = parts & kWantKey;
+        bool reuseKey = wantKey && batched.sameKey && !_batchKey.isEmpty();
+        IndexKeyEntry entry = _tree->_index->decode(batched.entry, batched.typeBits,
+                                                    batched.keySize, wantKey && !reuseKey);
+        if (reuseKey)
+            entry.key = _batchKey;
+        _batchKey = wantKey ? entry.key : BSONObj();
+        _cursorEntry = std::move(batched.entry);
+        _cursor.index += _forward ? 1 : -1;
+        return entry;
+    }
+    if (_batchAtEnd) {
+        dropBatch();
+        _isEOF = true;
+        return {};
+    }
+    std::list<PmseLatch*> locks;
+    PmseEpochs::Guard guard;
 
-    if (_tree->_root == nullptr)
+    if (_tree->isEmpty())
         return {};
-    locate(_cursorKey, RecordId(_cursorId), locks);
-    if (!_cursor.node) {
+    if (!resume(locks)) {
+        locate(_cursorEntry, locks);
+        if (!_cursor.node) {
             unlockTree(locks);
             return boost::none;
+        }
     }
-    IndexEntryComparison c(Ordering::make(_ordering));
-    if ( c.compare(IndexKeyEntry(_cursorKey, RecordId(_cursorId)),
-                    IndexKeyEntry((_cursor.node->keys[_cursor.index]).getBSON(),
-                                    RecordId((_cursor.node->keys[_cursor.index]).loc))) == 0)
+    _positioned = false;  // cursor moves, marked again with returned entry
+    if (_cursor.node->entryEqualsAt(_cursor.index, _cursorEntry))
         moveToNext(locks);
     if (!_cursor.node) {
         unlockTree(locks);
@@ -269,19 +306,18 @@ boost::optional<IndexKeyEntry> PmseCursor::next(
         return {};
     }
     if (_cursor.node.raw_ptr()->off != 0) {
-            _cursorKey = _cursor.node->keys[_cursor.index].getBSON();
-            _cursorId = _cursor.node->keys[_cursor.index].loc;
+            _cursorEntry = _cursor.node->entryStringAt(_cursor.index);
             // remember next value
         } else {
             _eofRestore = true;
         }
-    IndexKeyEntry entry((_cursor.node->keys[_cursor.index]).getBSON(),
-                        RecordId((_cursor.node->keys[_cursor.index]).loc));
+    IndexKeyEntry entry = _tree->_index->entryAt(*_cursor.node, _cursor.index, parts & kWantKey);
+    fillBatch();
     unlockTree(locks);
     return entry;
 }
 
-void PmseCursor::moveToNext(std::list<pmem::obj::shared_mutex*>& locks) {
+void PmseCursor::moveToNext(std::list<PmseLatch*>& locks) {
     persistent_ptr<PmseTreeNode> node;
     if (_forward) {
         /*
@@ -295,10 +331,9 @@ void PmseCursor::moveToNext(std::list<pmem::obj::shared_mutex*>& locks) {
              */
             if (_cursor.node->next != nullptr) {
                 node = _cursor.node->next;
-                node->_pmutex.lock_shared();
-                locks.push_back(&(node->_pmutex));
-                _cursor.node = _cursor.node->next;
-                _cursor.index = 0;
+                lockShared(node, locks);
+                _cursor.node = node;
+                skipEmpty(_cursor, true, locks);
             } else {
                 _cursor.node = nullptr;
             }
@@ -315,10 +350,9 @@ void PmseCursor::moveToNext(std::list<pmem::obj::shared_mutex*>& locks) {
              */
             if (_cursor.node->previous != nullptr) {
                 node = _cursor.node->previous;
-                node->_pmutex.lock_shared();
-                locks.push_back(&(node->_pmutex));
-                _cursor.node = _cursor.node->previous;
-                _cursor.index = _cursor.node->num_keys - 1;
+                lockShared(node, locks);
+                _cursor.node = node;
+                skipEmpty(_cursor, false, locks);
             } else {
                 _cursor.node = nullptr;
             }
@@ -326,8 +360,14 @@ void PmseCursor::moveToNext(std::list<pmem::obj::shared_mutex*>& locks) {
     }
 }
 
-void PmseCursor::unlockTree(std::list<pmem::obj::shared_mutex*>& locks) {
-    std::list<pmem::obj::shared_mutex*>::const_iterator iterator;
+void PmseCursor::lockShared(persistent_ptr<PmseTreeNode> node, std::list<PmseLatch*>& locks) {
+    PmseLatch& latch = _tree->_index->latch(node);
+    latch.lock_shared();
+    locks.push_back(&latch);
+}
+
+void PmseCursor::unlockTree(std::list<PmseLatch*>& locks) {
+    std::list<PmseLatch*>::const_iterator iterator;
     try {
         for (iterator = locks.begin(); iterator != locks.end(); ++iterator) {
             (*iterator)->unlock_shared();
@@ -339,51 +379,66 @@ void PmseCursor::unlockTree(std::list<pmem::obj::shared_mutex*>& locks) {
 boost::optional<IndexKeyEntry> PmseCursor::seek(const BSONObj& key,
                                                 bool inclusive,
                                                 RequestedInfo parts = kKeyAndLoc) {
-    if (!_tree->_root)
+    dropBatch();
+    _positioned = false;
+    PmseEpochs::Guard guard;
+    if (_tree->isEmpty())
         return {};
-    std::list<pmem::obj::shared_mutex*> locks;
+    std::list<PmseLatch*> locks;
 
     if (key.isEmpty()) {
+        _cursor.node = _tree->lockEnd(!inclusive);
+        if (!_cursor.node)
+            return {};
+        locks.push_back(&_tree->_index->latch(_cursor.node));
         if (inclusive) {
-            _cursor.node = _first;
-            _cursor.index = 0;
+            skipEmpty(_cursor, true, locks);
+            if (!_cursor.node) {
+                unlockTree(locks);
+                return {};
+            }
         } else {
-            _cursor.node = _last;
             _cursor.index = (_cursor.node)->num_keys - 1;
+            unlockTree(locks);
             return {};
         }
     } else {
-        const BSONObj query = stripFieldNames(key);
-        locate(query, _forward == inclusive ? RecordId::min() : RecordId::max(), locks);
+        locate(makeQuery(stripFieldNames(key),
+                         _forward == inclusive ? KeyString::kExclusiveBefore
+                                               : KeyString::kExclusiveAfter),
+               locks);
         if (_isEOF) {
             unlockTree(locks);
             return {};
         }
     }
     if (_cursor.node.raw_ptr()->off != 0) {
-        _cursorKey = _cursor.node->keys[_cursor.index].getBSON();
-        _cursorId = _cursor.node->keys[_cursor.index].loc;
+        _cursorEntry = _cursor.node->entryStringAt(_cursor.index);
         // remember next value
     } else {
         _eofRestore = true;
         unlockTree(locks);
         return {};
     }
-    IndexKeyEntry entry((_cursor.node->keys[_cursor.index]).getBSON(),
-                        RecordId((_cursor.node->keys[_cursor.index]).loc));
+    IndexKeyEntry entry = _tree->_index->entryAt(*_cursor.node, _cursor.index, parts & kWantKey);
+    fillBatch();
     unlockTree(locks);
     return entry;
 }
 
 boost::optional<IndexKeyEntry> PmseCursor::seek(const IndexSeekPoint& seekPoint,
                                                 RequestedInfo parts = kKeyAndLoc) {
-    if (!_tree->_root)
+    dropBatch();
+    _positioned = false;
+    PmseEpochs::Guard guard;
+    if (_tree->isEmpty())
         return {};
 
+    /* makeQueryObject handles exclusive fields, discriminator covers the rest */
     const BSONObj query = IndexEntryComparison::makeQueryObject(seekPoint, _forward);
-    auto discriminator = RecordId::min();
-    std::list<pmem::obj::shared_mutex*> locks;
-    locate(query, _forward ? RecordId::min() : RecordId::max(), locks);
+    std::list<PmseLatch*> locks;
+    locate(makeQuery(query, _forward ? KeyString::kExclusiveBefore : KeyString::kExclusiveAfter),
+           locks);
 
     if (_isEOF) {
         unlockTree(locks);
@@ -391,40 +446,150 @@ boost::optional<IndexKeyEntry> PmseCursor::seek(const IndexSeekPoint& seekPoint,
     }
 
     if (_cursor.node.raw_ptr()->off != 0) {
-        _cursorKey = _cursor.node->keys[_cursor.index].getBSON();
-        _cursorId = _cursor.node->keys[_cursor.index].loc;
+        _cursorEntry = _cursor.node->entryStringAt(_cursor.index);
         // remember next value
     } else {
         _eofRestore = true;
         unlockTree(locks);
         return {};
     }
-    IndexKeyEntry entry((_cursor.node->keys[_cursor.index]).getBSON(),
-                        RecordId((_cursor.node->keys[_cursor.index]).loc));
+    IndexKeyEntry entry = _tree->_index->entryAt(*_cursor.node, _cursor.index, parts & kWantKey);
+    fillBatch();
     unlockTree(locks);
     return entry;
 }
 
+/*
+ * Leaf where key would start is checked using fingerprints only.
+ * Full seek is needed only when matching entries begin in neighbour leaf.
+ */
 boost::optional<IndexKeyEntry> PmseCursor::seekExact(
                 const BSONObj& key, RequestedInfo parts = kKeyAndLoc) {
+    dropBatch();
+    _positioned = false;
+    {
+        PmseEpochs::Guard guard;
+        if (_tree->isEmpty())
+            return {};
+        const BSONObj query = stripFieldNames(key);
+        const std::string exact = makeQuery(query, KeyString::kInclusive);
+        if (_tree->hasHashTable())
+            return seekInHashTable(exact, parts);
+        std::list<PmseLatch*> locks;
+        persistent_ptr<PmseTreeNode> leaf = _tree->lockLeaf(
+            makeQuery(query, _forward ? KeyString::kExclusiveBefore : KeyString::kExclusiveAfter));
+        if (!leaf)
+            return {};
+        locks.push_back(&_tree->_index->latch(leaf));
+
+        /*
+         * Matching slot with lowest position for forward, highest for
+         * backward cursor. Posting leaf of the key matches at its end.
+         */
+        int64_t found = -1;
+        if (leaf->posting && leaf->keyEqualsAt(0, exact))
+            found = _forward ? 0 : leaf->num_keys - 1;
+        uint64_t candidates = PmseTree::matchFingerprints(leaf, _tree->_index->fingerprint(exact));
+        for (; candidates; candidates &= candidates - 1) {
+            uint64_t slot = countTrailingZeros64(candidates);
+            if (leaf->keyEquals(leaf->keys()[slot], exact)) {
+                int64_t position = leaf->positionOf(slot);
+                if (found < 0 || (_forward ? position < found : position > found))
+                    found = position;
+            }
+        }
+        if (found >= 0) {
+            _isEOF = false;
+            _cursor.node = leaf;
+            _cursor.index = found;
+            if (atOrPastEndPointAfterSeeking()) {
+                _isEOF = true;
+                unlockTree(locks);
+                return {};
+            }
+            _cursorEntry = leaf->entryStringAt(found);
+            markPosition();
+            IndexKeyEntry entry = _tree->_index->entryAt(*leaf, found, parts & kWantKey);
+            unlockTree(locks);
+            return entry;
+        }
+
+        persistent_ptr<PmseTreeNode> neighbour = _forward ? leaf->next : leaf->previous;
+        bool inNeighbour = false;
+        if (neighbour) {
+            lockShared(neighbour, locks);
+            /* Empty neighbour tells nothing, full seek steps over it */
+            uint64_t index = _forward ? 0 : neighbour->num_keys - 1;
+            inNeighbour = neighbour->num_keys == 0 ||
+                neighbour->keyEqualsAt(index, exact);
+        }
+        unlockTree(locks);
+        if (!inNeighbour) {
+            _isEOF = true;
+            return boost::none;
+        }
+    }
     auto kv = seek(key, true, kKeyAndLoc);
     if (kv && kv->key.woCompare(key, BSONObj(), false) == 0)
         return kv;
     return boost::none;
 }
 
+/*
+ * Matching entry comes from hash table without descending the tree.
+ * Cursor is left unpositioned on it, so next() locates it in the tree.
+ */
+boost::optional<IndexKeyEntry> PmseCursor::seekInHashTable(const std::string& exact,
+                                                           RequestedInfo parts) {
+    std::string typeBits;
+    if (!_tree->findEqual(exact, _forward, &_cursorEntry, &typeBits)) {
+        _isEOF = true;
+        return boost::none;
+    }
+    if (_endState) {
+        int cmp = StringData(_cursorEntry).compare(_endState->query);
+        if (_forward ? cmp > 0 : cmp < 0) {
+            _isEOF = true;
+            return boost::none;
+        }
+    }
+    _isEOF = false;
+    return _tree->_index->decode(_cursorEntry, typeBits, exact.size(), parts & kWantKey);
+}
+
 void PmseCursor::save() {}
 
-void PmseCursor::saveUnpositioned() {}
+void PmseCursor::saveUnpositioned() {
+    dropBatch();
+    _positioned = false;
+}
 
+/*
+ * Position and batch stay valid while leaf latch version is unchanged,
+ * otherwise next() locates saved entry from the root.
+ */
 void PmseCursor::restore() {
-    seekEndCursor();
-    if (_eofRestore)
-        return;
+    if (_positioned && _tree->_index->latch(_cursor.node).version() != _leafVersion) {
+        dropBatch();
+        _positioned = false;
+    }
 }
 
 void PmseCursor::detachFromOperationContext() {}
 
 void PmseCursor::reattachToOperationContext(OperationContext* opCtx) {}
 
+PmseRandomCursor::PmseRandomCursor(PmseTree* tree, PmsePoolPin pin)
+    : _tree(tree), _pin(pin), _random(static_cast<int64_t>(curTimeMicros64())) {}
+
+boost::optional<IndexKeyEntry> PmseRandomCursor::next(RequestedInfo parts) {
+    uint64_t entries = _tree->numEntries();
+    if (entries == 0)
+        return boost::none;
+    auto entry = _tree->entryAtRank(_random.nextInt64(entries));
+    if (entry && !(parts & kWantKey))
+        entry->key = BSONObj();
+    return entry;
+}
+
 }  // namespace mongo
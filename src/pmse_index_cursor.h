@@ -36,8 +36,14 @@
 #include "mongo/db/storage/sorted_data_interface.h"
 #include "mongo/db/storage/key_string.h"
 
+#include "pmse_pool_manager.h"
 #include "pmse_tree.h"
 
+#include <string>
+#include <vector>
+
+#include "mongo/platform/random.h"
+
 #define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
 
 using namespace pmem::obj;
@@ -47,8 +53,8 @@ namespace mongo {
 class PmseCursor final : public SortedDataInterface::Cursor {
  public:
     PmseCursor(OperationContext* txn, bool isForward,
-               persistent_ptr<PmseTree> tree, const BSONObj& ordering,
-               const bool unique);
+               PmseTree* tree, const BSONObj& ordering,
+               const bool unique, PmsePoolPin pin);
 
     void setEndPosition(const BSONObj& key, bool inclusive);
 
@@ -77,6 +83,7 @@ class PmseCursor final : public SortedDataInterface::Cursor {
     boost::optional<IndexKeyEntry> seekInTree(IndexKeyEntry& key,
                                               KeyString::Discriminator discriminator,
                                               RequestedInfo parts);
+    boost::optional<IndexKeyEntry> seekInHashTable(const std::string& exact, RequestedInfo parts);
     bool hasFieldNames(const BSONObj& obj) {
         BSONForEach(e, obj) {
             if (e.fieldName()[0])
@@ -95,35 +102,89 @@ class PmseCursor final : public SortedDataInterface::Cursor {
         }
         return bb.obj();
     }
-    void locate(const BSONObj& key, const RecordId& loc, std::list<pmem::obj::shared_mutex*>& locks);
-    void unlockTree(std::list<pmem::obj::shared_mutex*>& locks);
-    void seekEndCursor();
-    bool lower_bound(IndexKeyEntry entry, CursorObject& cursor, std::list<pmem::obj::shared_mutex*>& locks);
-    void moveToNext(std::list<pmem::obj::shared_mutex*>& locks);
+    /* KeyString of query, discriminator puts it before or after entries with equal key */
+    std::string makeQuery(const BSONObj& key, KeyString::Discriminator discriminator);
+    void locate(StringData query, std::list<PmseLatch*>& locks);
+    void unlockTree(std::list<PmseLatch*>& locks);
+    void lockShared(persistent_ptr<PmseTreeNode> node, std::list<PmseLatch*>& locks);
+    bool lower_bound(StringData query, CursorObject& cursor, std::list<PmseLatch*>& locks);
+    void moveToNext(std::list<PmseLatch*>& locks);
+    void skipEmpty(CursorObject& cursor, bool forward, std::list<PmseLatch*>& locks);
     bool atOrPastEndPointAfterSeeking();
     bool atEndPoint();
+    bool resume(std::list<PmseLatch*>& locks);
+    void markPosition();
+    void fillBatch();
+    void dropBatch();
     const bool _forward;
     const BSONObj& _ordering;
-    persistent_ptr<PmseTreeNode> _first;
-    persistent_ptr<PmseTreeNode> _last;
-    persistent_ptr<PmseTree> _tree;
+    PmsePoolPin _pin;
+    PmseTree* _tree;
     bool _isEOF = true;
-    /*
-     * Cursor used for iterating with next until "_endPosition"
-     */
-    boost::optional<IndexKeyEntry> _endPosition;
     CursorObject _cursor;
+    uint64_t _leafVersion = 0;  // latch version of _cursor leaf when position was taken
+    bool _positioned = false;  // _cursor is on _cursorEntry as of _leafVersion
 
     struct EndState {
-        EndState(BSONObj key, RecordId loc) : query(std::move(key), loc) {}
-        IndexKeyEntry query;
+        explicit EndState(std::string query) : query(std::move(query)) {}
+        std::string query;
     };
     boost::optional<EndState> _endState;
-    BSONObj _cursorKey;
-    int64_t _cursorId;
+    std::string _cursorEntry;  // entry returned last, cursor is repositioned after it
+
+    /* Entry copied from leaf, decoded when returned */
+    struct BatchEntry {
+        std::string entry;  // KeyString with RecordId
+        std::string typeBits;  // empty when all zero
+        uint64_t keySize;
+        bool sameKey;  // key equals key of batch entry before, known from leaf prefix
+    };
+    std::vector<BatchEntry> _batch;  // entries following _cursorEntry in its leaf
+    size_t _batchPosition = 0;
+    BSONObj _batchKey;  // key decoded for last batch entry, shared by run of equal keys
+    bool _batchAtEnd = false;  // batch stopped at end position
     bool _locateFoundDataEnd;
     bool _eofRestore;
 };
+/*
+ * Cursor returning index entries in random order, for sampling. Each
+ * entry is taken at uniform rank, which subtree counts of inner nodes
+ * find in one descent. Entries may repeat, seeks only draw next one.
+ */
+class PmseRandomCursor final : public SortedDataInterface::Cursor {
+ public:
+    PmseRandomCursor(PmseTree* tree, PmsePoolPin pin);
+
+    void setEndPosition(const BSONObj& key, bool inclusive) {}
+
+    virtual boost::optional<IndexKeyEntry> next(RequestedInfo parts);
+
+    boost::optional<IndexKeyEntry> seek(const BSONObj& key, bool inclusive,
+                                        RequestedInfo parts) {
+        return next(parts);
+    }
+
+    boost::optional<IndexKeyEntry> seek(const IndexSeekPoint& seekPoint,
+                                        RequestedInfo parts) {
+        return next(parts);
+    }
+
+    void save() {}
+
+    void saveUnpositioned() {}
+
+    void restore() {}
+
+    void detachFromOperationContext() {}
+
+    void reattachToOperationContext(OperationContext* opCtx) {}
+
+ private:
+    PmseTree* _tree;
+    PmsePoolPin _pin;
+    PseudoRandom _random;
+};
+
 }  // namespace mongo
 
 #endif  // SRC_PMSE_INDEX_CURSOR_H_
@@ -33,6 +33,7 @@
 #define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
 
 #include "pmse_engine.h"
+#include "pmse_sorted_data_interface.h"
 
 #include <string>
 
@@ -73,6 +74,10 @@ class PmseEngineFactory : public StorageEngine::Factory {
         return Status::OK();
     }
 
+    virtual Status validateIndexStorageOptions(const BSONObj& options) const {
+        return PmseSortedDataInterface::validateStorageOptions(options);
+    }
+
     virtual BSONObj createMetadataOptions(const StorageGlobalParams& params) const {
         // TODO( ): Implement createMetadataOptions
         return BSONObj();
@@ -115,6 +115,19 @@ TEST_F(PmseEngineFactoryTest, ValidateMetadataDirectoryPerDB) {
                             false, ErrorCodes::OK);
 }
 
+TEST_F(PmseEngineFactoryTest, ValidateIndexStorageOptionsNodeSize) {
+    ASSERT_OK(factory->validateIndexStorageOptions(fromjson("{nodeSize: 256}")));
+    ASSERT_OK(factory->validateIndexStorageOptions(fromjson("{nodeSize: 2048}")));
+    ASSERT_EQUALS(ErrorCodes::InvalidOptions,
+                  factory->validateIndexStorageOptions(fromjson("{nodeSize: 1}")));
+    ASSERT_EQUALS(ErrorCodes::InvalidOptions,
+                  factory->validateIndexStorageOptions(fromjson("{nodeSize: 300}")));
+    ASSERT_EQUALS(ErrorCodes::InvalidOptions,
+                  factory->validateIndexStorageOptions(fromjson("{nodeSize: 4096}")));
+    ASSERT_EQUALS(ErrorCodes::InvalidOptions,
+                  factory->validateIndexStorageOptions(fromjson("{nodeSize: 'big'}")));
+}
+
 void _testCreateMetadataOptions(const StorageEngine::Factory* factory,
                                 bool directoryPerDB, bool directoryForIndexes) {
     StorageGlobalParams storageOptions;
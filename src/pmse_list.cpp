@@ -143,12 +143,13 @@ void PmseList::clear() {
     if (!head)
         return;
     transaction::exec_tx(pool_obj, [this] {
-        for (auto rec = head; rec != nullptr; rec = rec->next) {
+        for (auto rec = head; rec != nullptr;) {
             auto temp = rec->next;
             pmemobj_tx_free(rec.raw());
             rec = temp;
         }
         head = nullptr;
+        tail = nullptr;
     });
 }
 
@@ -53,6 +53,7 @@ struct _values {
     char value[256];
 };
 struct ListRoot;
+class PmseIdentCatalog;
 
 class PmseList {
  public:
@@ -85,7 +86,8 @@ class PmseList {
 };
 
 struct ListRoot {
-    persistent_ptr<PmseList> list_root_ptr;
+    persistent_ptr<PmseList> list_root_ptr;  // catalog of older versions, migrated on open
+    persistent_ptr<PmseIdentCatalog> catalog_root_ptr;
 };
 
 }  // namespace mongo
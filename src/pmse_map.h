@@ -174,6 +174,11 @@ class PmseMap {
         delete_persistent<pmem::obj::mutex[]>(_listMutex, _size);
     }
 
+    /* Ids handed out so far are at most this */
+    uint64_t maxId() const {
+        return _counter.load();
+    }
+
     uint64_t fillment() {
         if (_isCapped)
             return _list[0].size();
@@ -325,6 +330,7 @@ class PmseMap {
 
 struct root {
     persistent_ptr<PmseMap<InitData>> kvmap_root_ptr;
+    p<uint64_t> partitions;  // 0 in pools created before partitioning, means 1
 };
 }  // namespace mongo
 #endif  // SRC_PMSE_MAP_H_
@@ -0,0 +1,268 @@
+/*
+ * Copyright 2014-2020, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
+
+#include "pmse_pool_manager.h"
+
+#include <libpmemobj.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "mongo/util/log.h"
+#include "mongo/util/time_support.h"
+
+namespace mongo {
+
+PmsePoolPin::PmsePoolPin(std::shared_ptr<PmsePoolEntry> entry) {
+    if (!entry)
+        return;
+    stdx::lock_guard<stdx::mutex> lock(entry->mutex);
+    if (entry->dropped) {
+        throw std::runtime_error("Pool " + entry->path + " was dropped");
+    }
+    if (!entry->open) {
+        PMEMobjpool* pop = pmemobj_open(entry->path.c_str(),
+                                        entry->layout.empty() ? nullptr : entry->layout.c_str());
+        if (!pop) {
+            throw std::runtime_error("Cannot reopen pool " + entry->path + ": " + pmemobj_errormsg());
+        }
+        entry->pop = pool_base(pop);
+        if (entry->onReopen) {
+            entry->onReopen(entry->pop);
+        }
+        entry->open = true;
+    }
+    entry->pins++;
+    _entry = std::move(entry);
+}
+
+void PmsePoolPin::release() {
+    if (!_entry)
+        return;
+    stdx::lock_guard<stdx::mutex> lock(_entry->mutex);
+    _entry->pins--;
+    _entry->lastUsed = curTimeMillis64();
+    /* Pool dropped while pinned is closed by its last user */
+    if (_entry->dropped && _entry->pins == 0 && _entry->open) {
+        _entry->pop.close();
+        _entry->open = false;
+    }
+    _entry.reset();
+}
+
+bool PmsePoolManager::contains(const std::string& ident) const {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    return _entries.count(ident) > 0;
+}
+
+void PmsePoolManager::add(const std::string& ident, pool_base pop,
+                          const std::string& path, const std::string& layout) {
+    auto entry = std::make_shared<PmsePoolEntry>();
+    entry->path = path;
+    entry->layout = layout;
+    entry->pop = pop;
+    entry->lastUsed = curTimeMillis64();
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    _entries[ident] = entry;
+}
+
+std::shared_ptr<PmsePoolEntry> PmsePoolManager::entry(const std::string& ident) const {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    auto it = _entries.find(ident);
+    return it == _entries.end() ? nullptr : it->second;
+}
+
+PmsePoolPin PmsePoolManager::pin(const std::string& ident) const {
+    auto found = entry(ident);
+    if (!found) {
+        throw std::runtime_error("Unknown pool " + ident);
+    }
+    return PmsePoolPin(found);
+}
+
+void PmsePoolManager::setReopenHook(const std::string& ident,
+                                    std::function<void(pool_base&)> hook) {
+    auto found = entry(ident);
+    if (found) {
+        stdx::lock_guard<stdx::mutex> lock(found->mutex);
+        found->onReopen = std::move(hook);
+    }
+}
+
+void PmsePoolManager::remove(const std::string& ident) {
+    std::shared_ptr<PmsePoolEntry> found;
+    {
+        stdx::lock_guard<stdx::mutex> lock(_mutex);
+        auto it = _entries.find(ident);
+        if (it == _entries.end())
+            return;
+        found = it->second;
+        _entries.erase(it);
+    }
+    /*
+     * Background maintenance pins pool without collection locks, so it may
+     * still be inside a transaction. Then the last pin closes the pool.
+     */
+    stdx::lock_guard<stdx::mutex> lock(found->mutex);
+    found->dropped = true;
+    if (found->open && found->pins == 0) {
+        found->pop.close();
+        found->open = false;
+    }
+}
+
+void PmsePoolManager::closeAll() {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    for (auto& it : _entries) {
+        stdx::lock_guard<stdx::mutex> entryLock(it.second->mutex);
+        if (it.second->open) {
+            it.second->pop.close();
+            it.second->open = false;
+        }
+    }
+    _entries.clear();
+}
+
+size_t PmsePoolManager::closeIdle(unsigned long long idleMillis) {
+    std::vector<std::shared_ptr<PmsePoolEntry>> entries;
+    {
+        stdx::lock_guard<stdx::mutex> lock(_mutex);
+        for (auto& it : _entries) {
+            entries.push_back(it.second);
+        }
+    }
+    size_t closed = 0;
+    auto now = curTimeMillis64();
+    for (auto& entry : entries) {
+        stdx::lock_guard<stdx::mutex> lock(entry->mutex);
+        if (entry->open && !entry->dropped && entry->pins == 0 &&
+            now - std::min(now, entry->lastUsed) >= idleMillis) {
+            entry->pop.close();
+            entry->open = false;
+            closed++;
+        }
+    }
+    return closed;
+}
+
+void PmsePoolManager::runMaintenance() {
+    std::vector<std::shared_ptr<PmsePoolEntry>> entries;
+    {
+        stdx::lock_guard<stdx::mutex> lock(_mutex);
+        for (auto& it : _entries) {
+            entries.push_back(it.second);
+        }
+    }
+    for (auto& entry : entries) {
+        std::function<void(const std::shared_ptr<PmsePoolEntry>&)> maintenance;
+        {
+            stdx::lock_guard<stdx::mutex> lock(entry->mutex);
+            if (!entry->open || entry->dropped)
+                continue;
+            maintenance = entry->maintenance;
+        }
+        if (!maintenance)
+            continue;
+        try {
+            maintenance(entry);
+        } catch (std::exception& e) {
+            log() << "Maintenance of pool " << entry->path << " failed: " << e.what();
+        }
+    }
+}
+
+size_t PmsePoolManager::size() const {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    return _entries.size();
+}
+
+size_t PmsePoolManager::openCount() const {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    size_t count = 0;
+    for (auto& it : _entries) {
+        stdx::lock_guard<stdx::mutex> entryLock(it.second->mutex);
+        count += it.second->open ? 1 : 0;
+    }
+    return count;
+}
+
+PmseIdlePoolCloser::PmseIdlePoolCloser(PmsePoolManager* manager, int idleSeconds)
+    : BackgroundJob(false), _manager(manager), _idleMillis(idleSeconds * 1000ULL) {}
+
+void PmseIdlePoolCloser::run() {
+    auto interval = Milliseconds(static_cast<long long>(std::max(1000ULL, _idleMillis / 2)));
+    stdx::unique_lock<stdx::mutex> lock(_mutex);
+    while (!_shutdown) {
+        _cond.wait_for(lock, interval.toSystemDuration());
+        if (_shutdown)
+            break;
+        lock.unlock();
+        size_t closed = _manager->closeIdle(_idleMillis);
+        if (closed) {
+            LOG(1) << "Closed " << closed << " idle pools";
+        }
+        lock.lock();
+    }
+}
+
+void PmseIdlePoolCloser::shutdown() {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    _shutdown = true;
+    _cond.notify_one();
+}
+
+PmsePoolMaintenance::PmsePoolMaintenance(PmsePoolManager* manager, int intervalSeconds)
+    : BackgroundJob(false), _manager(manager), _intervalSeconds(intervalSeconds) {}
+
+void PmsePoolMaintenance::run() {
+    stdx::unique_lock<stdx::mutex> lock(_mutex);
+    while (!_shutdown) {
+        _cond.wait_for(lock, Seconds(_intervalSeconds).toSystemDuration());
+        if (_shutdown)
+            break;
+        lock.unlock();
+        _manager->runMaintenance();
+        lock.lock();
+    }
+}
+
+void PmsePoolMaintenance::shutdown() {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    _shutdown = true;
+    _cond.notify_one();
+}
+
+}  // namespace mongo
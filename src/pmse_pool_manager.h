@@ -0,0 +1,228 @@
+/*
+ * Copyright 2014-2020, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_PMSE_POOL_MANAGER_H_
+#define SRC_PMSE_POOL_MANAGER_H_
+
+#include <libpmemobj.h>
+#include <libpmemobj++/pool.hpp>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mongo/stdx/condition_variable.h"
+#include "mongo/stdx/mutex.h"
+#include "mongo/util/background.h"
+
+using namespace pmem::obj;
+
+namespace mongo {
+
+/*
+ * Sizes of pools created for collections and indexes, smaller ones are
+ * used for system collections. Spare pools are created with the default.
+ */
+const size_t RECORD_STORE_POOL_SIZE = 300 * PMEMOBJ_MIN_POOL;
+const size_t SYSTEM_RECORD_STORE_POOL_SIZE = 10 * PMEMOBJ_MIN_POOL;
+const size_t INDEX_POOL_SIZE = 30 * PMEMOBJ_MIN_POOL;
+const size_t SYSTEM_INDEX_POOL_SIZE = 10 * PMEMOBJ_MIN_POOL;
+
+/*
+ * State of one pool file. Pool may be closed only while nobody pins it,
+ * it is reopened transparently by the next pin.
+ */
+struct PmsePoolEntry {
+    std::string path;
+    std::string layout;
+    pool_base pop;
+    bool open = true;
+    bool dropped = false;
+    uint64_t pins = 0;
+    unsigned long long lastUsed = 0;
+    std::function<void(pool_base&)> onReopen;
+    std::shared_ptr<void> volatileState;  // DRAM structures built over pool content
+    /*
+     * Background work on pool content, run by PmsePoolMaintenance while
+     * pool is open. It pins pool itself, only when it has work to do.
+     */
+    std::function<void(const std::shared_ptr<PmsePoolEntry>&)> maintenance;
+    stdx::mutex mutex;
+};
+
+/*
+ * Keeps pool open as long as it exists. Everything pointing into pool
+ * (persistent_ptrs, RecordData, pmem locks) may be used only while pinned.
+ */
+class PmsePoolPin {
+ public:
+    PmsePoolPin() = default;
+
+    explicit PmsePoolPin(std::shared_ptr<PmsePoolEntry> entry);
+
+    PmsePoolPin(const PmsePoolPin& other) : PmsePoolPin(other._entry) {}
+
+    PmsePoolPin& operator=(PmsePoolPin other) {
+        std::swap(_entry, other._entry);
+        return *this;
+    }
+
+    ~PmsePoolPin() {
+        release();
+    }
+
+    pool_base pool() const {
+        return _entry->pop;
+    }
+
+    const PmsePoolEntry* entry() const {
+        return _entry.get();
+    }
+
+ private:
+    void release();
+
+    std::shared_ptr<PmsePoolEntry> _entry;
+};
+
+/*
+ * Owns handles of all opened pools (ident -> pool). Pools not pinned for
+ * given time can be closed with closeIdle(), which bounds number of mappings
+ * on instances with many rarely used collections and indexes.
+ */
+class PmsePoolManager {
+ public:
+    PmsePoolManager() = default;
+
+    bool contains(const std::string& ident) const;
+
+    /*
+     * Registers already opened pool. Empty layout means layout is not
+     * checked when pool is reopened.
+     */
+    void add(const std::string& ident, pool_base pop,
+             const std::string& path, const std::string& layout);
+
+    /*
+     * Returns entry of ident or nullptr. Entry may be cached by caller and
+     * pinned without looking it up again.
+     */
+    std::shared_ptr<PmsePoolEntry> entry(const std::string& ident) const;
+
+    /*
+     * Pins pool of ident, reopening it if needed. Throws if ident is unknown.
+     */
+    PmsePoolPin pin(const std::string& ident) const;
+
+    /*
+     * Hook called after pool is reopened, before anybody else can use it.
+     * Used to refresh volatile state kept in pool.
+     */
+    void setReopenHook(const std::string& ident, std::function<void(pool_base&)> hook);
+
+    /*
+     * Forgets pool, used when ident is dropped. Pool is closed at once,
+     * or when the last pin is released if it is still pinned. File may be
+     * removed meanwhile, mapping stays valid until close.
+     */
+    void remove(const std::string& ident);
+
+    void closeAll();
+
+    /*
+     * Closes pools which were not pinned for idleMillis. Returns number of
+     * closed pools.
+     */
+    size_t closeIdle(unsigned long long idleMillis);
+
+    /* Runs maintenance of open pools which have it */
+    void runMaintenance();
+
+    size_t size() const;
+
+    size_t openCount() const;
+
+ private:
+    mutable stdx::mutex _mutex;
+    std::map<std::string, std::shared_ptr<PmsePoolEntry>> _entries;
+};
+
+/*
+ * Background job periodically closing idle pools of the engine.
+ */
+class PmseIdlePoolCloser : public BackgroundJob {
+ public:
+    PmseIdlePoolCloser(PmsePoolManager* manager, int idleSeconds);
+
+    std::string name() const {
+        return "PmseIdlePoolCloser";
+    }
+
+    void run();
+
+    void shutdown();
+
+ private:
+    PmsePoolManager* _manager;
+    const unsigned long long _idleMillis;
+    stdx::mutex _mutex;
+    stdx::condition_variable _cond;
+    bool _shutdown = false;
+};
+
+/*
+ * Background job periodically running maintenance of pools.
+ */
+class PmsePoolMaintenance : public BackgroundJob {
+ public:
+    PmsePoolMaintenance(PmsePoolManager* manager, int intervalSeconds);
+
+    std::string name() const {
+        return "PmsePoolMaintenance";
+    }
+
+    void run();
+
+    void shutdown();
+
+ private:
+    PmsePoolManager* _manager;
+    const long long _intervalSeconds;
+    stdx::mutex _mutex;
+    stdx::condition_variable _cond;
+    bool _shutdown = false;
+};
+
+}  // namespace mongo
+#endif  // SRC_PMSE_POOL_MANAGER_H_
@@ -34,6 +34,7 @@
 
 #include "pmse_change.h"
 #include "pmse_record_store.h"
+#include "pmse_server_parameters.h"
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/operations.hpp>
@@ -41,10 +42,14 @@
 #include <libpmemobj++/mutex.hpp>
 #include <libpmemobj++/transaction.hpp>
 
+#include <boost/algorithm/string.hpp>
+
+#include <algorithm>
 #include <cstdlib>
 #include <map>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "mongo/db/storage/record_store.h"
 #include "mongo/util/log.h"
@@ -59,14 +64,12 @@ PmseRecordStore::PmseRecordStore(StringData ns,
                                  StringData ident,
                                  const CollectionOptions& options,
                                  StringData dbpath,
-                                 std::map<std::string, pool_base> *pool_handler,
+                                 PmsePoolManager *pool_handler,
                                  bool recoveryNeeded)
     : RecordStore(ns), _cappedCallback(nullptr),
       _options(options), _dbPath(dbpath) {
     log() << "ns: " << ns;
-    if (pool_handler->count(ident.toString()) > 0) {
-        _mapPool = pool<root>((*pool_handler)[ident.toString()]);
-    } else {
+    if (!pool_handler->contains(ident.toString())) {
         std::string filepath = _dbPath.toString() + ident.toString();
         boost::filesystem::path path;
         log() << filepath;
@@ -76,51 +79,226 @@ PmseRecordStore::PmseRecordStore(StringData ns,
             boost::filesystem::remove_all(filepath);
         }
         std::string mapper_filename = _dbPath.toString() + ident.toString();
+        pool<root> mapPool;
         if (!boost::filesystem::exists(mapper_filename.c_str())) {
             try {
-                _mapPool = pool<root>::create(mapper_filename, "pmse_mapper",
-                                              (isSystemCollection(ns) ? 10 : 300)
-                                              * PMEMOBJ_MIN_POOL, 0664);
+                mapPool = pool<root>::create(mapper_filename, "pmse_mapper",
+                                             isSystemCollection(ns) ? SYSTEM_RECORD_STORE_POOL_SIZE
+                                                                    : RECORD_STORE_POOL_SIZE,
+                                             0664);
             } catch (std::exception &e) {
                 log() << "Error handled: " << e.what();
                 throw;
             }
         } else {
             try {
-                _mapPool = pool<root>::open(mapper_filename, "pmse_mapper");
+                mapPool = pool<root>::open(mapper_filename, "pmse_mapper");
             } catch (std::exception &e) {
                 log() << "Error handled: " << e.what();
                 throw;
             }
         }
-        pool_handler->insert(std::pair<std::string, pool_base>(ident.toString(),
-                                                               _mapPool));
+        pool_handler->add(ident.toString(), mapPool, mapper_filename, "pmse_mapper");
+    }
+    std::vector<PmsePoolPin> pins;
+    pins.push_back(pool_handler->pin(ident.toString()));
+    pool<root> mapPool(pins.back().pool());
+    auto mapper_root = mapPool.get_root();
+    if (!mapper_root->kvmap_root_ptr) {
+        uint64_t partitions = 1;
+        if (!options.capped && !isSystemCollection(ns) && pmseRecordStorePartitions > 1) {
+            partitions = pmseRecordStorePartitions;
+        }
+        transaction::exec_tx(mapPool, [mapper_root, partitions] {
+            mapper_root->partitions = partitions;
+        });
+    }
+    _mapper = initializeMapper(mapPool, ns, options, recoveryNeeded);
+    _partitions.push_back({pool_handler->entry(ident.toString()), _mapper});
+    pool_handler->setReopenHook(ident.toString(), reattachMapper);
+
+    uint64_t partitions = mapper_root->partitions == 0 ? 1 : mapper_root->partitions;
+    for (uint64_t i = 1; i < partitions; i++) {
+        pins.push_back(openPartitionPool(ident, i, pool_handler));
+        pool<root> partitionPool(pins.back().pool());
+        auto partitionMapper = initializeMapper(partitionPool, ns, options, recoveryNeeded);
+        _partitions.push_back({pool_handler->entry(partitionIdent(ident, i)), partitionMapper});
+        pool_handler->setReopenHook(partitionIdent(ident, i), reattachMapper);
+    }
+    if (partitions > 1) {
+        log() << "Collection " << ns << " is split into " << partitions << " partitions";
+    }
+}
+
+/*
+ * Volatile state of mapper (pool handles of lists) has to be refreshed
+ * after pool is closed as idle and opened again.
+ */
+void PmseRecordStore::reattachMapper(pool_base& pop) {
+    auto mapper = pool<root>(pop).get_root()->kvmap_root_ptr;
+    if (mapper) {
+        mapper->initialize(false);
     }
-    auto mapper_root = _mapPool.get_root();
+}
+
+persistent_ptr<PmseMap<InitData>> PmseRecordStore::initializeMapper(pool<root>& pop,
+                                                                    StringData ns,
+                                                                    const CollectionOptions& options,
+                                                                    bool recoveryNeeded) {
+    persistent_ptr<PmseMap<InitData>> mapper;
+    auto mapper_root = pop.get_root();
     if (!mapper_root->kvmap_root_ptr) {
-        transaction::exec_tx(_mapPool, [mapper_root, options, ns] {
+        transaction::exec_tx(pop, [mapper_root, options, ns] {
             mapper_root->kvmap_root_ptr = make_persistent<PmseMap<InitData>>(options.capped,
                                                                              options.cappedMaxDocs,
                                                                              options.cappedSize,
                                                                              isSystemCollection(ns));
         });
-        _mapper = mapper_root->kvmap_root_ptr;
-        _mapper->initialize(true);
+        mapper = mapper_root->kvmap_root_ptr;
+        mapper->initialize(true);
     } else {
-        _mapper = mapper_root->kvmap_root_ptr;
-        if (_mapper->isInitialized()) {
-            _mapper->initialize(false);
+        mapper = mapper_root->kvmap_root_ptr;
+        if (mapper->isInitialized()) {
+            mapper->initialize(false);
         } else {
-            _mapper->initialize(true);
+            mapper->initialize(true);
         }
-        transaction::exec_tx(_mapPool, [this, recoveryNeeded] {
+        transaction::exec_tx(pop, [mapper, recoveryNeeded] {
             if (recoveryNeeded) {
-                _mapper->recover();
+                mapper->recover();
             } else {
-                _mapper->restoreCounters();
+                mapper->restoreCounters();
             }
         });
     }
+    return mapper;
+}
+
+PmsePoolPin PmseRecordStore::openPartitionPool(StringData ident, uint64_t partition,
+                                               PmsePoolManager *pool_handler) {
+    std::string key = partitionIdent(ident, partition);
+    if (pool_handler->contains(key)) {
+        return pool_handler->pin(key);
+    }
+    std::string filepath = partitionPath(_dbPath, ident, partition);
+    pool<root> pop;
+    try {
+        if (filepath.empty()) {
+            filepath = newPartitionPath(_dbPath, ident, partition);
+            pop = pool<root>::create(filepath, "pmse_mapper", RECORD_STORE_POOL_SIZE, 0664);
+        } else {
+            pop = pool<root>::open(filepath, "pmse_mapper");
+        }
+    } catch (std::exception &e) {
+        log() << "Error handled: " << e.what();
+        throw;
+    }
+    log() << filepath;
+    pool_handler->add(key, pop, filepath, "pmse_mapper");
+    return pool_handler->pin(key);
+}
+
+void PmseRecordStore::dropPartitions(StringData dbpath, StringData ident,
+                                     PmsePoolManager *pool_handler) {
+    auto dirs = partitionDirs(dbpath);
+    for (uint64_t i = 1;; i++) {
+        bool found = false;
+        std::string key = partitionIdent(ident, i);
+        if (pool_handler->contains(key)) {
+            pool_handler->remove(key);
+            found = true;
+        }
+        for (auto& dir : dirs) {
+            if (boost::filesystem::exists(dir + key)) {
+                boost::filesystem::remove_all(dir + key);
+                found = true;
+            }
+        }
+        if (!found)
+            break;
+    }
+}
+
+void PmseRecordStore::storeCounters(StringData ident,
+                                    PmsePoolManager *pool_handler) {
+    std::string key = ident.toString();
+    for (uint64_t i = 1; pool_handler->contains(key); i++) {
+        auto pin = pool_handler->pin(key);
+        auto mapper = pool<root>(pin.pool()).get_root()->kvmap_root_ptr;
+        if (mapper) {
+            mapper->storeCounters();
+        }
+        key = partitionIdent(ident, i);
+    }
+}
+
+std::string PmseRecordStore::partitionPath(StringData dbpath, StringData ident,
+                                           uint64_t partition) {
+    // Partition may be placed in any of configured directories
+    std::string key = partitionIdent(ident, partition);
+    for (auto& dir : partitionDirs(dbpath)) {
+        if (boost::filesystem::exists(dir + key)) {
+            return dir + key;
+        }
+    }
+    return "";
+}
+
+std::string PmseRecordStore::newPartitionPath(StringData dbpath, StringData ident,
+                                              uint64_t partition) {
+    auto dirs = partitionDirs(dbpath);
+    return dirs[(partition - 1) % dirs.size()] + partitionIdent(ident, partition);
+}
+
+std::vector<std::string> PmseRecordStore::partitionDirs(StringData dbpath) {
+    std::vector<std::string> dirs;
+    std::vector<std::string> paths;
+    boost::split(paths, pmsePartitionPaths, boost::is_any_of(","));
+    for (auto& path : paths) {
+        boost::trim(path);
+        if (path.empty())
+            continue;
+        if (!boost::algorithm::ends_with(path, "/"))
+            path += "/";
+        dirs.push_back(path);
+    }
+    if (dirs.empty())
+        dirs.push_back(dbpath.toString());
+    return dirs;
+}
+
+std::string PmseRecordStore::partitionIdent(StringData ident, uint64_t partition) {
+    return ident.toString() + ".p" + std::to_string(partition);
+}
+
+int64_t PmseRecordStore::totalDataSize() const {
+    int64_t size = 0;
+    for (auto& partition : _partitions) {
+        size += partition.mapper->dataSize();
+    }
+    return size;
+}
+
+uint64_t PmseRecordStore::totalRecords() const {
+    uint64_t records = 0;
+    for (auto& partition : _partitions) {
+        records += partition.mapper->fillment();
+    }
+    return records;
+}
+
+std::unique_ptr<SeekableRecordCursor> PmseRecordStore::getCursor(OperationContext* txn,
+                                                                 bool forward) const {
+    if (_partitions.size() == 1) {
+        return stdx::make_unique<PmseRecordCursor>(_mapper, forward, PmsePoolPin(_partitions[0].pool));
+    }
+    std::vector<persistent_ptr<PmseMap<InitData>>> mappers;
+    std::vector<PmsePoolPin> pins;
+    for (auto& partition : _partitions) {
+        mappers.push_back(partition.mapper);
+        pins.push_back(PmsePoolPin(partition.pool));
+    }
+    return stdx::make_unique<PmsePartitionedRecordCursor>(mappers, pins, forward);
 }
 
 StatusWith<RecordId> PmseRecordStore::insertRecord(OperationContext* txn,
@@ -128,18 +306,25 @@ StatusWith<RecordId> PmseRecordStore::insertRecord(OperationContext* txn,
                                                    int len,
                                                    Timestamp timestamp,
                                                    bool enforceQuota) {
+    pinPools(txn);
     if (isCapped() && len > static_cast<int>(_mapper->getMax())) {
         return StatusWith<RecordId>(ErrorCodes::BadValue,
                                     "object to insert exceeds cappedMaxSize");
     }
     persistent_ptr<InitData> obj;
     uint64_t id = 0;
+    size_t partitionNumber = 0;
+    if (_partitions.size() > 1) {
+        partitionNumber = _nextPartition.fetch_add(1) % _partitions.size();
+    }
+    auto& partition = _partitions[partitionNumber];
+    pool_base pop = PmseRecoveryUnit::get(txn)->pinPool(partition.pool);
     try {
-        transaction::exec_tx(_mapPool, [this, &obj, len, data, &id] {
+        transaction::exec_tx(pop, [&partition, &obj, len, data, &id] {
             obj = pmemobj_tx_alloc(sizeof(InitData::size) + len, 1);
             obj->size = len;
             memcpy(obj->data, data, len);
-            id = _mapper->insert(obj);
+            id = partition.mapper->insert(obj);
         });
     } catch (std::exception &e) {
         log() << "RecordStore: " << e.what();
@@ -149,34 +334,39 @@ StatusWith<RecordId> PmseRecordStore::insertRecord(OperationContext* txn,
     if (!id)
         return StatusWith<RecordId>(ErrorCodes::OperationFailed,
                                     "Null record Id!");
-    _mapper->changeSize(len);
-    txn->recoveryUnit()->registerChange(new InsertChange(_mapper, RecordId(id), len));
+    partition.mapper->changeSize(len);
+    _inserts.fetch_add(1);
+    txn->recoveryUnit()->registerChange(new InsertChange(partition.mapper, RecordId(id), len));
     deleteCappedAsNeeded(txn);
-    while (_mapper->dataSize() > _storageSize) {
+    while (totalDataSize() > _storageSize) {
         _storageSize =  _storageSize + baseSize;
     }
-    return StatusWith<RecordId>(RecordId(id));
+    return StatusWith<RecordId>(toRecordId(id, partitionNumber));
 }
 
 Status PmseRecordStore::updateRecord(OperationContext* txn, const RecordId& oldLocation,
                                      const char* data, int len, bool enforceQuota,
                                      UpdateNotifier* notifier) {
+    pinPools(txn);
     persistent_ptr<InitData> obj;
-    stdx::lock_guard<pmem::obj::mutex> lock(_mapper->_listMutex[oldLocation.repr() % _mapper->getHashmapSize()]);
+    auto& partition = partitionOf(oldLocation);
+    uint64_t id = localIdOf(oldLocation);
+    pool_base pop = PmseRecoveryUnit::get(txn)->pinPool(partition.pool);
+    stdx::lock_guard<pmem::obj::mutex> lock(partition.mapper->_listMutex[id % partition.mapper->getHashmapSize()]);
     try {
-        transaction::exec_tx(_mapPool, [&obj, len, data, txn, oldLocation, this] {
+        transaction::exec_tx(pop, [&obj, len, data, txn, id, &partition, this] {
             obj = pmemobj_tx_alloc(sizeof(InitData::size) + len, 1);
             obj->size = len;
             memcpy(obj->data, data, len);
-            _mapper->updateKV(oldLocation.repr(), obj, txn);
-            _mapper->changeSize(obj->size - len);
+            partition.mapper->updateKV(id, obj, txn);
+            partition.mapper->changeSize(obj->size - len);
             deleteCappedAsNeeded(txn);
         });
     } catch (std::exception &e) {
         log() << e.what();
         return Status(ErrorCodes::BadValue, e.what());
     }
-    while (_mapper->dataSize() > _storageSize) {
+    while (totalDataSize() > _storageSize) {
         _storageSize =  _storageSize + baseSize;
     }
     return Status::OK();
@@ -184,11 +374,14 @@ Status PmseRecordStore::updateRecord(OperationContext* txn, const RecordId& oldL
 
 void PmseRecordStore::deleteRecord(OperationContext* txn,
                                    const RecordId& dl) {
-    stdx::lock_guard<pmem::obj::mutex> lock(_mapper->_listMutex[dl.repr() % _mapper->getHashmapSize()]);
+    pinPools(txn);
+    auto& partition = partitionOf(dl);
+    uint64_t id = localIdOf(dl);
+    stdx::lock_guard<pmem::obj::mutex> lock(partition.mapper->_listMutex[id % partition.mapper->getHashmapSize()]);
     persistent_ptr<KVPair> p;
-    if (_mapper->getPair(dl.repr(), &p)) {
-        _mapper->remove((uint64_t) dl.repr(), txn);
-        _mapper->changeSize(-p->ptr->size);
+    if (partition.mapper->getPair(id, &p)) {
+        partition.mapper->remove(id, txn);
+        partition.mapper->changeSize(-p->ptr->size);
     }
 }
 
@@ -198,7 +391,8 @@ void PmseRecordStore::setCappedCallback(CappedCallback* cb) {
 
 void PmseRecordStore::cappedTruncateAfter(OperationContext* txn, RecordId end,
                                           bool inclusive) {
-    PmseRecordCursor cursor(_mapper, true);
+    pinPools(txn);
+    PmseRecordCursor cursor(_mapper, true, PmsePoolPin(_partitions[0].pool));
     auto rec = cursor.seekExact(end);
     if (!inclusive)
         rec = cursor.next();
@@ -215,8 +409,9 @@ void PmseRecordStore::cappedTruncateAfter(OperationContext* txn, RecordId end,
 
 bool PmseRecordStore::findRecord(OperationContext* txn, const RecordId& loc,
                                  RecordData* rd) const {
+    pinPools(txn);
     persistent_ptr<InitData> obj;
-    if (_mapper->find((uint64_t) loc.repr(), &obj)) {
+    if (partitionOf(loc).mapper->find(localIdOf(loc), &obj)) {
         invariant(obj != nullptr);
         *rd = RecordData(obj->data, obj->size);
         return true;
@@ -260,6 +455,7 @@ Status PmseRecordStore::insertRecordsWithDocWriter(OperationContext* txn,
     }
     invariant(pos == (buffer.get() + totalSize));
 
+    pinPools(txn);
     int64_t totalLength = 0;
     for (size_t i = 0; i < nDocs; i++)
         totalLength += records[i].data.size();
@@ -295,8 +491,10 @@ void PmseRecordStore::waitForAllEarlierOplogWritesToBeVisible(OperationContext*
     log() << "Not implemented: waitForAllEarlierOplogWritesToBeVisible";
 }
 
-PmseRecordCursor::PmseRecordCursor(persistent_ptr<PmseMap<InitData>> mapper, bool forward)
-    : _forward(forward),
+PmseRecordCursor::PmseRecordCursor(persistent_ptr<PmseMap<InitData>> mapper, bool forward,
+                                   PmsePoolPin pin)
+    : _pin(pin),
+      _forward(forward),
       _lastMoveWasRestore(false) {
     _mapper = mapper;
     _before = nullptr;
@@ -373,6 +571,7 @@ Status PmseRecordStore::validate(OperationContext* txn,
     int64_t nRecords = 0;
     uint64_t totalDataSize = 0;
 
+    pinPools(txn);
     auto cursor = getCursor(txn, true);
     boost::optional<Record> record;
     Status status = Status::OK();
@@ -395,7 +594,7 @@ Status PmseRecordStore::validate(OperationContext* txn,
     if (level == kValidateFull)
         output->append("nInvalidDocuments", nInvalid);
 
-    output->appendNumber("nrecords", _mapper->fillment());
+    output->appendNumber("nrecords", totalRecords());
     return Status::OK();
 }
 
@@ -533,6 +732,60 @@ bool PmseRecordCursor::checkPosition() {
     return true;
 }
 
+PmsePartitionedRecordCursor::PmsePartitionedRecordCursor(
+                const std::vector<persistent_ptr<PmseMap<InitData>>>& mappers,
+                const std::vector<PmsePoolPin>& pins, bool forward)
+    : _mappers(mappers), _pins(pins), _forward(forward) {}
+
+int64_t PmsePartitionedRecordCursor::maxRecordId() const {
+    int64_t maxId = 0;
+    for (size_t i = 0; i < _mappers.size(); i++) {
+        maxId = std::max(maxId, static_cast<int64_t>(_mappers[i]->maxId() * _mappers.size() + i));
+    }
+    return maxId;
+}
+
+/*
+ * Ids in map start from 1, so RecordIds below number of partitions are
+ * never used.
+ */
+boost::optional<Record> PmsePartitionedRecordCursor::next() {
+    if (_eof)
+        return boost::none;
+    const int64_t partitions = _mappers.size();
+    const int64_t maxId = maxRecordId();
+    if (!_positioned) {
+        _id = _forward ? partitions - 1 : maxId + 1;
+        _positioned = true;
+    }
+    while (_forward ? _id < maxId : _id > partitions) {
+        _id += _forward ? 1 : -1;
+        persistent_ptr<InitData> obj;
+        if (_mappers[_id % partitions]->find(_id / partitions, &obj))
+            return {{RecordId(_id), RecordData(obj->data, obj->size)}};
+    }
+    _eof = true;
+    return boost::none;
+}
+
+boost::optional<Record> PmsePartitionedRecordCursor::seekExact(const RecordId& id) {
+    _id = id.repr();
+    _positioned = true;
+    _eof = false;
+    persistent_ptr<InitData> obj;
+    if (_id < static_cast<int64_t>(_mappers.size()) ||
+        !_mappers[_id % _mappers.size()]->find(_id / _mappers.size(), &obj))
+        return boost::none;
+    return {{id, RecordData(obj->data, obj->size)}};
+}
+
+void PmsePartitionedRecordCursor::save() {}
+
+/* Records removed meanwhile are stepped over by next */
+bool PmsePartitionedRecordCursor::restore() {
+    return true;
+}
+
 bool PmseRecordStore::isSystemCollection(const StringData& ns) {
     return ns.toString() == "local.startup_log" ||
            ns.toString() == "admin.system.version" ||
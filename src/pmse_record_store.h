@@ -34,14 +34,19 @@
 #define SRC_PMSE_RECORD_STORE_H_
 
 #include "pmse_map.h"
+#include "pmse_pool_manager.h"
+#include "pmse_recovery_unit.h"
 
 #include <libpmemobj++/p.hpp>
 #include <libpmemobj++/pext.hpp>
 #include <libpmemobj++/utils.hpp>
 
+#include <atomic>
 #include <cmath>
 #include <string>
 #include <map>
+#include <memory>
+#include <vector>
 
 #include "mongo/platform/basic.h"
 #include "mongo/db/catalog/collection_options.h"
@@ -58,7 +63,7 @@ const uint64_t baseSize = 20480;
 
 class PmseRecordCursor final : public SeekableRecordCursor {
  public:
-    PmseRecordCursor(persistent_ptr<PmseMap<InitData>> mapper, bool forward);
+    PmseRecordCursor(persistent_ptr<PmseMap<InitData>> mapper, bool forward, PmsePoolPin pin);
 
     boost::optional<Record> next();
 
@@ -80,6 +85,7 @@ class PmseRecordCursor final : public SeekableRecordCursor {
     void moveBackward();
     bool checkPosition();
 
+    PmsePoolPin _pin;
     persistent_ptr<PmseMap<InitData>> _mapper;
     persistent_ptr<KVPair> _before;
     persistent_ptr<KVPair> _cur;
@@ -92,16 +98,56 @@ class PmseRecordCursor final : public SeekableRecordCursor {
     p<uint64_t> _position;
 };
 
+/*
+ * Cursor over a collection split into several partitions, which returns
+ * records in RecordId order. RecordId encodes partition and id in its
+ * map, so partitions are merged by stepping through RecordIds and
+ * looking each one up. Inserts reuse ids of removed records, so there
+ * are few gaps to step over. Position is RecordId alone, which needs no
+ * care on save and restore.
+ */
+class PmsePartitionedRecordCursor final : public SeekableRecordCursor {
+ public:
+    PmsePartitionedRecordCursor(const std::vector<persistent_ptr<PmseMap<InitData>>>& mappers,
+                                const std::vector<PmsePoolPin>& pins, bool forward);
+
+    boost::optional<Record> next();
+
+    boost::optional<Record> seekExact(const RecordId& id) final;
+
+    void save() final;
+
+    bool restore() final;
+
+    void detachFromOperationContext() final {}
+
+    void reattachToOperationContext(OperationContext* txn) final {}
+
+ private:
+    /* Highest RecordId handed out by any partition */
+    int64_t maxRecordId() const;
+
+    std::vector<persistent_ptr<PmseMap<InitData>>> _mappers;
+    std::vector<PmsePoolPin> _pins;
+    bool _forward;
+    bool _positioned = false;
+    bool _eof = false;
+    int64_t _id = 0;  // RecordId of last position
+};
+
 class PmseRecordStore : public RecordStore {
  public:
     PmseRecordStore(StringData ns, StringData ident,
                     const CollectionOptions& options,
                     StringData dbpath,
-                    std::map<std::string, pool_base> *pool_handler,
+                    PmsePoolManager *pool_handler,
                     bool recoveryNeeded = false);
 
     ~PmseRecordStore() {
-        _mapper->storeCounters();
+        for (auto& partition : _partitions) {
+            PmsePoolPin pin(partition.pool);
+            partition.mapper->storeCounters();
+        }
     }
 
     virtual const char* name() const {
@@ -111,11 +157,13 @@ class PmseRecordStore : public RecordStore {
     virtual void setCappedCallback(CappedCallback* cb);
 
     virtual long long dataSize(OperationContext* txn) const {
-        return _mapper->dataSize();
+        pinPools(txn);
+        return totalDataSize();
     }
 
     virtual long long numRecords(OperationContext* txn) const {
-        return (int64_t)_mapper->fillment();
+        pinPools(txn);
+        return (int64_t)totalRecords();
     }
 
     virtual bool isCapped() const {
@@ -165,13 +213,14 @@ class PmseRecordStore : public RecordStore {
     }
 
     std::unique_ptr<SeekableRecordCursor> getCursor(OperationContext* txn,
-                                                    bool forward) const final {
-        return stdx::make_unique<PmseRecordCursor>(_mapper, forward);
-    }
+                                                    bool forward) const final;
 
     virtual Status truncate(OperationContext* txn) {
-        if (!_mapper->truncate(txn)) {
-            return Status(ErrorCodes::OperationFailed, "Truncate error");
+        pinPools(txn);
+        for (auto& partition : _partitions) {
+            if (!partition.mapper->truncate(txn)) {
+                return Status(ErrorCodes::OperationFailed, "Truncate error");
+            }
         }
         return Status::OK();
     }
@@ -187,6 +236,7 @@ class PmseRecordStore : public RecordStore {
 
     virtual void appendCustomStats(OperationContext* txn,
                                    BSONObjBuilder* result, double scale) const {
+        pinPools(txn);
         if (_mapper->isCapped()) {
             result->appendNumber("capped", true);
             result->appendNumber("maxSize", floor(_mapper->getMax() / scale));
@@ -194,7 +244,8 @@ class PmseRecordStore : public RecordStore {
         } else {
             result->appendNumber("capped", false);
         }
-        result->appendNumber("numInserts", _mapper->fillment());
+        result->appendNumber("partitions", static_cast<long long>(_partitions.size()));
+        result->appendNumber("numInserts", static_cast<long long>(_inserts.load()));
     }
 
     virtual Status touch(OperationContext* txn, BSONObjBuilder* output) const {
@@ -217,15 +268,91 @@ class PmseRecordStore : public RecordStore {
                             ValidateResults* results,
                             BSONObjBuilder* output);
 
+    /*
+     * Closes and removes all partition pools (except the first one, which
+     * is the ident file itself) of given ident.
+     */
+    static void dropPartitions(StringData dbpath, StringData ident,
+                               PmsePoolManager *pool_handler);
+
+    /*
+     * Stores volatile counters of all already opened partitions of given
+     * ident, so next PmseRecordStore instance starts with actual values.
+     */
+    static void storeCounters(StringData ident,
+                              PmsePoolManager *pool_handler);
+
+    /*
+     * Returns path of existing partition pool file or empty string.
+     */
+    static std::string partitionPath(StringData dbpath, StringData ident, uint64_t partition);
+
+    /*
+     * Path of partition pool which does not exist yet. New partitions go to
+     * configured directories in round robin manner.
+     */
+    static std::string newPartitionPath(StringData dbpath, StringData ident, uint64_t partition);
+
+    static std::string partitionIdent(StringData ident, uint64_t partition);
+
+    static bool isSystemCollection(const StringData& ns);
+
  private:
+    struct Partition {
+        std::shared_ptr<PmsePoolEntry> pool;
+        persistent_ptr<PmseMap<InitData>> mapper;
+    };
+
+    /*
+     * Pins pools of all partitions until the end of operation.
+     */
+    void pinPools(OperationContext* txn) const {
+        auto ru = PmseRecoveryUnit::get(txn);
+        for (auto& partition : _partitions) {
+            ru->pinPool(partition.pool);
+        }
+    }
+
+    static void reattachMapper(pool_base& pop);
+
     void deleteCappedAsNeeded(OperationContext* txn);
-    static bool isSystemCollection(const StringData& ns);
+    persistent_ptr<PmseMap<InitData>> initializeMapper(pool<root>& pop, StringData ns,
+                                                      const CollectionOptions& options,
+                                                      bool recoveryNeeded);
+    PmsePoolPin openPartitionPool(StringData ident, uint64_t partition,
+                                  PmsePoolManager *pool_handler);
+    int64_t totalDataSize() const;
+    uint64_t totalRecords() const;
+
+    /*
+     * RecordIds are spread over partitions: id = localId * partitions + partition.
+     * With single partition RecordId is equal to id in PmseMap.
+     */
+    RecordId toRecordId(uint64_t localId, size_t partition) const {
+        return RecordId(static_cast<int64_t>(localId * _partitions.size() + partition));
+    }
+
+    Partition& partitionOf(const RecordId& id) {
+        return _partitions[id.repr() % _partitions.size()];
+    }
+
+    const Partition& partitionOf(const RecordId& id) const {
+        return _partitions[id.repr() % _partitions.size()];
+    }
+
+    uint64_t localIdOf(const RecordId& id) const {
+        return id.repr() / _partitions.size();
+    }
+
+    static std::vector<std::string> partitionDirs(StringData dbpath);
     CappedCallback* _cappedCallback;
     int64_t _storageSize = baseSize;
     CollectionOptions _options;
     const StringData _dbPath;
-    pool<root> _mapPool;
     persistent_ptr<PmseMap<InitData>> _mapper;
+    std::vector<Partition> _partitions;
+    std::atomic<uint64_t> _nextPartition = {0};
+    std::atomic<uint64_t> _inserts = {0};  // since store was opened
 };
 }  // namespace mongo
 #endif  // SRC_PMSE_RECORD_STORE_H_
@@ -30,9 +30,11 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <algorithm>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include "mongo/platform/basic.h"
 #include "mongo/base/checked_cast.h"
@@ -41,7 +43,9 @@
 #include "mongo/bson/bsonobjbuilder.h"
 #include "mongo/db/concurrency/write_conflict_exception.h"
 #include "mongo/db/json.h"
+#include "mongo/db/modules/pmse/src/pmse_pool_manager.h"
 #include "mongo/db/modules/pmse/src/pmse_record_store.h"
+#include "mongo/db/modules/pmse/src/pmse_server_parameters.h"
 #include "mongo/db/operation_context_noop.h"
 #include "mongo/db/storage/kv/kv_prefix.h"
 #include "mongo/db/storage/record_store_test_harness.h"
@@ -234,4 +238,124 @@ TEST(PmseRecordStoreTest, CappedCursorYieldFirst) {
     ASSERT(!cursor->next());
 }
 
+TEST(PmseRecordStoreTest, PartitionedInsertFindScan) {
+    const int partitions = pmseRecordStorePartitions;
+    pmseRecordStorePartitions = 2;
+    ON_BLOCK_EXIT([partitions] { pmseRecordStorePartitions = partitions; });
+
+    const auto harnessHelper(newRecordStoreHarnessHelper());
+    unique_ptr<RecordStore> rs(harnessHelper->newNonCappedRecordStore());
+
+    std::vector<RecordId> ids;
+    {
+        ServiceContext::UniqueOperationContext opCtx(
+            harnessHelper->newOperationContext());
+        for (int i = 0; i < 10; ++i) {
+            WriteUnitOfWork uow(opCtx.get());
+            string data = std::to_string(i);
+            StatusWith<RecordId> res =
+                rs->insertRecord(opCtx.get(), data.c_str(), data.size() + 1, Timestamp(), false);
+            ASSERT_OK(res.getStatus());
+            ids.push_back(res.getValue());
+            uow.commit();
+        }
+        ASSERT_EQUALS(10, rs->numRecords(opCtx.get()));
+    }
+
+    {
+        ServiceContext::UniqueOperationContext opCtx(
+            harnessHelper->newOperationContext());
+        for (int i = 0; i < 10; ++i) {
+            ASSERT_EQUALS(std::to_string(i), rs->dataFor(opCtx.get(), ids[i]).data());
+        }
+
+        // Every record of every partition is scanned once in RecordId order, in either direction.
+        for (bool forward : {true, false}) {
+            auto cursor = rs->getCursor(opCtx.get(), forward);
+            std::vector<RecordId> seen;
+            while (auto record = cursor->next()) {
+                if (!seen.empty())
+                    ASSERT_TRUE(forward ? seen.back() < record->id : seen.back() > record->id);
+                seen.push_back(record->id);
+                auto inserted = std::find(ids.begin(), ids.end(), record->id) - ids.begin();
+                ASSERT_EQUALS(std::to_string(inserted), record->data.data());
+            }
+            ASSERT_EQUALS(10U, seen.size());
+        }
+
+        // Scan goes on in order from record found by seekExact.
+        auto cursor = rs->getCursor(opCtx.get());
+        auto record = cursor->seekExact(ids[7]);
+        ASSERT(record);
+        ASSERT_EQUALS(ids[7], record->id);
+        ASSERT_EQUALS(std::string("7"), record->data.data());
+        RecordId found = ids[7];
+        std::sort(ids.begin(), ids.end());
+        record = cursor->next();
+        ASSERT(record);
+        ASSERT_EQUALS(*std::upper_bound(ids.begin(), ids.end(), found), record->id);
+    }
+}
+
+/* Pool manager of its own over a temporary directory */
+class PmsePoolManagerTest : public unittest::Test {
+ protected:
+    std::string dbpath() const {
+        return _dbpath.path() + "/";
+    }
+
+ private:
+    unittest::TempDir _dbpath{"pmse_pool_manager_test"};
+
+ protected:
+    PmsePoolManager poolManager;
+};
+
+TEST_F(PmsePoolManagerTest, IdlePoolIsReopened) {
+    const auto harnessHelper(newRecordStoreHarnessHelper());
+    CollectionOptions options;
+    PmseRecordStore rs("a.b", "idle_test", options, dbpath(), &poolManager);
+
+    RecordId id;
+    {
+        ServiceContext::UniqueOperationContext opCtx(
+            harnessHelper->newOperationContext());
+        WriteUnitOfWork uow(opCtx.get());
+        StatusWith<RecordId> res = rs.insertRecord(opCtx.get(), "data", 5, Timestamp(), false);
+        ASSERT_OK(res.getStatus());
+        id = res.getValue();
+        uow.commit();
+        // Pool is pinned until the end of operation.
+        ASSERT_EQUALS(0U, poolManager.closeIdle(0));
+    }
+    ASSERT_EQUALS(1U, poolManager.closeIdle(0));
+    ASSERT_EQUALS(0U, poolManager.openCount());
+
+    {
+        ServiceContext::UniqueOperationContext opCtx(
+            harnessHelper->newOperationContext());
+        ASSERT_EQUALS(string("data"), rs.dataFor(opCtx.get(), id).data());
+        ASSERT_EQUALS(1, rs.numRecords(opCtx.get()));
+        ASSERT_EQUALS(1U, poolManager.openCount());
+    }
+}
+
+TEST_F(PmsePoolManagerTest, DroppedPoolClosesWithLastPin) {
+    std::string path = dbpath() + "dropped_test";
+    poolManager.add("dropped_test", pool_base::create(path, "", PMEMOBJ_MIN_POOL, 0664),
+                    path, "");
+
+    auto entry = poolManager.entry("dropped_test");
+    ASSERT(entry);
+    {
+        // Background work still pins pool when ident is dropped.
+        PmsePoolPin pin(entry);
+        poolManager.remove("dropped_test");
+        ASSERT_FALSE(poolManager.contains("dropped_test"));
+        ASSERT_TRUE(pin.entry()->open);
+        ASSERT_THROWS(PmsePoolPin{entry}, std::runtime_error);
+    }
+    ASSERT_FALSE(entry->open);
+}
+
 }  // namespace mongo
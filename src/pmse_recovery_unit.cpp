@@ -32,6 +32,8 @@
 
 #define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
 
+#include <tuple>
+
 #include "mongo/util/log.h"
 
 #include "pmse_recovery_unit.h"
@@ -45,6 +47,7 @@ void PmseRecoveryUnit::commitUnitOfWork() {
             (*it)->commit();
         }
         _changes.clear();
+        _pins.clear();
     } catch (...) {
         throw;
     }
@@ -57,6 +60,7 @@ void PmseRecoveryUnit::abortUnitOfWork() {
             (*it)->rollback();
         }
         _changes.clear();
+        _pins.clear();
     } catch (...) {
         throw;
     }
@@ -67,7 +71,9 @@ bool PmseRecoveryUnit::waitUntilDurable() {
     return true;
 }
 
-void PmseRecoveryUnit::abandonSnapshot() {}
+void PmseRecoveryUnit::abandonSnapshot() {
+    _pins.clear();
+}
 
 SnapshotId PmseRecoveryUnit::getSnapshotId() const {
     return SnapshotId();
@@ -83,4 +89,12 @@ void* PmseRecoveryUnit::writingPtr(void* data, size_t len) {
 
 void PmseRecoveryUnit::setRollbackWritesDisabled() {}
 
+pool_base PmseRecoveryUnit::pinPool(const std::shared_ptr<PmsePoolEntry>& entry) {
+    auto found = _pins.find(entry.get());
+    if (found == _pins.end())
+        found = _pins.emplace(std::piecewise_construct, std::forward_as_tuple(entry.get()),
+                              std::forward_as_tuple(entry)).first;
+    return found->second.pool();
+}
+
 }  // namespace mongo
@@ -33,9 +33,14 @@
 #ifndef SRC_PMSE_RECOVERY_UNIT_H_
 #define SRC_PMSE_RECOVERY_UNIT_H_
 
+#include <unordered_map>
 #include <vector>
 
+#include "pmse_pool_manager.h"
+
+#include "mongo/db/operation_context.h"
 #include "mongo/db/storage/recovery_unit.h"
+#include "mongo/base/checked_cast.h"
 
 namespace mongo {
 
@@ -43,6 +48,10 @@ class PmseRecoveryUnit : public RecoveryUnit {
  public:
     PmseRecoveryUnit() = default;
 
+    static PmseRecoveryUnit* get(OperationContext* opCtx) {
+        return checked_cast<PmseRecoveryUnit*>(opCtx->recoveryUnit());
+    }
+
     virtual void beginUnitOfWork(OperationContext* opCtx);
 
     virtual void commitUnitOfWork();
@@ -61,10 +70,18 @@ class PmseRecoveryUnit : public RecoveryUnit {
 
     virtual void setRollbackWritesDisabled();
 
+    /*
+     * Keeps pool open until unit of work ends or snapshot is abandoned, so
+     * changes and RecordData pointing into pool stay valid meanwhile.
+     * Cursors hold pins of their own. Returns current handle of the pool.
+     */
+    pool_base pinPool(const std::shared_ptr<PmsePoolEntry>& entry);
+
  private:
     typedef std::shared_ptr<Change> ChangePtr;
     typedef std::vector<ChangePtr> Changes;
     Changes _changes;
+    std::unordered_map<const PmsePoolEntry*, PmsePoolPin> _pins;
 };
 
 }  // namespace mongo
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2014-2020, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "pmse_server_parameters.h"
+
+#include <string>
+
+#include "mongo/db/server_parameters.h"
+#include "mongo/util/mongoutils/str.h"
+
+namespace mongo {
+
+int pmseRecordStorePartitions = 1;
+
+namespace {
+class RecordStorePartitionsParameter
+    : public ExportedServerParameter<int, ServerParameterType::kStartupOnly> {
+ public:
+    RecordStorePartitionsParameter()
+        : ExportedServerParameter<int, ServerParameterType::kStartupOnly>(
+              ServerParameterSet::getGlobal(), "pmseRecordStorePartitions",
+              &pmseRecordStorePartitions) {}
+
+    virtual Status validate(const int& potentialNewValue) {
+        if (potentialNewValue < 1 || potentialNewValue > MAX_RECORD_STORE_PARTITIONS) {
+            return Status(ErrorCodes::BadValue,
+                          mongoutils::str::stream()
+                              << "pmseRecordStorePartitions has to be from 1 to "
+                              << MAX_RECORD_STORE_PARTITIONS);
+        }
+        return Status::OK();
+    }
+} recordStorePartitionsParameter;
+}  // namespace
+
+MONGO_EXPORT_STARTUP_SERVER_PARAMETER(pmsePartitionPaths, std::string, "");
+MONGO_EXPORT_STARTUP_SERVER_PARAMETER(pmseStartupOpenThreads, int, 4);
+MONGO_EXPORT_STARTUP_SERVER_PARAMETER(pmsePrefaultAtOpen, bool, false);
+MONGO_EXPORT_STARTUP_SERVER_PARAMETER(pmseSparePools, int, 0);
+MONGO_EXPORT_STARTUP_SERVER_PARAMETER(pmsePoolIdleTimeoutSecs, int, 0);
+MONGO_EXPORT_STARTUP_SERVER_PARAMETER(pmseIndexNodeSize, int, 1024);
+MONGO_EXPORT_STARTUP_SERVER_PARAMETER(pmseIndexBulkFillFactor, int, 90);
+MONGO_EXPORT_STARTUP_SERVER_PARAMETER(pmseIndexBuildThreads, int, 4);
+MONGO_EXPORT_STARTUP_SERVER_PARAMETER(pmseIndexMaintenanceIntervalSecs, int, 10);
+MONGO_EXPORT_STARTUP_SERVER_PARAMETER(pmseIndexMergeFillPercent, int, 30);
+MONGO_EXPORT_STARTUP_SERVER_PARAMETER(pmseIndexCompactIntervalSecs, int, 600);
+
+}  // namespace mongo
@@ -0,0 +1,117 @@
+/*
+ * Copyright 2014-2020, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_PMSE_SERVER_PARAMETERS_H_
+#define SRC_PMSE_SERVER_PARAMETERS_H_
+
+#include <string>
+
+namespace mongo {
+
+/*
+ * Number of pools a newly created collection is split into, from 1 to
+ * MAX_RECORD_STORE_PARTITIONS. Capped and system collections always use
+ * a single pool.
+ */
+const int MAX_RECORD_STORE_PARTITIONS = 64;
+extern int pmseRecordStorePartitions;
+
+/*
+ * Comma separated list of directories for partition pools, e.g. mount
+ * points of DAX filesystems on different NUMA nodes. Empty means dbpath.
+ */
+extern std::string pmsePartitionPaths;
+
+/*
+ * Number of threads opening pools of all idents at engine startup.
+ * 0 disables the startup phase, pools are then opened on first use.
+ */
+extern int pmseStartupOpenThreads;
+
+/*
+ * Prefault mappings of pools when they are opened (libpmemobj
+ * "prefault.at_open" ctl, set for the whole process at startup), so
+ * first queries do not take page faults.
+ */
+extern bool pmsePrefaultAtOpen;
+
+/*
+ * Number of formatted spare pool files of each kind (collection, index)
+ * kept in dbpath for fast collection and index creation. 0 disables.
+ */
+extern int pmseSparePools;
+
+/*
+ * Pools not used for this many seconds are closed and reopened on next
+ * access, which bounds number of mappings with many idents. 0 disables.
+ */
+extern int pmsePoolIdleTimeoutSecs;
+
+/*
+ * Size in bytes of leaves of new indexes, rounded up to 256 byte media
+ * lines. Index option storageEngine.pmse.nodeSize overrides it.
+ */
+extern int pmseIndexNodeSize;
+
+/*
+ * Percent of leaf slots filled when index is built from sorted keys.
+ * Free slots take later inserts without splits.
+ */
+extern int pmseIndexBulkFillFactor;
+
+/*
+ * Number of threads writing leaves when index is built from sorted
+ * keys. Consecutive key ranges are written in parallel.
+ */
+extern int pmseIndexBuildThreads;
+
+/*
+ * Seconds between background passes merging underfull index leaves and
+ * dropping empty ones, which deletes leave behind. 0 disables.
+ */
+extern int pmseIndexMaintenanceIntervalSecs;
+
+/*
+ * Neighbour index leaves are merged when together they fill at most this
+ * percent of one leaf. 0 only drops empty leaves.
+ */
+extern int pmseIndexMergeFillPercent;
+
+/*
+ * Indexes whose leaves were split or removed are compacted online at
+ * most once per this many seconds, by the maintenance job. 0 disables
+ * compaction, the compact command is not supported.
+ */
+extern int pmseIndexCompactIntervalSecs;
+
+}  // namespace mongo
+#endif  // SRC_PMSE_SERVER_PARAMETERS_H_
@@ -34,6 +34,7 @@
 
 #include "pmse_change.h"
 #include "pmse_index_cursor.h"
+#include "pmse_server_parameters.h"
 #include "pmse_sorted_data_interface.h"
 
 #include <boost/filesystem.hpp>
@@ -41,42 +42,119 @@
 #include <boost/system/error_code.hpp>
 #include <libpmemobj++/mutex.hpp>
 
+#include <algorithm>
 #include <map>
 #include <string>
 #include <utility>
 
+#include "mongo/db/index_names.h"
 #include "mongo/util/log.h"
 
 namespace mongo {
 
 const int TempKeyMaxSize = 1024;
 
+namespace {
+
+/* Leaf size from index options, server parameter if not given */
+uint64_t requestedNodeSize(const IndexDescriptor* desc) {
+    BSONElement nodeSize = desc->infoObj().getObjectField("storageEngine")
+                               .getObjectField("pmse")["nodeSize"];
+    return nodeSize.isNumber() ? nodeSize.numberLong() : pmseIndexNodeSize;
+}
+
+/* Hashed indexes serve equality lookups only, others ask for hash table in options */
+bool requestedHashTable(const IndexDescriptor* desc) {
+    BSONElement hashTable = desc->infoObj().getObjectField("storageEngine")
+                                .getObjectField("pmse")["hashTable"];
+    return hashTable.isBoolean() ? hashTable.boolean()
+                                 : desc->getAccessMethodName() == IndexNames::HASHED;
+}
+
+/* Entries filling given percent of leaf */
+uint64_t leafEntries(const PmseTreeIndex& index, int percent) {
+    return index.capacity * std::min(std::max(percent, 0), 100) / 100;
+}
+
+}  // namespace
+
+Status PmseSortedDataInterface::validateStorageOptions(const BSONObj& options) {
+    for (auto&& element : options) {
+        if (element.fieldNameStringData() == "hashTable") {
+            if (!element.isBoolean()) {
+                return Status(ErrorCodes::InvalidOptions, "hashTable has to be a boolean");
+            }
+            continue;
+        }
+        if (element.fieldNameStringData() != "nodeSize") {
+            return Status(ErrorCodes::InvalidOptions,
+                          mongoutils::str::stream() << "Unknown pmse index option: " << element.fieldName());
+        }
+        long long nodeSize = element.numberLong();
+        if (!element.isNumber() || element.numberDouble() != nodeSize ||
+            nodeSize < static_cast<long long>(MIN_NODE_SIZE) ||
+            nodeSize > static_cast<long long>(MAX_NODE_SIZE) || nodeSize % NODE_LINE_SIZE != 0) {
+            return Status(ErrorCodes::InvalidOptions,
+                          mongoutils::str::stream() << "nodeSize has to be a multiple of " << NODE_LINE_SIZE
+                                                    << " from " << MIN_NODE_SIZE << " to " << MAX_NODE_SIZE);
+        }
+    }
+    return Status::OK();
+}
+
 PmseSortedDataInterface::PmseSortedDataInterface(StringData ident,
                                                  const IndexDescriptor* desc,
                                                  StringData dbpath,
-                                                 std::map<std::string, pool_base> *pool_handler)
+                                                 PmsePoolManager *pool_handler)
     : _dbpath(dbpath), _desc(*desc) {
     try {
-        if (pool_handler->count(ident.toString()) > 0) {
-            _pm_pool = pool<PmseTree>((*pool_handler)[ident.toString()]);
-        } else {
+        if (!pool_handler->contains(ident.toString())) {
             std::string filepath = _dbpath.toString() + ident.toString();
             if (desc->parentNS() == "local.startup_log" &&
                 boost::filesystem::exists(filepath)) {
                 log() << "Delete old startup log";
                 boost::filesystem::remove_all(filepath);
             }
+            pool<PmseTreeRoot> pm_pool;
             if (!boost::filesystem::exists(filepath)) {
-                _pm_pool = pool<PmseTree>::create(filepath.c_str(), "pmse_index",
-                                                  (isSystemCollection(desc->parentNS()) ? 10 : 30)
-                                                  * PMEMOBJ_MIN_POOL, 0664);
+                pm_pool = pool<PmseTreeRoot>::create(filepath.c_str(), "pmse_index",
+                                                 isSystemCollection(desc->parentNS())
+                                                     ? SYSTEM_INDEX_POOL_SIZE : INDEX_POOL_SIZE,
+                                                 0664);
             } else {
-                _pm_pool = pool<PmseTree>::open(filepath.c_str(), "pmse_index");
+                pm_pool = pool<PmseTreeRoot>::open(filepath.c_str(), "pmse_index");
             }
-            pool_handler->insert(std::pair<std::string, pool_base>(ident.toString(),
-                                                                   _pm_pool));
+            pool_handler->add(ident.toString(), pm_pool, filepath, "pmse_index");
+        }
+        auto pin = pool_handler->pin(ident.toString());
+        _pool = pool_handler->entry(ident.toString());
+        stdx::lock_guard<stdx::mutex> lock(_pool->mutex);
+        if (!_pool->volatileState) {
+            auto tree = std::make_shared<PmseTree>(pool<PmseTreeRoot>(pin.pool()).get_root(),
+                                                   desc->keyPattern());
+            tree->open(pin.pool(), requestedNodeSize(desc), requestedHashTable(desc));
+            tree->index().mergeEntries = leafEntries(tree->index(), pmseIndexMergeFillPercent);
+            tree->index().postingLists = !desc->unique();
+            _pool->volatileState = tree;
+            /* Tree lives with pool entry, so hooks hold it without pinning */
+            PmseTree* raw = tree.get();
+            _pool->onReopen = [raw](pool_base& pop) {
+                raw->registerAllocClass(pop);
+            };
+            _pool->maintenance = [raw](const std::shared_ptr<PmsePoolEntry>& entry) {
+                PmseTreeIndex& state = raw->index();
+                bool compact = pmseIndexCompactIntervalSecs > 0 &&
+                    state.compactionDue(pmseIndexCompactIntervalSecs * 1000ULL);
+                if (!compact && state.underfullLeaves.load(std::memory_order_relaxed) == 0)
+                    return;
+                PmsePoolPin pin(entry);
+                if (compact)
+                    raw->compact(pin.pool(), leafEntries(state, pmseIndexBulkFillFactor));
+                else
+                    raw->rebalance(pin.pool(), state.mergeEntries);
+            };
         }
-        _tree = _pm_pool.get_root();
+        _tree = std::static_pointer_cast<PmseTree>(_pool->volatileState);
     } catch (std::exception &e) {
         log() << "Error handled: " << e.what();
         throw Status(ErrorCodes::CannotCreateIndex, "Cannot create/open pool while creating index");
@@ -101,10 +179,11 @@ Status PmseSortedDataInterface::insert(OperationContext* txn,
         return Status(ErrorCodes::KeyTooLong, msg);
     }
     try {
+        pool_base pop = PmseRecoveryUnit::get(txn)->pinPool(_pool);
         IndexKeyEntry entry(key.getOwned(), loc);
-        status = _tree->insert(_pm_pool, entry, _desc.keyPattern(), dupsAllowed);
+        status = _tree->insert(pop, entry, _desc.keyPattern(), dupsAllowed);
         if (status == Status::OK()) {
-            txn->recoveryUnit()->registerChange(new InsertIndexChange(_tree, _pm_pool, key, loc, dupsAllowed, &_desc));
+            txn->recoveryUnit()->registerChange(new InsertIndexChange(_tree.get(), pop, key, loc, dupsAllowed, &_desc));
         }
     } catch (std::exception &e) {
         log() << e.what();
@@ -120,17 +199,51 @@ void PmseSortedDataInterface::unindex(OperationContext* txn, const BSONObj& key,
     bool status = true;
     IndexKeyEntry entry(key.getOwned(), loc);
     try {
-        transaction::exec_tx(_pm_pool, [this, &entry, dupsAllowed, txn, &status] {
-           status = _tree->remove(_pm_pool, entry, dupsAllowed, _desc.keyPattern());
-        });
-	    if (status == true) {
-            txn->recoveryUnit()->registerChange(new RemoveIndexChange(_tree, _pm_pool, key, loc, dupsAllowed, _desc.keyPattern()));
+        pool_base pop = PmseRecoveryUnit::get(txn)->pinPool(_pool);
+        status = _tree->remove(pop, entry, dupsAllowed, _desc.keyPattern());
+        if (status == true) {
+            txn->recoveryUnit()->registerChange(new RemoveIndexChange(_tree.get(), pop, key, loc, dupsAllowed, _desc.keyPattern()));
         }
     } catch (std::exception &e) {
         log() << e.what();
     }
 }
 
+/*
+ * Leaves are merged up to the fill of bulk built index, which leaves
+ * room for inserts, and laid out in key order.
+ */
+Status PmseSortedDataInterface::compact(OperationContext* txn) {
+    try {
+        pool_base pop = PmseRecoveryUnit::get(txn)->pinPool(_pool);
+        _tree->compact(pop, leafEntries(_tree->index(), pmseIndexBulkFillFactor));
+    } catch (std::exception &e) {
+        log() << "Index compaction failed: " << e.what();
+        return Status(ErrorCodes::CommandFailed, e.what());
+    }
+    return Status::OK();
+}
+
+/*
+ * Full validation counts entries leaf by leaf and checks the count kept
+ * by writers against it.
+ */
+void PmseSortedDataInterface::fullValidate(OperationContext* txn, long long* numKeysOut,
+                                           ValidateResults* fullResults) const {
+    PmseRecoveryUnit::get(txn)->pinPool(_pool);
+    if (!fullResults) {
+        *numKeysOut = _tree->numEntries();
+        return;
+    }
+    *numKeysOut = _tree->countElements();
+    if (static_cast<uint64_t>(*numKeysOut) != _tree->numEntries()) {
+        fullResults->valid = false;
+        fullResults->errors.push_back(mongoutils::str::stream()
+            << "index has " << *numKeysOut << " entries in leaves, but counts "
+            << _tree->numEntries());
+    }
+}
+
 Status PmseSortedDataInterface::dupKeyCheck(OperationContext* txn,
                                             const BSONObj& key,
                                             const RecordId& loc) {
@@ -139,35 +252,70 @@ Status PmseSortedDataInterface::dupKeyCheck(OperationContext* txn,
 
 std::unique_ptr<SortedDataInterface::Cursor> PmseSortedDataInterface::newCursor(
                 OperationContext* txn, bool isForward) const {
-    return stdx::make_unique <PmseCursor> (txn, isForward, _tree,
+    return stdx::make_unique <PmseCursor> (txn, isForward, _tree.get(),
                                            _desc.keyPattern(),
-                                           _desc.unique());
+                                           _desc.unique(), PmsePoolPin(_pool));
+}
+
+std::unique_ptr<SortedDataInterface::Cursor> PmseSortedDataInterface::newRandomCursor(
+                OperationContext* txn) const {
+    return stdx::make_unique<PmseRandomCursor>(_tree.get(), PmsePoolPin(_pool));
 }
 
+/*
+ * Keys come sorted, so empty tree is loaded bottom-up and published on
+ * commit. Non-empty tree gets keys inserted one by one.
+ */
 class PmseSortedDataBuilderInterface : public SortedDataBuilderInterface {
     MONGO_DISALLOW_COPYING(PmseSortedDataBuilderInterface);
  public:
     PmseSortedDataBuilderInterface(OperationContext* txn,
                                    PmseSortedDataInterface* index,
-                                   bool dupsAllowed)
+                                   bool dupsAllowed,
+                                   PmseTree* tree,
+                                   PmsePoolPin pin)
     : _index(index),
       _txn(txn),
-      _dupsAllowed(dupsAllowed) {}
+      _dupsAllowed(dupsAllowed),
+      _pin(pin) {
+        if (tree->isEmpty())
+            _builder = stdx::make_unique<PmseTreeBuilder>(tree, _pin.pool(), pmseIndexBulkFillFactor,
+                                                          pmseIndexBuildThreads);
+    }
 
     virtual Status addKey(const BSONObj& key, const RecordId& loc) {
-        return _index->insert(_txn, key, loc, _dupsAllowed);
+        if (!_builder)
+            return _index->insert(_txn, key, loc, _dupsAllowed);
+        if (key.objsize() >= TempKeyMaxSize) {
+            std::string msg = mongoutils::str::stream()
+                << "PMSE::addKey: key too large to index, failing " << ' '
+                << key.objsize() << ' ' << key;
+            return Status(ErrorCodes::KeyTooLong, msg);
+        }
+        try {
+            return _builder->add(IndexKeyEntry(key, loc), _dupsAllowed);
+        } catch (std::exception &e) {
+            log() << e.what();
+            return Status(ErrorCodes::CommandFailed, e.what());
+        }
     }
 
-    void commit(bool mayInterrupt) {}
+    void commit(bool mayInterrupt) {
+        if (_builder)
+            _builder->commit();
+    }
  private:
     PmseSortedDataInterface* _index;
     OperationContext* _txn;
     bool _dupsAllowed;
+    PmsePoolPin _pin;
+    std::unique_ptr<PmseTreeBuilder> _builder;
 };
 
 SortedDataBuilderInterface* PmseSortedDataInterface::getBulkBuilder(
                 OperationContext* txn, bool dupsAllowed) {
-    return new PmseSortedDataBuilderInterface(txn, this, dupsAllowed);
+    PmseRecoveryUnit::get(txn)->pinPool(_pool);
+    return new PmseSortedDataBuilderInterface(txn, this, dupsAllowed, _tree.get(), PmsePoolPin(_pool));
 }
 
 bool PmseSortedDataInterface::isSystemCollection(const StringData& ns) {
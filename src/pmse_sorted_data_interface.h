@@ -33,6 +33,8 @@
 #ifndef SRC_PMSE_SORTED_DATA_INTERFACE_H_
 #define SRC_PMSE_SORTED_DATA_INTERFACE_H_
 
+#include "pmse_pool_manager.h"
+#include "pmse_recovery_unit.h"
 #include "pmse_tree.h"
 
 #include <libpmemobj.h>
@@ -41,6 +43,7 @@
 #include <libpmemobj++/p.hpp>
 
 #include <map>
+#include <memory>
 #include <string>
 
 #include "mongo/db/storage/sorted_data_interface.h"
@@ -52,8 +55,10 @@ namespace mongo {
 class PmseSortedDataInterface : public SortedDataInterface {
  public:
     PmseSortedDataInterface(StringData ident, const IndexDescriptor* desc,
-                            StringData dbpath, std::map<std::string,
-                            pool_base> *pool_handler);
+                            StringData dbpath, PmsePoolManager *pool_handler);
+
+    /* Checks storageEngine.pmse options of index spec */
+    static Status validateStorageOptions(const BSONObj& options);
 
     virtual SortedDataBuilderInterface* getBulkBuilder(OperationContext* txn,
                                                        bool dupsAllowed);
@@ -67,16 +72,18 @@ class PmseSortedDataInterface : public SortedDataInterface {
     virtual Status dupKeyCheck(OperationContext* txn, const BSONObj& key,
                                const RecordId& loc);
 
+    /* Without results only the count is wanted, e.g. by numEntries */
     virtual void fullValidate(OperationContext* txn, long long* numKeysOut,
-                              ValidateResults* fullResults) const {
-        *numKeysOut = _tree->countElements();
-        // TODO(kfilipek): Implement fullValidate
-    }
+                              ValidateResults* fullResults) const;
+
+    /* Online, reads and writes of index go on meanwhile */
+    virtual Status compact(OperationContext* txn);
 
     virtual bool appendCustomStats(OperationContext* txn,
                                    BSONObjBuilder* output, double scale) const {
-        // TODO(kfilipek): Implement appendCustomStats
-        return false;
+        PmseRecoveryUnit::get(txn)->pinPool(_pool);
+        _tree->appendStats(output, scale);
+        return true;
     }
 
     virtual long long getSpaceUsedBytes(OperationContext* txn) const {
@@ -84,8 +91,10 @@ class PmseSortedDataInterface : public SortedDataInterface {
         return 0;
     }
 
+    /* Tree may keep empty leaves until rebalance, so entries are counted */
     virtual bool isEmpty(OperationContext* txn) {
-        return _tree->isEmpty();
+        PmseRecoveryUnit::get(txn)->pinPool(_pool);
+        return _tree->numEntries() == 0;
     }
 
     virtual Status initAsEmpty(OperationContext* txn) {
@@ -95,11 +104,15 @@ class PmseSortedDataInterface : public SortedDataInterface {
     std::unique_ptr<SortedDataInterface::Cursor> newCursor(
                     OperationContext* txn, bool isForward) const;
 
+    /* Samples entries at random ranks taken from subtree counts */
+    virtual std::unique_ptr<SortedDataInterface::Cursor> newRandomCursor(
+                    OperationContext* txn) const;
+
  private:
     static bool isSystemCollection(const StringData& ns);
     StringData _dbpath;
-    pool<PmseTree> _pm_pool;
-    persistent_ptr<PmseTree> _tree;
+    std::shared_ptr<PmsePoolEntry> _pool;
+    std::shared_ptr<PmseTree> _tree;  // kept by pool entry too
     IndexDescriptor _desc;
 };
 }  // namespace mongo
@@ -32,6 +32,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "mongo/platform/basic.h"
 #include "mongo/base/init.h"
@@ -48,6 +49,7 @@
 #include "mongo/db/storage/record_store_test_harness.h"
 #include "mongo/db/concurrency/write_conflict_exception.h"
 #include "mongo/stdx/memory.h"
+#include "mongo/stdx/thread.h"
 #include "mongo/unittest/temp_dir.h"
 #include "mongo/unittest/unittest.h"
 
@@ -84,7 +86,7 @@ class PmseSortedDataInterfaceHarnessHelper final
 
         IndexDescriptor desc(NULL, "", spec);
 
-        std::map<std::string, pool_base> pool_handler;
+        PmsePoolManager pool_handler;
 
         return stdx::make_unique<PmseSortedDataInterface>(
             "pool_test", &desc, _dbpath.path() + "/", &pool_handler);
@@ -106,4 +108,483 @@ MONGO_INITIALIZER(RegisterHarnessFactory)(InitializerContext* const) {
     mongo::registerHarnessHelperFactory(makeHarnessHelper);
     return Status::OK();
 }
+
+/* Indexes in one pool manager over a temporary directory */
+class PmseSortedDataInterfaceTest : public unittest::Test {
+ protected:
+    /* Index over keyPattern, options go to storageEngine.pmse of its spec */
+    PmseSortedDataInterface& makeIndex(const std::string& ident, bool unique,
+                                       const BSONObj& options = BSONObj(),
+                                       const BSONObj& keyPattern = BSON("a" << 1)) {
+        BSONObjBuilder spec;
+        spec.append("key", keyPattern);
+        spec.append("name", "testIndex");
+        spec.append("ns", "test.pmse");
+        spec.append("unique", unique);
+        if (!options.isEmpty())
+            spec.append("storageEngine", BSON("pmse" << options));
+        IndexDescriptor desc(NULL, "", spec.obj());
+        _indexes.push_back(stdx::make_unique<PmseSortedDataInterface>(
+            ident, &desc, _dbpath.path() + "/", &poolManager));
+        return *_indexes.back();
+    }
+
+    /* Closes all pools, indexes made afterwards are opened from their files */
+    void reopen() {
+        _indexes.clear();
+        poolManager.closeAll();
+    }
+
+    /* Tree of index opened by PmseSortedDataInterface, kept by its pool entry */
+    std::shared_ptr<PmseTree> treeOf(const std::string& ident) {
+        return std::static_pointer_cast<PmseTree>(poolManager.entry(ident)->volatileState);
+    }
+
+    BSONObj stats(PmseSortedDataInterface& sdi) {
+        BSONObjBuilder builder;
+        ASSERT_TRUE(sdi.appendCustomStats(&opCtx, &builder, 1));
+        return builder.obj();
+    }
+
+    /* Members are destroyed bottom up: indexes go before their pools and directory */
+ private:
+    unittest::TempDir _dbpath{"pmse_sorted_data_interface_test"};
+
+ protected:
+    PmsePoolManager poolManager;
+
+ private:
+    std::vector<std::unique_ptr<PmseSortedDataInterface>> _indexes;
+
+ protected:
+    OperationContextNoop opCtx{new PmseRecoveryUnit()};
+};
+
+TEST_F(PmseSortedDataInterfaceTest, InnerNodesAreRebuiltOnOpen) {
+    const int nKeys = 5000;
+
+    {
+        auto& sdi = makeIndex("rebuild_test", false, BSON("nodeSize" << 256));
+        for (int i = nKeys - 1; i >= 0; i--) {
+            ASSERT_OK(sdi.insert(&opCtx, BSON("" << i), RecordId(i + 1), true));
+        }
+        for (int i = 0; i < nKeys; i += 3) {
+            sdi.unindex(&opCtx, BSON("" << i), RecordId(i + 1), true);
+        }
+    }
+    reopen();
+
+    auto& sdi = makeIndex("rebuild_test", false, BSON("nodeSize" << 256));
+    auto cursor = sdi.newCursor(&opCtx, true);
+    int expected = 1;
+    for (auto entry = cursor->seek(BSON("" << 1), true, SortedDataInterface::Cursor::kKeyAndLoc);
+         entry; entry = cursor->next(SortedDataInterface::Cursor::kKeyAndLoc)) {
+        ASSERT_BSONOBJ_EQ(BSON("" << expected), entry->key);
+        expected += (expected % 3 == 1) ? 1 : 2;
+    }
+    ASSERT_EQUALS(nKeys, expected);
+    auto exact = sdi.newCursor(&opCtx, true)->seekExact(BSON("" << 4000),
+                                                        SortedDataInterface::Cursor::kKeyAndLoc);
+    ASSERT(exact);
+    ASSERT_EQUALS(RecordId(4001), exact->loc);
+}
+
+TEST_F(PmseSortedDataInterfaceTest, KeysKeepTypesAndLongKeys) {
+    auto& sdi = makeIndex("key_string_test", false);
+
+    /* 2.0 has TypeBits, long string is kept outside of the slot */
+    const BSONObj keys[] = {BSON("" << 1), BSON("" << 2.0), BSON("" << std::string(200, 'x'))};
+    for (int i = 0; i < 3; i++) {
+        ASSERT_OK(sdi.insert(&opCtx, keys[i], RecordId(i + 1), true));
+    }
+    auto cursor = sdi.newCursor(&opCtx, true);
+    int i = 0;
+    for (auto entry = cursor->seek(BSONObj(), true, SortedDataInterface::Cursor::kKeyAndLoc);
+         entry; entry = cursor->next(SortedDataInterface::Cursor::kKeyAndLoc), i++) {
+        ASSERT(keys[i].binaryEqual(entry->key));
+        ASSERT_EQUALS(RecordId(i + 1), entry->loc);
+    }
+    ASSERT_EQUALS(3, i);
+}
+
+TEST_F(PmseSortedDataInterfaceTest, KeysWithCommonPrefix) {
+    auto& sdi = makeIndex("prefix_test", true, BSONObj(), BSON("t" << 1 << "u" << 1));
+
+    /* Leaves of first tenant share long prefix, second tenant makes it shorter */
+    const std::string tenant(40, 't');
+    const int nKeys = 500;
+    for (int i = 0; i < nKeys; i++) {
+        int u = (i * 7919) % nKeys;
+        ASSERT_OK(sdi.insert(&opCtx, BSON("" << tenant << "" << u), RecordId(u + 1), false));
+    }
+    ASSERT_OK(sdi.insert(&opCtx, BSON("" << "other" << "" << 0), RecordId(nKeys + 1), false));
+    ASSERT_NOT_OK(sdi.insert(&opCtx, BSON("" << tenant << "" << 7), RecordId(nKeys + 2), false));
+
+    auto cursor = sdi.newCursor(&opCtx, true);
+    auto entry = cursor->seek(BSONObj(), true, SortedDataInterface::Cursor::kKeyAndLoc);
+    ASSERT(entry);
+    ASSERT_EQUALS(RecordId(nKeys + 1), entry->loc);
+    for (int u = 0; u < nKeys; u++) {
+        entry = cursor->next(SortedDataInterface::Cursor::kKeyAndLoc);
+        ASSERT(entry);
+        ASSERT_BSONOBJ_EQ(BSON("" << tenant << "" << u), entry->key);
+    }
+    ASSERT(!cursor->next(SortedDataInterface::Cursor::kKeyAndLoc));
+}
+TEST_F(PmseSortedDataInterfaceTest, UnindexFindsEntryAboveFreedSlot) {
+    auto& sdi = makeIndex("free_slot_test", false);
+
+    /* Slots 0-2, deleting the middle one leaves entry 2 in slot equal to key count */
+    for (int i = 0; i < 3; i++) {
+        ASSERT_OK(sdi.insert(&opCtx, BSON("" << i), RecordId(i + 1), true));
+    }
+    sdi.unindex(&opCtx, BSON("" << 1), RecordId(2), true);
+    sdi.unindex(&opCtx, BSON("" << 2), RecordId(3), true);
+    ASSERT_EQUALS(1, sdi.numEntries(&opCtx));
+    auto cursor = sdi.newCursor(&opCtx, true);
+    auto entry = cursor->seek(BSONObj(), true, SortedDataInterface::Cursor::kKeyAndLoc);
+    ASSERT(entry);
+    ASSERT_BSONOBJ_EQ(BSON("" << 0), entry->key);
+    ASSERT(!cursor->next(SortedDataInterface::Cursor::kKeyAndLoc));
+}
+
+TEST_F(PmseSortedDataInterfaceTest, ConcurrentWritersAndReaders) {
+    auto& sdi = makeIndex("concurrent_test", false, BSON("nodeSize" << 256));
+    const int nThreads = 4;
+    const int nKeys = 4000;
+
+    /* Writers split and empty leaves of each other, reader scans meanwhile */
+    std::vector<stdx::thread> threads;
+    for (int t = 0; t < nThreads; t++) {
+        threads.emplace_back([&sdi, t] {
+            OperationContextNoop opCtx(new PmseRecoveryUnit());
+            for (int i = t; i < nKeys; i += nThreads) {
+                ASSERT_OK(sdi.insert(&opCtx, BSON("" << i), RecordId(i + 1), true));
+            }
+            for (int i = t; i < nKeys; i += 2 * nThreads) {
+                sdi.unindex(&opCtx, BSON("" << i), RecordId(i + 1), true);
+            }
+        });
+    }
+    threads.emplace_back([&sdi] {
+        OperationContextNoop opCtx(new PmseRecoveryUnit());
+        for (int round = 0; round < 20; round++) {
+            auto cursor = sdi.newCursor(&opCtx, true);
+            int previous = -1;
+            for (auto entry = cursor->seek(BSONObj(), true, SortedDataInterface::Cursor::kKeyAndLoc);
+                 entry; entry = cursor->next(SortedDataInterface::Cursor::kKeyAndLoc)) {
+                ASSERT_LESS_THAN(previous, entry->key.firstElement().numberInt());
+                previous = entry->key.firstElement().numberInt();
+            }
+        }
+    });
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    ASSERT_EQUALS(nKeys / 2, sdi.numEntries(&opCtx));
+    auto cursor = sdi.newCursor(&opCtx, true);
+    /* Each writer removed every other of its keys */
+    int expected = nThreads;
+    for (auto entry = cursor->seek(BSONObj(), true, SortedDataInterface::Cursor::kKeyAndLoc);
+         entry; entry = cursor->next(SortedDataInterface::Cursor::kKeyAndLoc)) {
+        ASSERT_BSONOBJ_EQ(BSON("" << expected), entry->key);
+        expected += (expected % (2 * nThreads) == 2 * nThreads - 1) ? nThreads + 1 : 1;
+    }
+    ASSERT_EQUALS(nKeys + nThreads, expected);
+}
+
+TEST_F(PmseSortedDataInterfaceTest, BulkBuilderLoadsSortedKeys) {
+    auto& sdi = makeIndex("bulk_test", true, BSON("nodeSize" << 256));
+    /* Enough batches of leaves for all build threads */
+    const int nKeys = 50000;
+
+    {
+        std::unique_ptr<SortedDataBuilderInterface> builder(sdi.getBulkBuilder(&opCtx, false));
+        for (int i = 0; i < nKeys; i++) {
+            ASSERT_OK(builder->addKey(BSON("" << i), RecordId(i + 1)));
+        }
+        ASSERT_EQUALS(ErrorCodes::DuplicateKey,
+                      builder->addKey(BSON("" << nKeys - 1), RecordId(nKeys + 1)).code());
+        /* Nothing is visible before commit */
+        ASSERT_TRUE(sdi.isEmpty(&opCtx));
+        builder->commit(false);
+    }
+
+    ASSERT_EQUALS(nKeys, sdi.numEntries(&opCtx));
+    auto cursor = sdi.newCursor(&opCtx, true);
+    int expected = 0;
+    for (auto entry = cursor->seek(BSONObj(), true, SortedDataInterface::Cursor::kKeyAndLoc);
+         entry; entry = cursor->next(SortedDataInterface::Cursor::kKeyAndLoc)) {
+        ASSERT_BSONOBJ_EQ(BSON("" << expected), entry->key);
+        ASSERT_EQUALS(RecordId(expected + 1), entry->loc);
+        expected++;
+    }
+    ASSERT_EQUALS(nKeys, expected);
+    auto found = cursor->seekExact(BSON("" << 1234));
+    ASSERT(found);
+    ASSERT_EQUALS(RecordId(1235), found->loc);
+    ASSERT_OK(sdi.insert(&opCtx, BSON("" << nKeys), RecordId(nKeys + 1), false));
+    ASSERT_EQUALS(nKeys + 1, sdi.numEntries(&opCtx));
+}
+
+TEST_F(PmseSortedDataInterfaceTest, CountsFromSubtreeCounts) {
+    auto& sdi = makeIndex("counts_test", false, BSON("nodeSize" << 256));
+    auto tree = treeOf("counts_test");
+    const int nKeys = 3000;
+
+    for (int i = 0; i < nKeys; i++) {
+        ASSERT_OK(sdi.insert(&opCtx, BSON("" << i), RecordId(i + 1), true));
+    }
+    /* Every third key of the lower half goes */
+    for (int i = 0; i < nKeys / 2; i += 3) {
+        sdi.unindex(&opCtx, BSON("" << i), RecordId(i + 1), true);
+    }
+
+    ASSERT_EQUALS(nKeys - nKeys / 6, sdi.numEntries(&opCtx));
+    /* Without concurrent writers ranks are exact, 1000 entries are left below 1500 */
+    ASSERT_BSONOBJ_EQ(BSON("" << 1), tree->entryAtRank(0)->key);
+    ASSERT_BSONOBJ_EQ(BSON("" << 1499), tree->entryAtRank(999)->key);
+    ASSERT_BSONOBJ_EQ(BSON("" << 1500), tree->entryAtRank(1000)->key);
+    ASSERT_BSONOBJ_EQ(BSON("" << nKeys - 1), tree->entryAtRank(nKeys - nKeys / 6 - 1)->key);
+
+    auto random = sdi.newRandomCursor(&opCtx);
+    for (int round = 0; round < 200; round++) {
+        auto sample = random->next(SortedDataInterface::Cursor::kKeyAndLoc);
+        ASSERT(sample);
+        int key = sample->key.firstElement().numberInt();
+        ASSERT_TRUE(key >= nKeys / 2 || key % 3 != 0);
+        ASSERT_EQUALS(RecordId(key + 1), sample->loc);
+    }
+
+    BSONObj counts = stats(sdi);
+    ASSERT_EQUALS(nKeys - nKeys / 6, counts["entries"].numberLong());
+    ASSERT_GREATER_THAN(counts["height"].numberLong(), 2);
+    ASSERT_EQUALS(counts["leaves"].numberLong(),
+                  counts["leafSplits"].numberLong() + 1 - counts["leavesRemoved"].numberLong());
+    ASSERT_EQUALS(counts["height"].numberLong() - 1, counts["innerNodesPerLevel"].Obj().nFields());
+}
+
+TEST_F(PmseSortedDataInterfaceTest, MaintenanceMergesLeavesEmptiedByDeletes) {
+    auto& sdi = makeIndex("rebalance_test", false, BSON("nodeSize" << 1024));
+    auto tree = treeOf("rebalance_test");
+    const int nKeys = 2000;
+    auto leaves = [this, &sdi] { return stats(sdi)["leaves"].numberLong(); };
+
+    for (int i = 0; i < nKeys; i++) {
+        ASSERT_OK(sdi.insert(&opCtx, BSON("" << i), RecordId(i + 1), true));
+    }
+    long long before = leaves();
+    /* Deletes leave every leaf with an entry or two, which stay until maintenance */
+    for (int i = 0; i < nKeys; i++) {
+        if (i % 10 != 0)
+            sdi.unindex(&opCtx, BSON("" << i), RecordId(i + 1), true);
+    }
+    ASSERT_EQUALS(before, leaves());
+    poolManager.runMaintenance();
+    ASSERT_LESS_THAN(leaves(), before / 2);
+    ASSERT_EQUALS(nKeys / 10, sdi.numEntries(&opCtx));
+    ASSERT_BSONOBJ_EQ(BSON("" << 490), tree->entryAtRank(49)->key);
+    ASSERT_BSONOBJ_EQ(BSON("" << 500), tree->entryAtRank(50)->key);
+    auto cursor = sdi.newCursor(&opCtx, true);
+    int expected = 0;
+    for (auto entry = cursor->seek(BSON("" << 0), true, SortedDataInterface::Cursor::kKeyAndLoc);
+         entry; entry = cursor->next(SortedDataInterface::Cursor::kKeyAndLoc)) {
+        ASSERT_BSONOBJ_EQ(BSON("" << expected), entry->key);
+        ASSERT_EQUALS(RecordId(expected + 1), entry->loc);
+        expected += 10;
+    }
+    ASSERT_EQUALS(nKeys, expected);
+
+    /* Empty leaves are skipped by cursors until maintenance drops them */
+    for (int i = 0; i < nKeys; i += 10) {
+        sdi.unindex(&opCtx, BSON("" << i), RecordId(i + 1), true);
+    }
+    ASSERT_TRUE(sdi.isEmpty(&opCtx));
+    ASSERT_FALSE(sdi.newCursor(&opCtx, true)->seek(BSON("" << 0), true,
+                                                   SortedDataInterface::Cursor::kKeyAndLoc));
+    ASSERT_FALSE(sdi.newCursor(&opCtx, false)->seek(BSON("" << nKeys), true,
+                                                    SortedDataInterface::Cursor::kKeyAndLoc));
+    poolManager.runMaintenance();
+    ASSERT_LESS_THAN_OR_EQUALS(leaves(), 1);
+    ASSERT_OK(sdi.insert(&opCtx, BSON("" << 7), RecordId(8), true));
+    ASSERT_EQUALS(1, sdi.numEntries(&opCtx));
+}
+
+TEST_F(PmseSortedDataInterfaceTest, CompactMergesAndRelocatesLeaves) {
+    auto& sdi = makeIndex("compact_test", false, BSON("nodeSize" << 256));
+    auto tree = treeOf("compact_test");
+    const int nKeys = 3000;
+
+    /* Descending inserts allocate leaves against key order */
+    for (int i = nKeys - 1; i >= 0; i--) {
+        ASSERT_OK(sdi.insert(&opCtx, BSON("" << i), RecordId(i + 1), true));
+    }
+    for (int i = 0; i < nKeys; i += 2) {
+        sdi.unindex(&opCtx, BSON("" << i), RecordId(i + 1), true);
+    }
+    long long before = stats(sdi)["leaves"].numberLong();
+    ASSERT_OK(sdi.compact(&opCtx));
+    BSONObj after = stats(sdi);
+    ASSERT_LESS_THAN(after["leaves"].numberLong(), before);
+    ASSERT_GREATER_THAN(after["leafRelocations"].numberLong(), 0);
+    ASSERT_EQUALS(nKeys / 2, after["entries"].numberLong());
+
+    long long keys = 0;
+    ValidateResults results;
+    sdi.fullValidate(&opCtx, &keys, &results);
+    ASSERT_TRUE(results.valid);
+    ASSERT_EQUALS(nKeys / 2, keys);
+    auto cursor = sdi.newCursor(&opCtx, true);
+    int expected = 1;
+    for (auto entry = cursor->seek(BSON("" << 0), true, SortedDataInterface::Cursor::kKeyAndLoc);
+         entry; entry = cursor->next(SortedDataInterface::Cursor::kKeyAndLoc)) {
+        ASSERT_BSONOBJ_EQ(BSON("" << expected), entry->key);
+        ASSERT_EQUALS(RecordId(expected + 1), entry->loc);
+        expected += 2;
+    }
+    ASSERT_EQUALS(nKeys + 1, expected);
+    ASSERT_BSONOBJ_EQ(BSON("" << 999), tree->entryAtRank(499)->key);
+    ASSERT_BSONOBJ_EQ(BSON("" << 1001), tree->entryAtRank(500)->key);
+}
+
+TEST_F(PmseSortedDataInterfaceTest, HashTableServesExactSeeks) {
+    auto& sdi = makeIndex("hash_table_test", false, BSON("hashTable" << true));
+
+    /* Enough keys to split buckets, two records per key */
+    const int nKeys = 4000;
+    for (int i = 0; i < nKeys; i++) {
+        ASSERT_OK(sdi.insert(&opCtx, BSON("" << i), RecordId(2 * i + 2), true));
+        ASSERT_OK(sdi.insert(&opCtx, BSON("" << i), RecordId(2 * i + 1), true));
+    }
+    for (int i = 0; i < nKeys; i += 2) {
+        sdi.unindex(&opCtx, BSON("" << i), RecordId(2 * i + 1), true);
+    }
+    auto forward = sdi.newCursor(&opCtx, true);
+    auto backward = sdi.newCursor(&opCtx, false);
+    for (int i = 0; i < nKeys; i++) {
+        auto entry = forward->seekExact(BSON("" << i), SortedDataInterface::Cursor::kKeyAndLoc);
+        ASSERT(entry);
+        ASSERT_BSONOBJ_EQ(BSON("" << i), entry->key);
+        ASSERT_EQUALS(RecordId(i % 2 ? 2 * i + 1 : 2 * i + 2), entry->loc);
+        entry = backward->seekExact(BSON("" << i), SortedDataInterface::Cursor::kKeyAndLoc);
+        ASSERT(entry);
+        ASSERT_EQUALS(RecordId(2 * i + 2), entry->loc);
+    }
+    ASSERT(!forward->seekExact(BSON("" << nKeys), SortedDataInterface::Cursor::kKeyAndLoc));
+
+    /* Cursor goes on in the tree after entry found in hash table */
+    auto entry = forward->seekExact(BSON("" << 11), SortedDataInterface::Cursor::kKeyAndLoc);
+    entry = forward->next(SortedDataInterface::Cursor::kKeyAndLoc);
+    ASSERT(entry);
+    ASSERT_EQUALS(RecordId(24), entry->loc);
+    entry = forward->next(SortedDataInterface::Cursor::kKeyAndLoc);
+    ASSERT(entry);
+    ASSERT_BSONOBJ_EQ(BSON("" << 12), entry->key);
+}
+
+TEST_F(PmseSortedDataInterfaceTest, ScansRunsOfDuplicateKeys) {
+    auto& sdi = makeIndex("duplicates_test", false, BSONObj(), BSON("status" << 1));
+
+    /* Few keys with many records each, 2.0 keeps TypeBits */
+    const BSONObj keys[] = {BSON("" << "active"), BSON("" << 2.0), BSON("" << "new")};
+    const int nRecords = 300;
+    for (int i = 0; i < 3 * nRecords; i++) {
+        ASSERT_OK(sdi.insert(&opCtx, keys[i % 3], RecordId(i + 1), true));
+    }
+    for (int k = 0; k < 3; k++) {
+        for (bool forward : {true, false}) {
+            auto cursor = sdi.newCursor(&opCtx, forward);
+            cursor->setEndPosition(keys[k], true);
+            int count = 0;
+            int64_t last = 0;
+            for (auto entry = cursor->seek(keys[k], true, SortedDataInterface::Cursor::kKeyAndLoc);
+                 entry; entry = cursor->next(SortedDataInterface::Cursor::kKeyAndLoc), count++) {
+                ASSERT(keys[k].binaryEqual(entry->key));
+                ASSERT_EQUALS(k, (entry->loc.repr() - 1) % 3);
+                if (count > 0)
+                    ASSERT(forward ? entry->loc.repr() > last : entry->loc.repr() < last);
+                last = entry->loc.repr();
+            }
+            ASSERT_EQUALS(nRecords, count);
+        }
+    }
+}
+TEST_F(PmseSortedDataInterfaceTest, PostingListsKeepLongDuplicateRuns) {
+    auto& sdi = makeIndex("posting_test", false, BSON("nodeSize" << 256));
+    /* Every fourth record keeps TypeBits of 1.0 in the same list */
+    auto keyOf = [](int64_t record) { return record % 4 ? BSON("" << 1) : BSON("" << 1.0); };
+
+    /* More records than one list holds, in shuffled order, then keys on both sides */
+    const int nRecords = 5000;
+    for (int i = 0; i < nRecords; i++) {
+        int64_t record = (i * 7919) % nRecords + 1;
+        ASSERT_OK(sdi.insert(&opCtx, keyOf(record), RecordId(record), true));
+    }
+    for (int i = 0; i < 100; i++) {
+        ASSERT_OK(sdi.insert(&opCtx, BSON("" << 0), RecordId(nRecords + i + 1), true));
+        ASSERT_OK(sdi.insert(&opCtx, BSON("" << 2), RecordId(nRecords + i + 101), true));
+    }
+    ASSERT_GREATER_THAN(stats(sdi)["postingLeaves"].numberLong(), 0);
+    ASSERT_EQUALS(nRecords + 200, sdi.numEntries(&opCtx));
+
+    for (bool forward : {true, false}) {
+        auto cursor = sdi.newCursor(&opCtx, forward);
+        cursor->setEndPosition(BSON("" << 1), true);
+        int64_t expected = forward ? 1 : nRecords;
+        for (auto entry = cursor->seek(BSON("" << 1), true, SortedDataInterface::Cursor::kKeyAndLoc);
+             entry; entry = cursor->next(SortedDataInterface::Cursor::kKeyAndLoc)) {
+            ASSERT_EQUALS(RecordId(expected), entry->loc);
+            ASSERT(keyOf(expected).binaryEqual(entry->key));
+            expected += forward ? 1 : -1;
+        }
+        ASSERT_EQUALS(forward ? nRecords + 1 : 0, expected);
+        auto exact = sdi.newCursor(&opCtx, forward)->seekExact(BSON("" << 1));
+        ASSERT(exact);
+        ASSERT_EQUALS(RecordId(forward ? 1 : nRecords), exact->loc);
+    }
+
+    /* Lists shrink back towards slots, neighbouring keys stay in place */
+    for (int64_t record = 1; record <= nRecords; record++) {
+        if (record % 10 != 0)
+            sdi.unindex(&opCtx, keyOf(record), RecordId(record), true);
+    }
+    long long keys = 0;
+    ValidateResults results;
+    sdi.fullValidate(&opCtx, &keys, &results);
+    ASSERT_TRUE(results.valid);
+    ASSERT_EQUALS(nRecords / 10 + 200, keys);
+    auto cursor = sdi.newCursor(&opCtx, true);
+    auto entry = cursor->seek(BSON("" << 1), true, SortedDataInterface::Cursor::kKeyAndLoc);
+    for (int64_t record = 10; record <= nRecords; record += 10) {
+        ASSERT(entry);
+        ASSERT_EQUALS(RecordId(record), entry->loc);
+        entry = cursor->next(SortedDataInterface::Cursor::kKeyAndLoc);
+    }
+    ASSERT(entry);
+    ASSERT_BSONOBJ_EQ(BSON("" << 2), entry->key);
+
+    /* Bulk builder writes runs longer than a leaf as posting lists */
+    auto& bulk = makeIndex("posting_bulk_test", false, BSON("nodeSize" << 256));
+    {
+        std::unique_ptr<SortedDataBuilderInterface> builder(bulk.getBulkBuilder(&opCtx, true));
+        for (int i = 0; i < 3 * nRecords; i++) {
+            ASSERT_OK(builder->addKey(BSON("" << i / nRecords), RecordId(i + 1)));
+        }
+        builder->commit(false);
+    }
+    ASSERT_GREATER_THAN(stats(bulk)["postingLeaves"].numberLong(), 0);
+    ASSERT_EQUALS(3 * nRecords, bulk.numEntries(&opCtx));
+    auto found = bulk.newCursor(&opCtx, true)->seekExact(BSON("" << 2));
+    ASSERT(found);
+    ASSERT_EQUALS(RecordId(2 * nRecords + 1), found->loc);
+    cursor = bulk.newCursor(&opCtx, false);
+    cursor->setEndPosition(BSON("" << 1), true);
+    int64_t expected = 2 * nRecords;
+    for (entry = cursor->seek(BSON("" << 1), true, SortedDataInterface::Cursor::kKeyAndLoc);
+         entry; entry = cursor->next(SortedDataInterface::Cursor::kKeyAndLoc)) {
+        ASSERT_EQUALS(RecordId(expected--), entry->loc);
+    }
+    ASSERT_EQUALS(nRecords, expected);
+}
 }  // namespace mongo
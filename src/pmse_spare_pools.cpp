@@ -0,0 +1,217 @@
+/*
+ * Copyright 2014-2020, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
+
+#include "pmse_spare_pools.h"
+#include "pmse_map.h"
+#include "pmse_pool_manager.h"
+#include "pmse_server_parameters.h"
+#include "pmse_tree.h"
+
+#include <libpmemobj++/make_persistent.hpp>
+#include <libpmemobj++/transaction.hpp>
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <string>
+
+#include "mongo/util/log.h"
+#include "mongo/util/time_support.h"
+
+using pmem::obj::transaction;
+
+namespace mongo {
+
+namespace {
+const std::string sparePrefix = "pmse_spare_";
+const std::string kindNames[PmseSparePools::kKinds] = {"mapper", "index"};
+const std::string tmpSuffix = ".tmp";
+
+/* Spare number of file name, false for anything but plain decimal number */
+bool parseNumber(const std::string& text, uint64_t* number) {
+    if (text.empty() || text.size() > 19 ||
+        !std::all_of(text.begin(), text.end(), [](char c) { return c >= '0' && c <= '9'; }))
+        return false;
+    *number = std::stoull(text);
+    return true;
+}
+
+uint64_t expectedPartitions() {
+    return pmseRecordStorePartitions > 1 ? pmseRecordStorePartitions : 1;
+}
+}  // namespace
+
+PmseSparePools::PmseSparePools(const std::string& dbpath, int count)
+    : BackgroundJob(false), _dbPath(dbpath), _count(count) {}
+
+void PmseSparePools::run() {
+    loadExisting();
+    stdx::unique_lock<stdx::mutex> lock(_mutex);
+    while (!_shutdown) {
+        int kind = _ready[kRecordStore].size() <= _ready[kIndex].size() ? kRecordStore : kIndex;
+        if (_ready[kind].size() >= _count) {
+            _cond.wait(lock);
+            continue;
+        }
+        std::string path = sparePath(static_cast<Kind>(kind), _nextNumber++);
+        lock.unlock();
+        bool created = createSpare(static_cast<Kind>(kind), path);
+        lock.lock();
+        if (!created) {
+            // Probably out of space, try again later
+            _cond.wait_for(lock, Seconds(10).toSystemDuration());
+            continue;
+        }
+        _ready[kind].push_back(path);
+    }
+}
+
+bool PmseSparePools::claim(Kind kind, const std::string& target) {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    if (_ready[kind].empty())
+        return false;
+    std::string path = _ready[kind].front();
+    boost::system::error_code ec;
+    boost::filesystem::rename(path, target, ec);
+    if (ec) {
+        // E.g. partition directory on another filesystem, spare stays for others
+        log() << "Cannot claim spare pool " << path << ": " << ec.message();
+        return false;
+    }
+    _ready[kind].pop_front();
+    _cond.notify_one();
+    return true;
+}
+
+void PmseSparePools::shutdown() {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    _shutdown = true;
+    _cond.notify_one();
+}
+
+/*
+ * Reuses spares left by previous run. Unfinished ones and spares created
+ * with different number of partitions are removed, files with names not
+ * made by us are left alone.
+ */
+void PmseSparePools::loadExisting() {
+    boost::system::error_code ec;
+    for (boost::filesystem::directory_iterator it(_dbPath, ec), end; !ec && it != end; it.increment(ec)) {
+        std::string filename = it->path().filename().string();
+        if (!boost::starts_with(filename, sparePrefix))
+            continue;
+        std::string path = it->path().string();
+        bool valid = false;
+        if (!boost::ends_with(filename, tmpSuffix)) {
+            uint64_t number;
+            if (!parseNumber(filename.substr(filename.rfind('.') + 1), &number)) {
+                log() << "Skipping unknown file " << path;
+                continue;
+            }
+            for (int kind = 0; kind < kKinds; kind++) {
+                if (boost::starts_with(filename, sparePrefix + kindNames[kind] + ".") &&
+                    isValidSpare(static_cast<Kind>(kind), path)) {
+                    stdx::lock_guard<stdx::mutex> lock(_mutex);
+                    _nextNumber = std::max(_nextNumber, number + 1);
+                    _ready[kind].push_back(path);
+                    valid = true;
+                }
+            }
+        }
+        if (!valid) {
+            boost::system::error_code removeError;
+            boost::filesystem::remove(path, removeError);
+            if (removeError)
+                log() << "Cannot remove spare pool " << path << ": " << removeError.message();
+        }
+    }
+}
+
+bool PmseSparePools::isValidSpare(Kind kind, const std::string& path) {
+    bool valid = false;
+    try {
+        if (kind == kRecordStore) {
+            auto pop = pool<root>::open(path, "pmse_mapper");
+            auto mapper_root = pop.get_root();
+            valid = mapper_root->kvmap_root_ptr && mapper_root->partitions == expectedPartitions();
+            pop.close();
+        } else {
+            auto pop = pool<PmseTreeRoot>::open(path, "pmse_index");
+            pop.close();
+            valid = true;
+        }
+    } catch (std::exception &e) {
+        log() << "Invalid spare pool " << path << ": " << e.what();
+    }
+    return valid;
+}
+
+/*
+ * Spare is created under temporary name and renamed when it is fully
+ * formatted, so a crash never leaves half initialized spare behind.
+ */
+bool PmseSparePools::createSpare(Kind kind, const std::string& path) {
+    std::string tmpPath = path + tmpSuffix;
+    try {
+        if (kind == kRecordStore) {
+            auto pop = pool<root>::create(tmpPath, "pmse_mapper", RECORD_STORE_POOL_SIZE, 0664);
+            auto mapper_root = pop.get_root();
+            uint64_t partitions = expectedPartitions();
+            transaction::exec_tx(pop, [mapper_root, partitions] {
+                mapper_root->partitions = partitions;
+                mapper_root->kvmap_root_ptr = make_persistent<PmseMap<InitData>>(false, 0, 0);
+                mapper_root->kvmap_root_ptr->storeCounters();
+            });
+            mapper_root->kvmap_root_ptr->initialize(true);
+            pop.close();
+        } else {
+            auto pop = pool<PmseTreeRoot>::create(tmpPath, "pmse_index", INDEX_POOL_SIZE, 0664);
+            pop.close();
+        }
+        boost::filesystem::rename(tmpPath, path);
+    } catch (std::exception &e) {
+        log() << "Cannot create spare pool " << path << ": " << e.what();
+        boost::system::error_code ec;
+        boost::filesystem::remove(tmpPath, ec);
+        return false;
+    }
+    return true;
+}
+
+std::string PmseSparePools::sparePath(Kind kind, uint64_t number) const {
+    return _dbPath + sparePrefix + kindNames[kind] + "." + std::to_string(number);
+}
+
+}  // namespace mongo
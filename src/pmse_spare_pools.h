@@ -0,0 +1,89 @@
+/*
+ * Copyright 2014-2020, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_PMSE_SPARE_POOLS_H_
+#define SRC_PMSE_SPARE_POOLS_H_
+
+#include <deque>
+#include <string>
+
+#include "mongo/stdx/condition_variable.h"
+#include "mongo/stdx/mutex.h"
+#include "mongo/util/background.h"
+
+namespace mongo {
+
+/*
+ * Keeps a few pre-created and formatted pool files in dbpath, so creating
+ * collection or index only renames one of them instead of creating and
+ * zeroing whole pool under engine mutex. Spares are refilled in background.
+ * Only pools with default size and layout are kept: record store pools of
+ * not capped, not system collections and indexes of not system collections.
+ */
+class PmseSparePools : public BackgroundJob {
+ public:
+    enum Kind { kRecordStore = 0, kIndex = 1, kKinds = 2 };
+
+    PmseSparePools(const std::string& dbpath, int count);
+
+    std::string name() const {
+        return "PmseSparePools";
+    }
+
+    void run();
+
+    /*
+     * Moves spare pool of given kind to target path. Returns false if there
+     * is no spare ready or it cannot be moved there, caller has to create
+     * pool by itself then.
+     */
+    bool claim(Kind kind, const std::string& target);
+
+    void shutdown();
+
+ private:
+    void loadExisting();
+    bool createSpare(Kind kind, const std::string& path);
+    bool isValidSpare(Kind kind, const std::string& path);
+    std::string sparePath(Kind kind, uint64_t number) const;
+
+    const std::string _dbPath;
+    const size_t _count;
+    stdx::mutex _mutex;
+    stdx::condition_variable _cond;
+    bool _shutdown = false;
+    uint64_t _nextNumber = 0;
+    std::deque<std::string> _ready[kKinds];
+};
+
+}  // namespace mongo
+#endif  // SRC_PMSE_SPARE_POOLS_H_
@@ -91,7 +91,7 @@ class PmseHarnessHelper final : public RecordStoreHarnessHelper {
         options.cappedSize = -1;
         options.cappedMaxDocs = -1;
 
-        std::map<std::string, pool_base> pool_handler;
+        PmsePoolManager pool_handler;
         auto ret = stdx::make_unique<PmseRecordStore>(
             ns, "pool_test", options, _dbpath.path() + "/", &pool_handler);
 
@@ -115,7 +115,7 @@ class PmseHarnessHelper final : public RecordStoreHarnessHelper {
         options.cappedSize = cappedMaxSize;
         options.cappedMaxDocs = cappedMaxDocs;
 
-        std::map<std::string, pool_base> pool_handler;
+        PmsePoolManager pool_handler;
         auto ret = stdx::make_unique<PmseRecordStore>(
             ns, "pool_test", options, _dbpath.path() + "/", &pool_handler);
 
@@ -30,917 +30,2610 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+
 #define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
 
 #include "pmse_tree.h"
 #include "pmse_sorted_data_interface.h"
 #include "pmse_change.h"
 
-#include <list>
+#include <algorithm>
+#include <numeric>
+#include <unordered_set>
 #include <utility>
 
 #include "mongo/platform/basic.h"
+#include "mongo/platform/bits.h"
 #include "mongo/db/storage/sorted_data_interface.h"
+#include "mongo/util/bufreader.h"
 #include "mongo/util/log.h"
+#include "mongo/util/time_support.h"
 #include "mongo/stdx/memory.h"
+#include "mongo/stdx/thread.h"
 
 #include "libpmemobj++/transaction.hpp"
 #include "libpmemobj++/make_persistent_array.hpp"
 
 namespace mongo {
 
+namespace {
 
-int64_t IndexKeyEntry_PM::compareEntries(IndexKeyEntry& leftEntry,
-                                         IndexKeyEntry_PM& rightEntry,
-                                         const BSONObj& ordering) {
-    IndexEntryComparison c(Ordering::make(ordering));
-    return c.compare(leftEntry, IndexKeyEntry(rightEntry.getBSON(), RecordId(rightEntry.loc)));
-}
+/* Below this number of leaves per thread rebuild is not worth spawning threads */
+const size_t REBUILD_LEAVES_PER_THREAD = 4096;
 
-BSONObj IndexKeyEntry_PM::getBSON() {
-    char* data_ptr = data.get();
-    return BSONObj(data_ptr);
-}
+/* Leaves written or freed in one transaction by bulk load */
+const size_t BULK_LEAVES_PER_TX = 128;
 
-bool PmseTree::remove(pool_base pop, IndexKeyEntry& entry,
-                      bool dupsAllowed, const BSONObj& ordering) {
-    persistent_ptr<PmseTreeNode> node;
-    uint64_t i;
-    int64_t cmp;
-    std::list<pmem::obj::shared_mutex*> locks;
-    persistent_ptr<PmseTreeNode> lockNode;
-    _ordering = ordering;
-    // find node with key
-    if (!_root)
-        return false;
-    node = locateLeafWithKeyPM(_root, entry, _ordering, locks, lockNode, false);
+/* Threads inside epoch guards at the same time, more of them wait */
+const size_t EPOCH_SLOTS = 1024;
 
-    for (i = 0; i < node->num_keys; i++) {
-        cmp = IndexKeyEntry_PM::compareEntries(entry, node->keys[i], _ordering);
-        if (cmp == 0) {
-            break;
+struct alignas(64) EpochSlot {
+    std::atomic<uint64_t> epoch{0};  // 0 outside guard
+    std::atomic<bool> taken{false};
+};
+
+std::atomic<uint64_t> globalEpoch{1};
+EpochSlot epochSlots[EPOCH_SLOTS];
+
+/* Slot of thread, claimed on first guard and released at thread exit */
+struct ThreadEpoch {
+    ThreadEpoch() {
+        for (size_t i = 0;; i = (i + 1) % EPOCH_SLOTS) {
+            bool expected = false;
+            if (epochSlots[i].taken.compare_exchange_strong(expected, true)) {
+                slot = &epochSlots[i];
+                return;
+            }
+            if (i == EPOCH_SLOTS - 1)
+                stdx::this_thread::yield();
         }
     }
-    // not found
-    if (i == node->num_keys) {
-        if (lockNode) {
-               lockNode->_pmutex.unlock();
-           }
-        unlockTree(locks);
-        return false;
-    }
-    _root = deleteEntry(pop, entry, node, i);
-    if (lockNode) {
-       lockNode->_pmutex.unlock();
+
+    ~ThreadEpoch() {
+        slot->taken.store(false, std::memory_order_release);
     }
-    unlockTree(locks);
-    return true;
-}
 
-persistent_ptr<PmseTreeNode> PmseTree::deleteEntry(pool_base pop,
-                                                   IndexKeyEntry& key,
-                                                   persistent_ptr<PmseTreeNode> node,
-                                                   uint64_t index) {
-    uint64_t min_keys;
-    int64_t neighbor_index;
-    int64_t k_prime_index;
-    IndexKeyEntry_PM k_prime;
-    uint64_t capacity;
-    persistent_ptr<PmseTreeNode> neighbor;
+    EpochSlot* slot;
+    uint64_t depth = 0;
+};
 
-    // Remove key and pointer from node.
-    node = removeEntryFromNode(key, node, index);
+thread_local ThreadEpoch threadEpoch;
 
-    if (node == _root) {
-        return adjustRoot(_root);
+/*
+ * Index of child which contains entry. Node may change meanwhile, so
+ * result is used only after its version is validated.
+ */
+size_t childIndex(const PmseInnerNode* node, StringData entry) {
+    size_t count = std::min<size_t>(node->childCount(), INNER_NODE_ORDER + 2);
+    size_t low = 0;
+    size_t high = count > 0 ? count - 1 : 0;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        const std::string* key = node->keys[middle].load(std::memory_order_relaxed);
+        if (key && entry.compare(*key) >= 0)
+            low = middle + 1;
+        else
+            high = middle;
     }
-    /* Case:  deletion from a node below the root.
-     * (Rest of function body.)
-     */
-
-    /* Determine minimum allowable size of node,
-     * to be preserved after deletion.
-     */
-    min_keys = node->is_leaf ? cut(TREE_ORDER - 1) : cut(TREE_ORDER) - 1;
-    /* Case:  node stays at or above minimum.
-     * (The simple case.)
-     */
+    return low;
+}
 
-    if (node->num_keys >= min_keys)
-        return _root;
+/* Length of common prefix */
+uint64_t commonPrefix(StringData a, StringData b) {
+    uint64_t length = 0;
+    while (length < a.size() && length < b.size() && a[length] == b[length])
+        length++;
+    return length;
+}
 
-    /* Case:  node falls below minimum.
-     * Either coalescence or redistribution
-     * is needed.
-     */
+/*
+ * Shortest separator s with left < s <= right, the right entry cut after
+ * first byte differing from left. Inner nodes compare only bytes, so it
+ * routes as well as the whole entry.
+ */
+std::string shortestSeparator(StringData left, StringData right) {
+    return right.substr(0, commonPrefix(left, right) + 1).toString();
+}
 
-    /* Find the appropriate neighbor node with which
-     * to coalesce.
-     * Also find the key (k_prime) in the parent
-     * between the pointer to node n and the pointer
-     * to the neighbor.
-     */
-    neighbor_index = getNeighborIndex(node);
-    k_prime_index = neighbor_index == -1 ? 0 : neighbor_index;
-    k_prime = node->parent->keys[k_prime_index];
-    neighbor = neighbor_index == -1 ?
-               node->parent->children_array[1] :
-               node->parent->children_array[neighbor_index];
-
-    capacity = node->is_leaf ? TREE_ORDER : TREE_ORDER - 1;
-
-    /* Coalescence. */
-    if (neighbor->num_keys + node->num_keys < capacity)
-        return coalesceNodes(pop, _root, node, neighbor, neighbor_index, k_prime);
-    else
-        return redistributeNodes(pop, _root, node, neighbor, neighbor_index,
-                                 k_prime_index, k_prime);
-}
-
-/* Redistributes entries between two nodes when
- * one has become too small after deletion
- * but its neighbor is too big to append the
- * small node's entries without exceeding the
- * maximum
- */
-persistent_ptr<PmseTreeNode> PmseTree::redistributeNodes(
-                pool_base pop, persistent_ptr<PmseTreeNode> root,
-                persistent_ptr<PmseTreeNode> n,
-                persistent_ptr<PmseTreeNode> neighbor, int64_t neighbor_index,
-                int64_t k_prime_index, IndexKeyEntry_PM k_prime) {
-    uint64_t i;
-    persistent_ptr<PmseTreeNode> tmp;
-    /* Case: n has a neighbor to the left.
-     * Pull the neighbor's last key-pointer pair over
-     * from the neighbor's right end to n's left end.
-     */
-    if (neighbor_index != -1) {
-        if (!n->is_leaf) {
-            n->children_array[n->num_keys + 1] = n->children_array[n->num_keys];
-            for (i = n->num_keys; i > 0; i--) {
-                n->keys[i] = n->keys[i - 1];
-                n->children_array[i] = n->children_array[i - 1];
-            }
-        } else {
-            for (i = n->num_keys; i > 0; i--) {
-                n->keys[i] = n->keys[i - 1];
-            }
-        }
-        if (!n->is_leaf) {
-            n->children_array[0] = neighbor->children_array[neighbor->num_keys];
-            tmp = n->children_array[0];
-            tmp->parent = n;
-            neighbor->children_array[neighbor->num_keys] = nullptr;
-            n->keys[0] = k_prime;
-            n->parent->keys[k_prime_index].data =
-                            neighbor->keys[neighbor->num_keys - 1].data;
-            n->parent->keys[k_prime_index].loc = neighbor->keys[neighbor->num_keys - 1].loc;
-        } else {
-            n->keys[0] = neighbor->keys[neighbor->num_keys - 1];
-            persistent_ptr<char> obj;
-                obj = pmemobj_tx_alloc(n->keys[0].getBSON().objsize(), 1);
-                memcpy(static_cast<void*>(obj.get()),
-                       n->keys[0].getBSON().objdata(),
-                       n->keys[0].getBSON().objsize());
-            if (n->parent->keys[k_prime_index].data) {
-                pmemobj_tx_free(n->parent->keys[k_prime_index].data.raw());
-            }
-            n->parent->keys[k_prime_index].data = obj;
-            n->parent->keys[k_prime_index].loc = n->keys[0].loc;
+/*
+ * Inner nodes over at least two leaves in key order, keys[i] separates
+ * leaf i from the one before. Levels are built bottom-up, each node
+ * remembers its lowest leaf. Separators are moved out of keys.
+ */
+PmseInnerNode* buildInnerNodes(const std::vector<persistent_ptr<PmseTreeNode>>& leaves,
+                               std::vector<std::string>& keys) {
+    const size_t n = leaves.size();
+    const size_t fanout = INNER_NODE_ORDER;
+    std::vector<std::pair<PmseInnerNode*, size_t>> level;
+    for (size_t i = 0; i < n; i += fanout) {
+        auto node = new PmseInnerNode(true);
+        for (size_t j = i; j < std::min(n, i + fanout); j++) {
+            node->append(j > i ? new std::string(std::move(keys[j])) : nullptr,
+                         nullptr, leaves[j].raw().off, leaves[j]->num_keys);
         }
-    } else {
-        /*
-         * Case: n is the leftmost child.
-         * Take a key-pointer pair from the neighbor to the right.
-         * Move the neighbor's leftmost key-pointer pair
-         * to n's rightmost position.
-         */
-        if (n->is_leaf) {
-            n->keys[n->num_keys] = neighbor->keys[0];
-            persistent_ptr<char> obj;
-            obj = pmemobj_tx_alloc(neighbor->keys[1].getBSON().objsize(), 1);
-            memcpy(static_cast<void*>(obj.get()),
-                   neighbor->keys[1].getBSON().objdata(),
-                   neighbor->keys[1].getBSON().objsize());
-
-            if (n->parent->keys[k_prime_index].data) {
-                pmemobj_tx_free(n->parent->keys[k_prime_index].data.raw());
-            }
-
-            n->parent->keys[k_prime_index].data = obj;
-            n->parent->keys[k_prime_index].loc = neighbor->keys[1].loc;
-        } else {
-            n->keys[n->num_keys] = k_prime;
-            n->children_array[n->num_keys + 1] = neighbor->children_array[0];
-            tmp = n->children_array[n->num_keys + 1];
-            tmp->parent = n;
-
-            n->parent->keys[k_prime_index].data = neighbor->keys[0].data;
-            n->parent->keys[k_prime_index].loc = neighbor->keys[0].loc;
-        }
-        if (!n->is_leaf) {
-            for (i = 0; i < neighbor->num_keys - 1; i++) {
-                neighbor->keys[i] = neighbor->keys[i + 1];
-                neighbor->children_array[i] = neighbor->children_array[i + 1];
-            }
-            neighbor->children_array[i] = neighbor->children_array[i + 1];
-        } else {
-            for (i = 0; i < neighbor->num_keys - 1; i++) {
-                neighbor->keys[i] = neighbor->keys[i + 1];
+        level.emplace_back(node, i);
+    }
+    while (level.size() > 1) {
+        std::vector<std::pair<PmseInnerNode*, size_t>> upper;
+        for (size_t i = 0; i < level.size(); i += fanout) {
+            auto node = new PmseInnerNode(false);
+            for (size_t j = i; j < std::min(level.size(), i + fanout); j++) {
+                size_t low = level[j].second;
+                node->append(j > i ? new std::string(std::move(keys[low])) : nullptr,
+                             level[j].first, 0, level[j].first->total());
             }
+            upper.emplace_back(node, level[i].second);
         }
+        level = std::move(upper);
     }
+    return level[0].first;
+}
 
-    /*
-     * n now has one more key and one more pointer;
-     * the neighbor has one fewer of each.
-     */
-    n->num_keys++;
-    neighbor->num_keys--;
-    return root;
+/* Slot order is plain bytes, whole array is snapshotted before change */
+void snapshotSlotOrder(persistent_ptr<PmseTreeNode> node) {
+    pmemobj_tx_add_range_direct(node->slotOrder(), PmseTreeNode::arrayLength(node->capacity));
 }
 
 /*
- * Coalesces a node that has become
- * too small after deletion
- * with a neighboring node that
- * can accept the additional entries
- * without exceeding the maximum.
+ * Bytes of separators in subtree with their heap buffers, short ones fit
+ * in the string itself. Read without locks under epoch guard, so it is
+ * only as exact as statistics need.
  */
-persistent_ptr<PmseTreeNode> PmseTree::coalesceNodes(
-                pool_base pop, persistent_ptr<PmseTreeNode> root,
-                persistent_ptr<PmseTreeNode> n,
-                persistent_ptr<PmseTreeNode> neighbor, int64_t neighbor_index,
-                IndexKeyEntry_PM k_prime) {
-    uint64_t i, j, neighbor_insertion_index, n_end;
-    persistent_ptr<PmseTreeNode> tmp;
-    IndexKeyEntry k_prime_temp(k_prime.getBSON(), RecordId((k_prime).loc));
-    // Swap neighbor with node if node is on the extreme left and neighbor is to its right.
-    if (neighbor_index == -1) {
-        std::swap(n, neighbor);
+uint64_t separatorBytes(const PmseInnerNode* node) {
+    static const size_t inlineCapacity = std::string().capacity();
+    uint64_t bytes = 0;
+    size_t n = std::min<size_t>(node->childCount(), INNER_NODE_ORDER + 2);
+    for (size_t i = 0; i + 1 < n; i++) {
+        const std::string* key = node->keys[i].load(std::memory_order_acquire);
+        if (key)
+            bytes += sizeof(std::string) + (key->capacity() > inlineCapacity ? key->capacity() + 1 : 0);
     }
-
-    /*
-     * Starting point in the neighbor for copying
-     * keys and pointers from n.
-     * Recall that n and neighbor have swapped places
-     * in the special case of n being a leftmost child.
-     */
-    neighbor_insertion_index = neighbor->num_keys;
-
-    /*
-     * Case:  nonleaf node.
-     * Append k_prime and the following pointer.
-     * Append all pointers and keys from the neighbor.
-     */
-    if (!n->is_leaf) {
-        /*
-         * Append k_prime.
-         */
-        neighbor->keys[neighbor_insertion_index].data = pmemobj_tx_alloc(k_prime.getBSON().objsize(), 1);
-        memcpy(static_cast<void*>(neighbor->keys[neighbor_insertion_index].data.get()), k_prime.getBSON().objdata(),
-               k_prime.getBSON().objsize());
-        (neighbor->keys[neighbor_insertion_index]).loc = k_prime.loc;
-        neighbor->num_keys++;
-        n_end = n->num_keys;
-
-        for (i = neighbor_insertion_index + 1, j = 0; j < n_end; i++, j++) {
-            neighbor->keys[i] = n->keys[j];
-            neighbor->children_array[i] = n->children_array[j];
-            neighbor->num_keys++;
-            n->num_keys--;
-        }
-
-        /*
-         * The number of pointers is always
-         * one more than the number of keys.
-         */
-        neighbor->children_array[i] = n->children_array[j];
-
-         // All children must now point up to the same parent.
-        for (i = 0; i < neighbor->num_keys + 1; i++) {
-            tmp = neighbor->children_array[i];
-            tmp->parent = neighbor;
-        }
-    } else {
-        /* In a leaf, append the keys and pointers of
-         * n to the neighbor.
-         * Set the neighbor's last pointer to point to
-         * what had been n's right neighbor.
-         */
-        for (i = neighbor_insertion_index, j = 0; j < n->num_keys; i++, j++) {
-            neighbor->keys[i] = n->keys[j];
-            neighbor->num_keys++;
-        }
-        if (n->next) {
-            n->next->previous = neighbor;
+    if (!node->aboveLeaves) {
+        for (size_t i = 0; i < n; i++) {
+            const PmseInnerNode* child = node->children[i].load(std::memory_order_acquire);
+            if (child)
+                bytes += separatorBytes(child);
         }
-        neighbor->next = n->next;
     }
+    return bytes;
+}
 
-    if (neighbor_index == -1) {
-        for (i = 0; i < n->parent->num_keys; i++) {
-            int cmp = IndexKeyEntry_PM::compareEntries(k_prime_temp, n->parent->keys[i], _ordering);
-            if (cmp == 0) {
-                break;
-            }
-        }
-    } else {
-       i = neighbor_index;
-    }
-    root = deleteEntry(pop, k_prime_temp, n->parent, i);
-    delete_persistent<IndexKeyEntry_PM[TREE_ORDER]>(n->keys);
-    delete_persistent<PmseTreeNode>(n);
-    return root;
+/* Writer which lost a latch race yields, and sleeps once it keeps losing */
+void backoff(uint64_t failures) {
+    if (failures < 16)
+        stdx::this_thread::yield();
+    else
+        sleepmicros(std::min<uint64_t>(failures, 1000));
 }
 
-// DELETION.
+/* Entry with TypeBits as stored in hash table, TypeBits left out when all zero */
+std::string withTypeBits(const PmseKey& key) {
+    const KeyString::TypeBits& typeBits = key.ks.getTypeBits();
+    std::string stored = key.entry().toString();
+    if (!typeBits.isAllZeros())
+        stored.append(typeBits.getBuffer(), typeBits.getSize());
+    return stored;
+}
 
-/* Utility function for deletion.  Retrieves
- * the index of a node's nearest neighbor (sibling)
- * to the left if one exists.  If not (the node
- * is the leftmost child), returns -1 to signify
- * this special case.
- */
-int64_t PmseTree::getNeighborIndex(persistent_ptr<PmseTreeNode> node) {
-    /* Return the index of the key to the left
-     * of the pointer in the parent pointing
-     * to n.
-     * If n is the leftmost child, this means
-     * return -1.
-     */
-    for (uint64_t i = 0; i <= node->parent->num_keys; i++)
-        if (node->parent->children_array[i] == node)
-            return i - 1;
+/* TypeBits of key as stored in leaves, empty when all zero */
+std::string storedTypeBits(const PmseKey& key) {
+    const KeyString::TypeBits& typeBits = key.ks.getTypeBits();
+    return typeBits.isAllZeros() ? std::string()
+                                 : std::string(typeBits.getBuffer(), typeBits.getSize());
+}
 
-    // Error state.
-    std::cout << "Error: Search for nonexistent pointer to node in parent.\n"
-                    << std::endl;
-    return 0;
+/* KeyString of RecordId alone, appended to key it makes whole entry */
+std::string recordIdString(int64_t recordId) {
+    KeyString ks(KeyString::Version::V1, RecordId(recordId));
+    return std::string(ks.getBuffer(), ks.getSize());
 }
 
-persistent_ptr<PmseTreeNode> PmseTree::adjustRoot(
-                persistent_ptr<PmseTreeNode> root) {
-    persistent_ptr<PmseTreeNode> new_root;
+int64_t recordIdOf(StringData entry) {
+    return KeyString::decodeRecordIdAtEnd(entry.rawData(), entry.size()).repr();
+}
 
-    /* Case: nonempty root.
-     * Key and pointer have already been deleted,
-     * so nothing to be done.
-     */
+/* Entry goes before others with equal RecordId, like into slots */
+void insertPosting(std::vector<PmsePosting>& entries, int64_t recordId, std::string typeBits) {
+    auto at = std::lower_bound(entries.begin(), entries.end(), recordId,
+                               [](const PmsePosting& e, int64_t id) { return e.recordId < id; });
+    entries.insert(at, PmsePosting{recordId, std::move(typeBits)});
+}
 
-    if (root->num_keys > 0)
-        return root;
-    /* Case: empty root.
-     */
+/* FNV hash of key mixed, so low bits choosing bucket depend on all of it */
+uint64_t tableHash(const PmseTreeIndex& index, StringData key) {
+    uint64_t hash = index.keyHash(key);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
 
-    // If it has a child, promote
-    // the first (only) child
-    // as the new root.
-    if (!root->is_leaf) {
-        new_root = root->children_array[0];
-        new_root->parent = nullptr;
-    } else {
-        // If it is a leaf (has no children),
-        // then the whole tree is empty.
-        new_root = nullptr;
-    }
+}  // namespace
 
-    delete_persistent<IndexKeyEntry_PM[TREE_ORDER]>(root->keys);
-    delete_persistent<PmseTreeNode>(root);
-    return new_root;
+/*
+ * Announced epoch is stored before any pointer is read, so writer which
+ * unlinks memory either sees the announcement or the reader sees memory
+ * already unlinked.
+ */
+PmseEpochs::Guard::Guard() {
+    if (threadEpoch.depth++ == 0)
+        threadEpoch.slot->epoch.store(globalEpoch.load());
 }
 
-persistent_ptr<PmseTreeNode> PmseTree::removeEntryFromNode(
-                IndexKeyEntry& key, persistent_ptr<PmseTreeNode> node,
-                uint64_t index) {
-    uint64_t i = index, num_pointers;
+PmseEpochs::Guard::~Guard() {
+    if (--threadEpoch.depth == 0)
+        threadEpoch.slot->epoch.store(0, std::memory_order_release);
+}
 
-    // Remove the key and shift other keys accordingly.
-    IndexKeyEntry_PM entryPM;
-    entryPM = (node->keys[i]);
-    pmemobj_tx_free(entryPM.data.raw());
+uint64_t PmseEpochs::retire() {
+    return globalEpoch.fetch_add(1);
+}
 
-    for (++i; i < node->num_keys; i++) {
-        node->keys[i - 1] = node->keys[i];
-    }
-    // Remove the pointer and shift other pointers accordingly.
-    i = index;
-    num_pointers = node->num_keys + 1;
-    i++;
-    for (++i; i < num_pointers; i++) {
-        node->children_array[i - 1] = node->children_array[i];
+uint64_t PmseEpochs::safe() {
+    uint64_t safe = globalEpoch.load();
+    for (auto& slot : epochSlots) {
+        uint64_t epoch = slot.epoch.load();
+        if (epoch != 0 && epoch < safe)
+            safe = epoch;
     }
+    return safe;
+}
 
-    // Set the other pointers to NULL for tidiness.
-    if (!node->is_leaf) {
-        for (i = node->num_keys + 1; i < TREE_ORDER; i++)
-            node->children_array[i] = nullptr;
+uint64_t PmseVersionLock::stable() const {
+    uint64_t version = _version.load(std::memory_order_acquire);
+    while (version & LOCKED) {
+        stdx::this_thread::yield();
+        version = _version.load(std::memory_order_acquire);
     }
-    node->num_keys--;
-
-    return node;
+    return version;
 }
 
-persistent_ptr<PmseTreeNode> PmseTree::makeTreeRoot(IndexKeyEntry& entry) {
-    persistent_ptr<char> obj;
-    auto n = make_persistent<PmseTreeNode>(true);
-
-    (n->keys[0]).data = pmemobj_tx_alloc(entry.key.objsize(), 1);
-    memcpy(static_cast<void*>((n->keys[0]).data.get()), entry.key.objdata(), entry.key.objsize());
-    (n->keys[0]).loc = entry.loc.repr();
-    n->num_keys = n->num_keys + 1;
-    n->next = nullptr;
-    n->previous = nullptr;
-    n->parent = nullptr;
-    return n;
+void PmseLatch::lock() {
+    if (try_lock())
+        return;
+    _waits.fetch_add(1, std::memory_order_relaxed);
+    while (!try_lock())
+        stdx::this_thread::yield();
 }
 
-bool PmseTree::nodeIsSafeForOperation(persistent_ptr<PmseTreeNode> node, bool insert) {
-    if (insert) {
-        if (node->num_keys < (TREE_ORDER)) {
-            return true;
-        }
-        else
-            return false;
-    } else {
-        uint64_t min_keys;
-        min_keys = node->is_leaf ? cut(TREE_ORDER - 1) : cut(TREE_ORDER) - 1;
+void PmseLatch::lock_shared() {
+    if (try_lock_shared())
+        return;
+    _waits.fetch_add(1, std::memory_order_relaxed);
+    while (!try_lock_shared())
+        stdx::this_thread::yield();
+}
 
-        if (node->num_keys > min_keys) {
-            return true;
-        }
-        else
-            return false;
+PmseInnerNode::PmseInnerNode(bool aboveLeaves) : aboveLeaves(aboveLeaves) {
+    for (auto& key : keys)
+        key.store(nullptr, std::memory_order_relaxed);
+    for (size_t i = 0; i < INNER_NODE_ORDER + 2; i++) {
+        children[i].store(nullptr, std::memory_order_relaxed);
+        leaves[i].store(0, std::memory_order_relaxed);
+        counts[i].store(0, std::memory_order_relaxed);
     }
 }
 
-persistent_ptr<PmseTreeNode> PmseTree::locateLeafWithKeyPM(
-                persistent_ptr<PmseTreeNode> node, IndexKeyEntry& entry,
-                const BSONObj& ordering, std::list<pmem::obj::shared_mutex*>& locks,
-                persistent_ptr<PmseTreeNode>& lockNode, bool insert) {
-    uint64_t i = 0;
-    int64_t cmp;
-    persistent_ptr<PmseTreeNode> current = _root;
-    persistent_ptr<PmseTreeNode> child;
+/*
+ * Frees subtree. Retired nodes have no children left, root replaced by
+ * its child gave the child away.
+ */
+PmseInnerNode::~PmseInnerNode() {
+    size_t n = childCount();
+    for (size_t i = 0; i + 1 < n; i++)
+        delete keys[i].load(std::memory_order_relaxed);
+    if (!aboveLeaves) {
+        for (size_t i = 0; i < n; i++)
+            delete children[i].load(std::memory_order_relaxed);
+    }
+}
 
-    if (current == nullptr)
-            return nullptr;
+uint64_t PmseInnerNode::total() const {
+    int64_t sum = 0;
+    for (size_t i = 0; i < childCount(); i++)
+        sum += counts[i].load(std::memory_order_relaxed);
+    return std::max<int64_t>(sum, 0);
+}
 
-    if (current->is_leaf) {
-        (current->_pmutex).lock();
-        if (current != _root) {
-            (current->_pmutex).unlock();
-            current = _root;
-        } else {
-            locks.push_back(&(_root->_pmutex));
-            return _root;
-        }
-    }
-    (current->_pmutex).lock_shared();
-    if (current != _root) {
-        (current->_pmutex).unlock_shared();
-        (_root->_pmutex).lock_shared();
-        current = _root;
-    }
-    while (!current->is_leaf) {
-        i = 0;
-        while (i < current->num_keys) {
-            cmp = IndexKeyEntry_PM::compareEntries(entry, current->keys[i], ordering);
-            if (cmp >= 0) {
-                i++;
-            } else {
-                break;
-            }
-        }
-    if (current->children_array[i]->is_leaf) {
-        (current->children_array[i]->_pmutex).lock();
-        locks.push_back(&(current->children_array[i]->_pmutex));
-    }
-    else {
-        (current->children_array[i]->_pmutex).lock_shared();
-    }
+void PmseInnerNode::append(const std::string* key, PmseInnerNode* child, uint64_t leaf,
+                           uint64_t entries) {
+    size_t n = childCount();
+    if (n > 0)
+        keys[n - 1].store(key, std::memory_order_relaxed);
+    children[n].store(child, std::memory_order_relaxed);
+    leaves[n].store(leaf, std::memory_order_relaxed);
+    counts[n].store(entries, std::memory_order_relaxed);
+    count.store(n + 1, std::memory_order_relaxed);
+}
 
-    current = current->children_array[i];
-    current->parent->_pmutex.unlock_shared();
+void PmseInnerNode::insertAt(size_t index, const std::string* key, PmseInnerNode* child, uint64_t leaf,
+                             uint64_t entries) {
+    size_t n = childCount();
+    for (size_t i = n; i > index + 1; i--) {
+        children[i].store(children[i - 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        leaves[i].store(leaves[i - 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        counts[i].store(counts[i - 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
     }
-    if (!nodeIsSafeForOperation(current, insert)) {
-        unlockTree(locks);
-        current = _root;
-        (current->_pmutex).lock();
-        while (current != _root)
-        {
-            (current->_pmutex).unlock();
-            current = _root;
-            (current->_pmutex).lock();
-        }
-        locks.push_back(&(current->_pmutex));
-        if (current == nullptr)
-            return nullptr;
+    for (size_t i = n - 1; i > index; i--)
+        keys[i].store(keys[i - 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    keys[index].store(key, std::memory_order_relaxed);
+    children[index + 1].store(child, std::memory_order_relaxed);
+    leaves[index + 1].store(leaf, std::memory_order_relaxed);
+    counts[index + 1].store(entries, std::memory_order_relaxed);
+    count.store(n + 1, std::memory_order_relaxed);
+}
 
-        while (!current->is_leaf) {
-            i = 0;
-            while (i < current->num_keys) {
-                cmp = IndexKeyEntry_PM::compareEntries(entry, current->keys[i], ordering);
-                if (cmp >= 0) {
-                    i++;
-                } else {
-                    break;
-                }
-            }
-            child = current->children_array[i];
-            (child->_pmutex).lock();
-            current = child;
-            if (nodeIsSafeForOperation(current, insert)) {
-                unlockTree(locks);
-            }
-            locks.push_back(&(current->_pmutex));
-        }
+const std::string* PmseInnerNode::eraseAt(size_t index) {
+    size_t n = childCount();
+    for (size_t i = index; i + 1 < n; i++) {
+        children[i].store(children[i + 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        leaves[i].store(leaves[i + 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        counts[i].store(counts[i + 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
     }
-    if (current->next) {
-        current->next->_pmutex.lock();
-        lockNode = current->next;
+    const std::string* erased = nullptr;
+    if (n > 1) {
+        size_t k = index > 0 ? index - 1 : 0;
+        erased = keys[k].load(std::memory_order_relaxed);
+        for (; k + 2 < n; k++)
+            keys[k].store(keys[k + 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
     }
-    return current;
+    count.store(n - 1, std::memory_order_relaxed);
+    return erased;
 }
 
-
-/*
- * Insert leaf into correct place.
- */
-Status PmseTree::insertKeyIntoLeaf(persistent_ptr<PmseTreeNode> node,
-                                   IndexKeyEntry& entry,
-                                   const BSONObj& _ordering) {
-    uint64_t i, insertion_point = 0;
-
-    while (insertion_point < node->num_keys &&
-                    IndexKeyEntry_PM::compareEntries(entry, node->keys[insertion_point], _ordering) > 0) {
-            insertion_point++;
+const std::string* PmseInnerNode::splitTo(PmseInnerNode* sibling, size_t split) {
+    size_t n = childCount();
+    const std::string* up = keys[split].load(std::memory_order_relaxed);
+    for (size_t i = split + 1; i < n; i++) {
+        sibling->append(i > split + 1 ? keys[i - 1].load(std::memory_order_relaxed) : nullptr,
+                        children[i].load(std::memory_order_relaxed),
+                        leaves[i].load(std::memory_order_relaxed),
+                        counts[i].load(std::memory_order_relaxed));
     }
+    count.store(split + 1, std::memory_order_relaxed);
+    return up;
+}
 
-    for (i = node->num_keys; i > insertion_point; i--) {
-        node->keys[i] = node->keys[i - 1];
+/* Level of node above leaves, inner nodes of its subtree are counted */
+size_t countInnerNodes(const PmseInnerNode* node, PmseTreeStats& stats) {
+    size_t level = 0;
+    if (!node->aboveLeaves) {
+        for (size_t i = 0; i < node->childCount(); i++)
+            level = countInnerNodes(node->children[i].load(std::memory_order_relaxed), stats) + 1;
     }
+    stats.addInnerNodes(level, 1);
+    return level;
+}
 
-    node->keys[insertion_point].data = pmemobj_tx_alloc(entry.key.objsize(), 1);
-    memcpy(static_cast<void*>((node->keys[insertion_point]).data.get()), entry.key.objdata(), entry.key.objsize());
-    node->keys[insertion_point].loc = entry.loc.repr();
-    node->num_keys = node->num_keys + 1;
-    return Status::OK();
+void PmseTreeStats::reset(const PmseInnerNode* root, int64_t leafCount, int64_t postingCount,
+                          int64_t entryBytes) {
+    leaves.store(leafCount);
+    postingLeaves.store(postingCount);
+    keyBytes.store(entryBytes);
+    for (auto& level : innerNodes)
+        level.store(0, std::memory_order_relaxed);
+    if (root)
+        countInnerNodes(root, *this);
 }
 
-/* Finds the appropriate place to
- * split a node that is too big into two.
- */
-uint64_t PmseTree::cut(uint64_t length) {
-    if (length % 2 == 0)
-        return length / 2;
-    else
-        return length / 2 + 1;
+/* Nobody uses index any more, retired memory can go at once */
+PmseTreeIndex::~PmseTreeIndex() {
+    delete root.load();
+    for (auto& retired : retiredNodes)
+        delete retired.second;
+    for (auto& retired : retiredKeys)
+        delete retired.second;
+}
+
+void PmseTreeIndex::reclaim() {
+    uint64_t safe = PmseEpochs::safe();
+    stdx::lock_guard<stdx::mutex> lock(retiredMutex);
+    while (!retiredNodes.empty() && retiredNodes.front().first < safe) {
+        delete retiredNodes.front().second;
+        retiredNodes.pop_front();
+    }
+    while (!retiredKeys.empty() && retiredKeys.front().first < safe) {
+        delete retiredKeys.front().second;
+        retiredKeys.pop_front();
+    }
 }
 
 /*
- * Split node and insert value
+ * Version locks taken by writer, released when it leaves the scope.
+ * Nodes unlinked meanwhile are released as obsolete.
  */
-persistent_ptr<PmseTreeNode> PmseTree::splitFullNodeAndInsert(
-                pool_base pop, persistent_ptr<PmseTreeNode> node,
-                IndexKeyEntry& entry, const BSONObj& _ordering,
-                std::list<pmem::obj::shared_mutex*>& locks) {
-    persistent_ptr<PmseTreeNode> new_leaf;
-    IndexKeyEntry_PM new_entry;
-    uint64_t insertion_index = 0;
-    uint64_t i, j, split;
-    persistent_ptr<PmseTreeNode> new_root;
-    new_leaf = make_persistent<PmseTreeNode>(true);
-    new_leaf->_pmutex.lock();
-    IndexKeyEntry_PM temp_keys_array[TREE_ORDER + 1];
-    while (insertion_index < node->num_keys &&
-                    IndexKeyEntry_PM::compareEntries(entry, node->keys[insertion_index], _ordering) > 0) {
-       insertion_index++;
-    }
-    split = cut(TREE_ORDER);
-
-    /*
-     * Copy from existing to temp, leaving space for inserted one
-     */
-    for (i = 0, j = 0; i < node->num_keys; i++, j++) {
-        if (j == insertion_index)
-            j++;
-        temp_keys_array[j] = node->keys[i];
+class PmseTree::HeldLocks {
+ public:
+    HeldLocks() = default;
+    HeldLocks(const HeldLocks&) = delete;
+    HeldLocks& operator=(const HeldLocks&) = delete;
+
+    ~HeldLocks() {
+        for (auto& held : _held) {
+            if (held.second)
+                held.first->unlockObsolete();
+            else
+                held.first->unlock();
+        }
     }
 
-    /*
-     * Fill free slot with inserted key
-     */
-    temp_keys_array[insertion_index].data = pmemobj_tx_alloc(entry.key.objsize(), 1);
-    memcpy(static_cast<void*>((temp_keys_array[insertion_index]).data.get()), entry.key.objdata(), entry.key.objsize());
-    temp_keys_array[insertion_index].loc = entry.loc.repr();
-    /*
-     * Now copy from temp array to new and to old
-     */
-    node->num_keys = 0;
-    for (i = 0; i < split; i++) {
-        node->keys[i] = temp_keys_array[i];
-        node->num_keys = node->num_keys + 1;
-    }
-    /*
-     * Copy rest of keys to new node
-     */
-    for (i = split, j = 0; i < (TREE_ORDER + 1); i++, j++) {
-        new_leaf->keys[j] = temp_keys_array[i];
-        new_leaf->num_keys = new_leaf->num_keys + 1;
-    }
-    /*
-     * Update pointers next, previous
-     */
-    new_leaf->next = node->next;
-    if (node->next) {
-        node->next->previous = new_leaf;
+    bool upgrade(PmseVersionLock& lock, uint64_t version) {
+        if (!lock.upgrade(version))
+            return false;
+        _held.emplace_back(&lock, false);
+        return true;
     }
-    node->next = new_leaf;
-    new_leaf->previous = node;
 
-    /*
-     * Update parents
-     */
-    new_leaf->parent = node->parent;
-    new_entry = new_leaf->keys[0];
-    new_root = insertIntoNodeParent(pop, _root, node, new_entry, new_leaf);
-    if(new_root!=_root)
-    {
-        new_root->_pmutex.lock();
-        locks.push_back(&(new_root->_pmutex));
-    }
-    new_leaf->_pmutex.unlock();
-    if (node == _last)
-        _last = new_leaf;
-    return new_root;
-}
-
-uint64_t PmseTree::getLeftIndex(persistent_ptr<PmseTreeNode> parent,
-                                persistent_ptr<PmseTreeNode> left) {
-    uint64_t left_index = 0;
-    while (left_index <= parent->num_keys
-                    && parent->children_array[left_index] != left) {
-        left_index++;
-    }
-    return left_index;
-}
-
-/*
- * Insert key into internal node
- * Returns root.
- */
-persistent_ptr<PmseTreeNode> PmseTree::insertKeyIntoNode(
-                pool_base pop, persistent_ptr<PmseTreeNode> root,
-                persistent_ptr<PmseTreeNode> n, uint64_t left_index,
-                IndexKeyEntry_PM& new_key, persistent_ptr<PmseTreeNode> right) {
-    uint64_t i;
-    for (i = n->num_keys; i > left_index; i--) {
-        n->children_array[i + 1] = n->children_array[i];
-        n->keys[i] = n->keys[i - 1];
-    }
-    n->children_array[left_index + 1] = right;
-    (n->keys[left_index]).data = pmemobj_tx_alloc(new_key.getBSON().objsize(), 1);
-    memcpy(static_cast<void*>((n->keys[left_index]).data.get()), new_key.data.get(), new_key.getBSON().objsize());
-    (n->keys[left_index]).loc = new_key.loc;
-
-    n->num_keys = n->num_keys + 1;
-    return root;
-}
-
-persistent_ptr<PmseTreeNode> PmseTree::insertToNodeAfterSplit(
-                pool_base pop, persistent_ptr<PmseTreeNode> root,
-                persistent_ptr<PmseTreeNode> old_node, uint64_t left_index,
-                IndexKeyEntry_PM& new_key, persistent_ptr<PmseTreeNode> right) {
-    uint64_t i = 0, j, split;
-    IndexKeyEntry_PM k_prime;
-    persistent_ptr<PmseTreeNode> new_node;
-    persistent_ptr<PmseTreeNode> child;
-    persistent_ptr<PmseTreeNode> new_root;
-    new_node = make_persistent<PmseTreeNode>(false);
-    persistent_ptr<PmseTreeNode> temp_children_array[TREE_ORDER + 2];
-    IndexKeyEntry_PM temp_keys_array[TREE_ORDER + 1];
-
-    for (i = 0, j = 0; i < old_node->num_keys + 1; i++, j++) {
-        if (j == left_index + 1)
-            j++;
-        temp_children_array[j] = old_node->children_array[i];
+    /* Waits for lock like stable(), yielding while writers hold it */
+    void lock(PmseVersionLock& lock) {
+        while (!upgrade(lock, lock.stable()))
+            stdx::this_thread::yield();
     }
 
-    for (i = 0, j = 0; i < old_node->num_keys; i++, j++) {
-        if (j == left_index)
-            j++;
-        temp_keys_array[j] = old_node->keys[i];
+    void markObsolete(PmseVersionLock& lock) {
+        for (auto& held : _held) {
+            if (held.first == &lock)
+                held.second = true;
+        }
     }
 
-    temp_children_array[left_index + 1] = right;
-    (temp_keys_array[left_index]).data = pmemobj_tx_alloc(new_key.getBSON().objsize(), 1);
-    memcpy(static_cast<void*>((temp_keys_array[left_index]).data.get()),
-                               new_key.data.get(), new_key.getBSON().objsize());
-    (temp_keys_array[left_index]).loc = new_key.loc;
+ private:
+    std::vector<std::pair<PmseVersionLock*, bool>> _held;
+};
+
+bool PmseTreeIndex::compactionDue(unsigned long long intervalMillis) const {
+    uint64_t churn = stats.leafSplits.load(std::memory_order_relaxed) +
+                     stats.leavesRemoved.load(std::memory_order_relaxed);
+    return churn != compactedChurn.load(std::memory_order_relaxed) &&
+           curTimeMillis64() - compactedAt.load(std::memory_order_relaxed) >= intervalMillis;
+}
 
-    split = cut(TREE_ORDER + 1);
-    old_node->num_keys = 0;
-    for (i = 0; i < split - 1; i++) {
-        old_node->children_array[i] = temp_children_array[i];
-        old_node->keys[i] = temp_keys_array[i];
-        old_node->num_keys = old_node->num_keys + 1;
+uint64_t PmseTreeIndex::keyHash(StringData key) const {
+    auto data = reinterpret_cast<const unsigned char*>(key.rawData());
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < key.size(); i++) {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
     }
+    return hash;
+}
 
-    old_node->children_array[i] = temp_children_array[i];
-    k_prime = temp_keys_array[split - 1];
+uint8_t PmseTreeIndex::fingerprint(StringData key) const {
+    uint64_t hash = keyHash(key);
+    hash ^= hash >> 32;
+    hash ^= hash >> 16;
+    hash ^= hash >> 8;
+    return static_cast<uint8_t>(hash);
+}
 
-    for (++i, j = 0; i < (TREE_ORDER + 1); i++, j++) {
-        new_node->children_array[j] = temp_children_array[i];
-        new_node->keys[j] = temp_keys_array[i];
-        new_node->num_keys = new_node->num_keys + 1;
-    }
-    new_node->children_array[j] = temp_children_array[i];
-    new_node->parent = old_node->parent;
-    for (i = 0; i <= new_node->num_keys; i++) {
-        child = new_node->children_array[i];
-        child->parent = new_node;
+uint64_t PmseTreeIndex::bucketOf(uint64_t hash, uint64_t shape) {
+    uint64_t buckets = HASH_BASE_BUCKETS << (shape >> 32);
+    uint64_t bucket = hash & (buckets - 1);
+    if (bucket < (shape & 0xffffffffULL))
+        bucket = hash & (2 * buckets - 1);
+    return bucket;
+}
+
+void PmseHashTable::locate(uint64_t bucket, uint64_t* segment, uint64_t* offset) {
+    if (bucket < HASH_BASE_BUCKETS) {
+        *segment = 0;
+        *offset = bucket;
+        return;
     }
-    new_root = insertIntoNodeParent(pop, root, old_node, k_prime, new_node);
+    *segment = 64 - countLeadingZeros64(bucket / HASH_BASE_BUCKETS);
+    *offset = bucket - (HASH_BASE_BUCKETS << (*segment - 1));
+}
 
-    IndexKeyEntry_PM entryPM = temp_keys_array[split-1];;
-    if (entryPM.data)
-       pmemobj_tx_free(entryPM.data.raw());
+persistent_ptr<PmseHashEntry>& PmseHashTable::bucket(uint64_t bucket) {
+    uint64_t segment, offset;
+    locate(bucket, &segment, &offset);
+    return segments[segment][offset];
+}
 
-    return new_root;
+IndexKeyEntry PmseTreeIndex::entryAt(PmseTreeNode& node, uint64_t position, bool wantKey) const {
+    if (node.posting && !wantKey)
+        return IndexKeyEntry(BSONObj(), RecordId(node.posting->recordIdAt(position)));
+    return decode(node.entryStringAt(position), node.typeBitsAt(position), node.keySizeAt(position),
+                  wantKey);
 }
 
-/*
- * Inserts a new node into tree structure.
- * Returns root after tree modification.
- */
-persistent_ptr<PmseTreeNode> PmseTree::insertIntoNodeParent(
-                pool_base pop, persistent_ptr<PmseTreeNode> root,
-                persistent_ptr<PmseTreeNode> left, IndexKeyEntry_PM& key,
-                persistent_ptr<PmseTreeNode> right) {
-    persistent_ptr<PmseTreeNode> parent = left->parent;
-    uint64_t left_index;
-    /*
-     * Check if parent exist. If not, create new one.
-     */
-    if (parent == nullptr) {
-        return allocateNewRoot(pop, left, key, right);
+IndexKeyEntry PmseTreeIndex::decode(StringData entry, StringData typeBits, uint64_t keySize,
+                                    bool wantKey) const {
+    if (!wantKey)
+        return IndexKeyEntry(BSONObj(), KeyString::decodeRecordIdAtEnd(entry.rawData(), entry.size()));
+    BufReader reader(typeBits.rawData(), typeBits.size());
+    KeyString::TypeBits bits = typeBits.empty()
+        ? KeyString::TypeBits(KeyString::Version::V1)
+        : KeyString::TypeBits::fromBuffer(KeyString::Version::V1, &reader);
+    return IndexKeyEntry(KeyString::toBson(entry.rawData(), keySize, ordering, bits),
+                         KeyString::decodeRecordIdAtEnd(entry.rawData(), entry.size()));
+}
+
+int64_t PmsePostingList::recordIdAt(uint64_t position) const {
+    uint64_t offset = 0;
+    memcpy(&offset, records() + position * stride(), width);
+    return static_cast<int64_t>(static_cast<uint64_t>(base) + offset);
+}
+
+StringData PmsePostingList::typeBitsAt(uint64_t position) const {
+    uint64_t variant = 0;
+    memcpy(&variant, records() + position * stride() + width, variantWidth);
+    const char* table = data() + keySize;
+    uint16_t length;
+    while (true) {
+        memcpy(&length, table, sizeof(length));
+        table += sizeof(length);
+        if (variant-- == 0)
+            return StringData(table, length);
+        table += length;
     }
-    /*
-     * There is parent, insert key into it.
-     */
-    /*
-     * Find place in parent where to insert new key
-     */
-    left_index = getLeftIndex(parent, left);
-    /*
-     * If there is slot for new key - just insert
-     */
-    if (parent->num_keys < TREE_ORDER) {
-        return insertKeyIntoNode(pop, root, parent, left_index, key, right);
+}
+
+uint64_t PmsePostingList::lowerBound(int64_t recordId) const {
+    uint64_t low = 0;
+    uint64_t high = size;
+    while (low < high) {
+        uint64_t middle = (low + high) / 2;
+        if (recordIdAt(middle) < recordId)
+            low = middle + 1;
+        else
+            high = middle;
     }
-    /*
-     * There is no slot for new key - we need to split
-     */
-    return insertToNodeAfterSplit(pop, root, parent, left_index, key, right);
+    return low;
+}
+
+std::string PmseTreeNode::entryStringAt(uint64_t position) {
+    if (posting)
+        return posting->key().toString() + recordIdString(posting->recordIdAt(position));
+    return entryString(entryAt(position));
+}
+
+StringData PmseTreeNode::typeBitsAt(uint64_t position) {
+    return posting ? posting->typeBitsAt(position) : typeBits(entryAt(position));
+}
+
+uint64_t PmseTreeNode::keySizeAt(uint64_t position) {
+    return posting ? posting->keySize : entryAt(position).keySize;
+}
+
+uint64_t PmseTreeNode::entrySizeAt(uint64_t position) {
+    if (posting)
+        return posting->keySize + recordIdString(posting->recordIdAt(position)).size();
+    return entryAt(position).entrySize;
+}
+
+/* Key of posting leaf is compared once, then RecordId alone */
+int PmseTreeNode::compareAt(uint64_t position, StringData other) {
+    if (!posting)
+        return compareEntry(entryAt(position), other);
+    StringData key = posting->key();
+    int cmp = key.compare(other.substr(0, key.size()));
+    if (cmp != 0)
+        return cmp;
+    return StringData(recordIdString(posting->recordIdAt(position))).compare(other.substr(key.size()));
+}
+
+bool PmseTreeNode::entryEqualsAt(uint64_t position, StringData entry) {
+    return posting ? compareAt(position, entry) == 0 : entryEquals(entryAt(position), entry);
+}
+
+bool PmseTreeNode::keyEqualsAt(uint64_t position, StringData key) {
+    return posting ? posting->key() == key : keyEquals(entryAt(position), key);
+}
+
+uint64_t PmseTreeNode::capacityFor(uint64_t nodeSize) {
+    uint64_t capacity = MAX_LEAF_SLOTS;
+    while (capacity > 1 && sizeof(PmseTreeNode) + 2 * arrayLength(capacity) +
+           prefixCapacityFor(nodeSize) + capacity * sizeof(IndexKeyEntry_PM) > nodeSize)
+        capacity--;
+    return capacity;
 }
 
 /*
- * Allocate node for new root and fill it with key.
+ * Compares eight fingerprints at once: bytes equal to fp become zero
+ * and the exact zero-byte test leaves 0x80 in them, which is then
+ * gathered into one bit per slot (little endian layout).
  */
-persistent_ptr<PmseTreeNode> PmseTree::allocateNewRoot(
-                pool_base pop, persistent_ptr<PmseTreeNode> left,
-                IndexKeyEntry_PM& new_key, persistent_ptr<PmseTreeNode> right) {
-    persistent_ptr<PmseTreeNode> new_root;
-    new_root = make_persistent<PmseTreeNode>(false);
-    (new_root->keys[0]).data = pmemobj_tx_alloc(new_key.getBSON().objsize(), 1);
-    memcpy(static_cast<void*>((new_root->keys[0]).data.get()), new_key.data.get(), new_key.getBSON().objsize());
-    (new_root->keys[0]).loc = new_key.loc;
-
-    new_root->children_array[0] = left;
-    new_root->children_array[1] = right;
-    new_root->num_keys = new_root->num_keys + 1;
-    new_root->parent = nullptr;
-    left->parent = new_root;
-    right->parent = new_root;
-    return new_root;
+uint64_t PmseTree::matchFingerprints(persistent_ptr<PmseTreeNode> node, uint8_t fp) {
+    static_assert(MAX_LEAF_SLOTS <= 64, "slot mask has to fit in one word");
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t low7 = 0x7F7F7F7F7F7F7F7FULL;
+    const uint8_t* fingerprints = node->fingerprints();
+    uint64_t mask = 0;
+    for (uint64_t w = 0; w < PmseTreeNode::arrayLength(node->capacity) / 8; w++) {
+        uint64_t word;
+        memcpy(&word, fingerprints + w * 8, sizeof(word));
+        uint64_t x = word ^ (ones * fp);
+        uint64_t zero = ~(((x & low7) + low7) | x | low7);
+        mask |= (((zero >> 7) * 0x0102040810204080ULL) >> 56) << (w * 8);
+    }
+    return mask & node->bitmap;
 }
 
-void PmseTree::unlockTree(std::list<pmem::obj::shared_mutex*>& locks) {
-    std::list<pmem::obj::shared_mutex*>::const_iterator iterator;
-    try {
-        for (iterator = locks.begin(); iterator != locks.end(); ++iterator) {
-            (*iterator)->unlock();
-        }
-        locks.erase(locks.begin(), locks.end());
-    }catch(std::exception &e) {}
+uint64_t PmseTree::alignNodeSize(int64_t requested) {
+    uint64_t size = std::max<int64_t>(requested, MIN_NODE_SIZE);
+    size = (size + NODE_LINE_SIZE - 1) / NODE_LINE_SIZE * NODE_LINE_SIZE;
+    return std::min(size, MAX_NODE_SIZE);
 }
 
-Status PmseTree::insert(pool_base pop, IndexKeyEntry& entry,
-                        const BSONObj& ordering, bool dupsAllowed) {
-    persistent_ptr<PmseTreeNode> node;
-    Status status = Status::OK();
-    uint64_t i;
-    int64_t cmp;
-    std::list<pmem::obj::shared_mutex*> locks;
-    persistent_ptr<PmseTreeNode> lockNode;
-    if (!_root) {
-        stdx::lock_guard<pmem::obj::mutex> guard(globalMutex);
-        if(!_root){
-            // root not allocated yet
-            try {
-                transaction::exec_tx(pop, [this, &entry] {
-                    _root = makeTreeRoot(entry);
-                    _first = _root;
-                    _last = _root;
-                });
-            } catch (std::exception &e) {
-                log() << "Index: " << e.what();
-                status = Status(ErrorCodes::CommandFailed, e.what());
-            }
-            return status;
-        }
+void PmseTree::open(pool_base pop, uint64_t nodeSize, bool hashTable) {
+    _index->poolUuid = _root.raw().pool_uuid_lo;
+    if (_root->nodeSize == 0) {
+        transaction::exec_tx(pop, [this, nodeSize] {
+            _root->nodeSize = alignNodeSize(nodeSize);
+        });
     }
-    node = locateLeafWithKeyPM(_root, entry, ordering, locks, lockNode, true);
-    /*
-     * Duplicate key check
-     */
-    if (!dupsAllowed) {
-        for (i = 0; i < node->num_keys; i++) {
-            cmp = entry.key.woCompare(node->keys[i].getBSON(),
-                                          ordering, false);
-            if (cmp == 0) {
-                if (node->keys[i].loc != entry.loc.repr()) {
-                    StringBuilder sb;
-                    sb << "E11000 duplicate key error ";
-                    sb << "dup key: " << entry.key.toString();
-                    unlockTree(locks);
-                    return Status(ErrorCodes::DuplicateKey, sb.str());
-                } else {
-                    break;
-                }
-            }
+    _index->capacity = PmseTreeNode::capacityFor(_root->nodeSize);
+    _index->prefixCapacity = PmseTreeNode::prefixCapacityFor(_root->nodeSize);
+    registerAllocClass(pop);
+    if (_root->version < TREE_FORMAT_VERSION) {
+        log() << "Index: converting tree to format " << TREE_FORMAT_VERSION;
+        if (_root->legacyRoot)
+            freeLegacyNodes(pop);
+        /* One old leaf per transaction, after crash conversion continues */
+        while (_root->legacyFirst) {
+            transaction::exec_tx(pop, [this] {
+                convertLegacyLeaf();
+            });
         }
+        transaction::exec_tx(pop, [this] {
+            _root->legacyLast = nullptr;
+            _root->version = TREE_FORMAT_VERSION;
+        });
     }
-
-    /*
-     * There is place for new value
-     */
-    if (node->num_keys < (TREE_ORDER)) {
-        try {
-            transaction::exec_tx(pop, [this, &status, &node, &entry, ordering] {
-                status = insertKeyIntoLeaf(node, entry, ordering);
+    freeBulkLeaves(pop);
+    /* Empty leaves left by removals go first, separators are taken from leaf ends */
+    for (auto leaf = _root->first; leaf;) {
+        auto next = leaf->next;
+        if (leaf->num_keys == 0) {
+            transaction::exec_tx(pop, [this, &leaf] {
+                unlinkLeaf(leaf);
             });
-        } catch (std::exception &e) {
-            log() << "Index: " << e.what();
-            if (lockNode) {
-               lockNode->_pmutex.unlock();
-            }
-            return Status(ErrorCodes::CommandFailed, e.what());
         }
-        unlockTree(locks);
-        if (lockNode) {
-           lockNode->_pmutex.unlock();
-       }
-        return status;
+        leaf = next;
     }
-
-    /*
-     * splitting
-     */
-    try {
-        transaction::exec_tx(pop, [this, pop, &node, &entry, ordering, &locks] {
-            _root = splitFullNodeAndInsert(pop, node, entry, ordering, locks);
+    /* No reader is left from before restart */
+    if (_root->retired) {
+        transaction::exec_tx(pop, [this] {
+            while (_root->retired) {
+                auto leaf = _root->retired;
+                _root->retired = leaf->next;
+                pmemobj_tx_free(leaf.raw());
+            }
         });
-    } catch (std::exception &e) {
-        log() << "Index: " << e.what();
-        if (lockNode) {
-           lockNode->_pmutex.unlock();
-        }
-        return Status(ErrorCodes::CommandFailed, e.what());
     }
-    if (lockNode) {
-       lockNode->_pmutex.unlock();
+    if (hashTable && !_root->hash && !_root->first) {
+        transaction::exec_tx(pop, [this] {
+            _root->hash = make_persistent<PmseHashTable>();
+            _root->hash->segments[0] = make_persistent<persistent_ptr<PmseHashEntry>[]>(HASH_BASE_BUCKETS);
+            _root->hash->complete = true;
+        });
+    }
+    if (_root->hash) {
+        _index->bucketLatches.reset(new PmseLatch[1 << LEAF_LATCH_BITS]);
+        _index->hashShape.store((_root->hash->level << 32) | _root->hash->split);
+    }
+    rebuildInnerNodes();
+    /* Fill of bulk load was interrupted, entries count for growing the table */
+    if (_root->hash && !_root->hash->complete) {
+        clearHash(pop);
+        fillHash(pop);
     }
-    unlockTree(locks);
-    return Status::OK();
+}
+
+/*
+ * Leaves come from allocation class whose units are node sized and
+ * aligned to media lines. Without it leaves are allocated as usual.
+ */
+void PmseTree::registerAllocClass(pool_base pop) {
+    struct pobj_alloc_class_desc desc;
+    desc.unit_size = _root->nodeSize;
+    desc.alignment = NODE_LINE_SIZE;
+    desc.units_per_block = 256;
+    desc.header_type = POBJ_HEADER_NONE;
+    if (pmemobj_ctl_set(pop.handle(), "heap.alloc_class.new.desc", &desc) == 0) {
+        _index->allocClass = desc.class_id;
+    } else {
+        log() << "Index: leaves not aligned to media lines: " << pmemobj_errormsg();
+        _index->allocClass = 0;
+    }
+}
+
+/*
+ * Zeroed leaf of tree node size.
+ */
+persistent_ptr<PmseTreeNode> PmseTree::allocateLeaf() {
+    PMEMoid oid = _index->allocClass
+        ? pmemobj_tx_xalloc(_root->nodeSize, 0, POBJ_XALLOC_ZERO | POBJ_CLASS_ID(_index->allocClass))
+        : pmemobj_tx_zalloc(_root->nodeSize, 0);
+    if (OID_IS_NULL(oid))
+        throw pmem::transaction_alloc_error("cannot allocate index leaf");
+    persistent_ptr<PmseTreeNode> node(oid);
+    node->capacity = _index->capacity;
+    node->prefixCapacity = _index->prefixCapacity;
+    return node;
+}
+
+/*
+ * Appends old entry re-encoded at the end of leaf list and frees its
+ * key data. Entries come in key order.
+ */
+void PmseTree::appendConverted(PmseLegacyEntry& old) {
+    PmseKey key(IndexKeyEntry(old.getBSON(), RecordId(old.loc)), _index->ordering);
+    if (!_root->last || _root->last->num_keys == _root->last->capacity) {
+        auto node = allocateLeaf();
+        node->previous = _root->last;
+        if (_root->last)
+            _root->last->next = node;
+        else
+            _root->first = node;
+        _root->last = node;
+    }
+    fitPrefix(_root->last, key.entry());
+    appendSlot(_root->last, makeEntry(key, _root->last->prefixSize), _index->fingerprint(key.key()));
+    pmemobj_tx_free(old.data.raw());
+}
+
+/*
+ * Converts first leaf of format 0.
+ */
+void PmseTree::convertLegacyLeaf() {
+    auto leaf = _root->legacyFirst;
+    for (uint64_t i = 0; i < leaf->num_keys; i++) {
+        appendConverted(leaf->keys[i]);
+    }
+    _root->legacyFirst = leaf->next;
+    delete_persistent<PmseLegacyEntry[TREE_ORDER]>(leaf->keys);
+    delete_persistent<PmseLegacyTreeNode>(leaf);
+}
+
+/*
+ * Frees leaves of bulk load which was not committed, with their entries.
+ */
+void PmseTree::freeBulkLeaves(pool_base pop) {
+    if (!_root->bulkChains)
+        return;
+    for (auto& head : _root->bulkChains->heads) {
+        while (head) {
+            transaction::exec_tx(pop, [this, &head] {
+                for (size_t i = 0; i < BULK_LEAVES_PER_TX && head; i++) {
+                    auto leaf = head;
+                    if (leaf->posting) {
+                        pmemobj_tx_free(leaf->posting.raw());
+                    } else {
+                        for (uint64_t position = 0; position < leaf->num_keys; position++) {
+                            freeEntry(leaf->entryAt(position));
+                        }
+                    }
+                    head = leaf->next;
+                    pmemobj_tx_free(leaf.raw());
+                }
+            });
+        }
+    }
+    transaction::exec_tx(pop, [this] {
+        delete_persistent<PmseBulkChains>(_root->bulkChains);
+        _root->bulkChains = nullptr;
+    });
+}
+
+/*
+ * Frees inner nodes of format 0 with their separators. Separators were
+ * copies of leaf keys, except that redistribution between leaves moved
+ * data of leaf key into parent, so separators sharing data with leaf
+ * are skipped. The same redistribution freed old separator without
+ * checking who else holds it, so only data still allocated is freed.
+ */
+void PmseTree::freeLegacyNodes(pool_base pop) {
+    std::unordered_set<uint64_t> leafData;
+    for (auto leaf = _root->legacyFirst; leaf; leaf = leaf->next) {
+        for (uint64_t i = 0; i < leaf->num_keys; i++)
+            leafData.insert(leaf->keys[i].data.raw().off);
+    }
+    std::vector<persistent_ptr<PmseLegacyTreeNode>> nodes;
+    std::unordered_set<uint64_t> separators;
+    if (!_root->legacyRoot->is_leaf)
+        nodes.push_back(_root->legacyRoot);
+    for (size_t n = 0; n < nodes.size(); n++) {
+        auto node = nodes[n];
+        for (uint64_t i = 0; i < node->num_keys; i++) {
+            uint64_t data = node->keys[i].data.raw().off;
+            if (data && !leafData.count(data))
+                separators.insert(data);
+        }
+        for (uint64_t i = 0; i <= node->num_keys; i++) {
+            auto child = node->children_array[i];
+            if (child && !child->is_leaf)
+                nodes.push_back(child);
+        }
+    }
+    std::vector<PMEMoid> allocated;
+    for (PMEMoid oid = pmemobj_first(pop.handle()); !OID_IS_NULL(oid); oid = pmemobj_next(oid)) {
+        if (separators.erase(oid.off))
+            allocated.push_back(oid);
+    }
+    transaction::exec_tx(pop, [this, &nodes, &allocated] {
+        for (auto& oid : allocated)
+            pmemobj_tx_free(oid);
+        for (auto& node : nodes) {
+            delete_persistent<PmseLegacyEntry[TREE_ORDER]>(node->keys);
+            delete_persistent<PmseLegacyTreeNode>(node);
+        }
+        _root->legacyRoot = nullptr;
+    });
+}
+
+void PmseTree::rebuildInnerNodes() {
+    delete _index->root.exchange(nullptr);
+    std::vector<persistent_ptr<PmseTreeNode>> leaves;
+    int64_t entries = 0;
+    int64_t postings = 0;
+    for (auto leaf = _root->first; leaf; leaf = leaf->next) {
+        leaves.push_back(leaf);
+        entries += leaf->num_keys;
+        if (leaf->posting)
+            postings++;
+    }
+    _index->entries.store(entries);
+    const size_t n = leaves.size();
+
+    /*
+     * Separators are made from the ends of neighbouring leaves and entry
+     * sizes are summed for stats, which touches every leaf in pmem, so it
+     * is split between threads. Linking nodes afterwards is cheap. First
+     * leaf needs no separator.
+     */
+    std::vector<std::string> keys(n);
+    auto copyKeys = [&leaves, &keys](size_t begin, size_t end, int64_t* keyBytes) {
+        int64_t bytes = 0;
+        for (size_t i = begin; i < end; i++) {
+            for (uint64_t position = 0; position < leaves[i]->num_keys; position++)
+                bytes += leaves[i]->entrySizeAt(position);
+            if (i == 0)
+                continue;
+            auto left = leaves[i - 1];
+            keys[i] = shortestSeparator(left->entryStringAt(left->num_keys - 1),
+                                        leaves[i]->entryStringAt(0));
+        }
+        *keyBytes = bytes;
+    };
+    size_t threads = std::min<size_t>(std::max(1u, stdx::thread::hardware_concurrency()),
+                                      (n + REBUILD_LEAVES_PER_THREAD - 1) / REBUILD_LEAVES_PER_THREAD);
+    threads = std::max<size_t>(threads, 1);
+    size_t chunk = (n + threads - 1) / threads;
+    std::vector<int64_t> keyBytes(threads);
+    std::vector<stdx::thread> workers;
+    for (size_t t = 1; t < threads; t++) {
+        workers.emplace_back(copyKeys, std::min(n, t * chunk), std::min(n, (t + 1) * chunk),
+                             &keyBytes[t]);
+    }
+    copyKeys(0, std::min(n, chunk), &keyBytes[0]);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    PmseInnerNode* root = n > 1 ? buildInnerNodes(leaves, keys) : nullptr;
+    _index->stats.reset(root, n, postings,
+                        std::accumulate(keyBytes.begin(), keyBytes.end(), int64_t(0)));
+    _index->root.store(root, std::memory_order_release);
+}
+
+/*
+ * Optimistic descent: version of inner node is taken before it is read
+ * and validated once child is taken, so readers lock nothing. Fails when
+ * a writer changed some node meanwhile and caller restarts. Leaf is
+ * checked with validLeaf after caller locks it. childOf picks index of
+ * child in node.
+ */
+template <typename ChildOf>
+bool PmseTree::descendBy(ChildOf childOf, Descent& descent) {
+    descent.path.clear();
+    descent.rootVersion = _index->rootLock.stable();
+    PmseInnerNode* node = _index->root.load(std::memory_order_acquire);
+    if (!node) {
+        descent.leaf = _root->first;
+        return true;
+    }
+    uint64_t version = node->lock.stable();
+    if (!_index->rootLock.validate(descent.rootVersion))
+        return false;
+    while (true) {
+        if (version & PmseVersionLock::OBSOLETE)
+            return false;
+        size_t i = childOf(node);
+        PmseInnerNode* child = nullptr;
+        if (node->aboveLeaves)
+            descent.leaf = _index->leaf(node->leaves[i].load(std::memory_order_relaxed));
+        else
+            child = node->children[i].load(std::memory_order_relaxed);
+        if (!node->lock.validate(version))
+            return false;
+        descent.path.push_back({node, i, version});
+        if (!child)
+            return true;
+        uint64_t childVersion = child->lock.stable();
+        if (!node->lock.validate(version))
+            return false;
+        node = child;
+        version = childVersion;
+    }
+}
+
+bool PmseTree::descend(StringData entry, Descent& descent) {
+    return descendBy([entry](const PmseInnerNode* node) { return childIndex(node, entry); },
+                     descent);
+}
+
+/*
+ * Child is the one holding entry of given rank by subtree counts, rank
+ * is left relative to the leaf. Caller restarts with the original rank.
+ */
+bool PmseTree::descendToRank(uint64_t& rank, Descent& descent) {
+    return descendBy([&rank](const PmseInnerNode* node) {
+        size_t n = node->childCount();
+        size_t i = 0;
+        for (; i + 1 < n; i++) {
+            uint64_t below = std::max<int64_t>(node->counts[i].load(std::memory_order_relaxed), 0);
+            if (rank < below)
+                break;
+            rank -= below;
+        }
+        return i;
+    }, descent);
+}
+
+void PmseTree::addCount(const std::vector<PathEntry>& path, size_t levels, int64_t delta) {
+    for (size_t level = 0; level < levels; level++)
+        path[level].node->counts[path[level].index].fetch_add(delta, std::memory_order_relaxed);
+}
+
+/*
+ * Leaf locked by caller is still where descent leads. Leaves are only
+ * removed with their parent and rootLock locked, so removed leaf fails.
+ */
+bool PmseTree::validLeaf(const Descent& descent) {
+    if (descent.path.empty())
+        return _index->rootLock.validate(descent.rootVersion);
+    return descent.path.back().node->lock.validate(descent.path.back().version);
+}
+
+/*
+ * Locks inner nodes changed by split: parent and every ancestor which
+ * overflows with it, rootLock when root changes. Fails when any of them
+ * changed since descent.
+ */
+bool PmseTree::lockForSplit(const Descent& descent, HeldLocks& held) {
+    for (size_t level = descent.path.size(); level > 0; level--) {
+        const PathEntry& entry = descent.path[level - 1];
+        if (!held.upgrade(entry.node->lock, entry.version))
+            return false;
+        if (entry.node->childCount() <= INNER_NODE_ORDER)
+            return true;
+    }
+    return held.upgrade(_index->rootLock, descent.rootVersion);
+}
+
+/*
+ * Leaf where entry belongs locked shared, null for empty tree.
+ */
+persistent_ptr<PmseTreeNode> PmseTree::lockLeaf(StringData entry) {
+    for (bool retry = false; true; retry = true) {
+        if (retry)
+            _index->stats.restarts.fetch_add(1, std::memory_order_relaxed);
+        Descent descent;
+        if (!descend(entry, descent))
+            continue;
+        if (!descent.leaf)
+            return nullptr;
+        PmseLatch& latch = _index->latch(descent.leaf);
+        latch.lock_shared();
+        if (validLeaf(descent))
+            return descent.leaf;
+        latch.unlock_shared();
+    }
+}
+
+/*
+ * First or last leaf locked shared, null for empty tree. When the end
+ * moved before lock was taken it is read again. Leaf may be empty.
+ */
+persistent_ptr<PmseTreeNode> PmseTree::lockEnd(bool last) {
+    while (true) {
+        persistent_ptr<PmseTreeNode> leaf = last ? _root->last : _root->first;
+        if (!leaf)
+            return nullptr;
+        PmseLatch& latch = _index->latch(leaf);
+        latch.lock_shared();
+        if (leaf == (last ? _root->last : _root->first))
+            return leaf;
+        latch.unlock_shared();
+    }
+}
+
+/*
+ * Tries to latch neighbour of leaf latched by writer. Neighbour sharing
+ * latch the writer already holds needs nothing more.
+ */
+bool PmseTree::tryLatch(persistent_ptr<PmseTreeNode> leaf, std::initializer_list<const PmseLatch*> held,
+                        stdx::unique_lock<PmseLatch>& lock) {
+    PmseLatch& latch = _index->latch(leaf);
+    if (std::find(held.begin(), held.end(), &latch) != held.end())
+        return true;
+    lock = stdx::unique_lock<PmseLatch>(latch, stdx::try_to_lock);
+    return lock.owns_lock();
+}
+
+/*
+ * Frees retired leaves no reader can reach. Persistent list of them is
+ * newest first, so the oldest ones are cut off its end.
+ */
+void PmseTree::reclaim(pool_base pop) {
+    _index->reclaim();
+    uint64_t safe = PmseEpochs::safe();
+    stdx::lock_guard<stdx::mutex> lock(_index->retiredMutex);
+    auto& retired = _index->retiredLeaves;
+    size_t n = 0;
+    while (n < retired.size() && retired[n].first < safe)
+        n++;
+    if (n == 0)
+        return;
+    transaction::exec_tx(pop, [this, &retired, n] {
+        if (n < retired.size())
+            retired[n].second->next = nullptr;
+        else
+            _root->retired = nullptr;
+        for (size_t i = 0; i < n; i++)
+            pmemobj_tx_free(retired[i].second.raw());
+    });
+    retired.erase(retired.begin(), retired.begin() + n);
+}
+
+/*
+ * Slot holding entry, its position in posting leaf, MAX_POSTING_ENTRIES
+ * when absent. Deletes leave free slots below num_keys.
+ */
+uint64_t PmseTree::findEntry(persistent_ptr<PmseTreeNode> node, const PmseKey& key, uint8_t fp) {
+    if (node->posting) {
+        if (node->posting->key() != key.key())
+            return MAX_POSTING_ENTRIES;
+        uint64_t position = node->posting->lowerBound(key.recordId);
+        return position < node->num_keys && node->posting->recordIdAt(position) == key.recordId
+            ? position : MAX_POSTING_ENTRIES;
+    }
+    for (uint64_t candidates = matchFingerprints(node, fp); candidates; candidates &= candidates - 1) {
+        uint64_t i = countTrailingZeros64(candidates);
+        if (node->entryEquals(node->keys()[i], key.entry()))
+            return i;
+    }
+    return MAX_POSTING_ENTRIES;
+}
+
+Status PmseTree::checkDuplicate(persistent_ptr<PmseTreeNode> node, const PmseKey& key,
+                                uint8_t fp, const IndexKeyEntry& entry) {
+    for (uint64_t candidates = matchFingerprints(node, fp); candidates; candidates &= candidates - 1) {
+        uint64_t i = countTrailingZeros64(candidates);
+        if (node->keyEquals(node->keys()[i], key.key())) {
+            if (!node->entryEquals(node->keys()[i], key.entry())) {
+                StringBuilder sb;
+                sb << "E11000 duplicate key error ";
+                sb << "dup key: " << entry.key.toString();
+                return Status(ErrorCodes::DuplicateKey, sb.str());
+            }
+            break;
+        }
+    }
+    return Status::OK();
+}
+
+/*
+ * Entries with key of new entry may continue in neighbouring leaves when
+ * the key is at the fence of its leaf. Previous leaves are checked while
+ * they hold nothing below the key, next ones while they hold nothing
+ * above it. Writer holds latch of node, neighbours are only tried, false
+ * asks caller to retry.
+ */
+bool PmseTree::checkNeighbourDuplicates(persistent_ptr<PmseTreeNode> node, const PmseKey& key,
+                                        uint8_t fp, const IndexKeyEntry& entry, Status& status) {
+    StringData k = key.key();
+    auto belowKey = [&k](persistent_ptr<PmseTreeNode> leaf) {
+        return leaf->num_keys > 0 && leaf->compareAt(0, k) < 0;
+    };
+    auto aboveKey = [&k](persistent_ptr<PmseTreeNode> leaf) {
+        if (leaf->num_keys == 0)
+            return false;
+        uint64_t last = leaf->num_keys - 1;
+        return leaf->compareAt(last, k) > 0 && !leaf->keyEqualsAt(last, k);
+    };
+    const PmseLatch* nodeLatch = &_index->latch(node);
+    bool locked = true;
+    for (bool backward : {true, false}) {
+        std::vector<PmseLatch*> latches;
+        for (auto leaf = node; locked && status.isOK() && !(backward ? belowKey(leaf) : aboveKey(leaf));) {
+            leaf = backward ? leaf->previous : leaf->next;
+            if (!leaf)
+                break;
+            PmseLatch& latch = _index->latch(leaf);
+            if (&latch != nodeLatch) {
+                if (!latch.try_lock_shared()) {
+                    locked = false;
+                    break;
+                }
+                latches.push_back(&latch);
+            }
+            status = checkDuplicate(leaf, key, fp, entry);
+        }
+        for (auto latch : latches)
+            latch->unlock_shared();
+    }
+    return locked;
+}
+
+/*
+ * Only the slot is removed, also the last one of leaf. Underfull and
+ * empty leaves are left to rebalance, so removal never locks more than
+ * its leaf.
+ */
+bool PmseTree::remove(pool_base pop, IndexKeyEntry& entry,
+                      bool dupsAllowed, const BSONObj& ordering) {
+    PmseKey key(entry, _index->ordering);
+    uint8_t fp = _index->fingerprint(key.key());
+    uint64_t hash = _root->hash ? tableHash(*_index, key.key()) : 0;
+    PmseTreeStats& stats = _index->stats;
+    PmseEpochs::Guard guard;
+    for (bool retry = false; true; retry = true) {
+        if (retry)
+            stats.restarts.fetch_add(1, std::memory_order_relaxed);
+        Descent descent;
+        if (!descend(key.entry(), descent))
+            continue;
+        auto node = descent.leaf;
+        if (!node)
+            return false;
+        stdx::unique_lock<PmseLatch> leafLock(_index->latch(node));
+        if (!validLeaf(descent))
+            continue;
+        uint64_t i = findEntry(node, key, fp);
+        if (i == MAX_POSTING_ENTRIES)
+            return false;
+        const bool posting = node->posting != nullptr;
+        stdx::unique_lock<PmseLatch> bucketLock;
+        auto bucket = lockBucket(hash, bucketLock);
+        transaction::exec_tx(pop, [this, &node, i, bucket, &key] {
+            removeEntryFromNode(node, i);
+            if (bucket)
+                removeFromHash(bucket, key);
+        });
+        if (posting && !node->posting)
+            stats.postingLeaves.fetch_sub(1, std::memory_order_relaxed);
+        _index->entries.fetch_sub(1, std::memory_order_relaxed);
+        stats.keyBytes.fetch_sub(key.ks.getSize(), std::memory_order_relaxed);
+        addCount(descent.path, descent.path.size(), -1);
+        if (node->num_keys <= _index->mergeEntries)
+            _index->underfullLeaves.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+}
+
+/* Slot is position for posting leaf */
+void PmseTree::removeEntryFromNode(persistent_ptr<PmseTreeNode> node, uint64_t slot) {
+    if (node->posting) {
+        removeFromPosting(node, slot);
+        return;
+    }
+    freeEntry(node->keys()[slot]);
+    uint64_t position = node->positionOf(slot);
+    snapshotSlotOrder(node);
+    memmove(node->slotOrder() + position, node->slotOrder() + position + 1,
+            node->num_keys - position - 1);
+    node->bitmap = node->bitmap & ~(1ULL << slot);
+    node->num_keys--;
+}
+
+/*
+ * Removes empty leaf from the list of leaves. Readers may still hold it,
+ * so it goes to retired leaves, freed by reclaim or on next open.
+ */
+void PmseTree::unlinkLeaf(persistent_ptr<PmseTreeNode> node) {
+    if (node->previous)
+        node->previous->next = node->next;
+    else
+        _root->first = node->next;
+    if (node->next)
+        node->next->previous = node->previous;
+    else
+        _root->last = node->previous;
+    node->next = _root->retired;
+    _root->retired = node;
+}
+
+/*
+ * Drops removed leaf from inner nodes, caller locked the whole path.
+ * Leaf is empty or its entries moved to sibling, so counts above stay.
+ * Empty inner nodes are dropped too, root with single child is replaced
+ * by that child while it is on the path. Unlinked nodes, separators and
+ * the leaf are retired, caller holds retiredMutex.
+ */
+void PmseTree::removeLeafFromParent(std::vector<PathEntry>& path, HeldLocks& held,
+                                    persistent_ptr<PmseTreeNode> leaf) {
+    std::vector<PmseInnerNode*> nodes;
+    std::vector<const std::string*> keys;
+    size_t level = path.size();
+    for (; level > 0; level--) {
+        PmseInnerNode* node = path[level - 1].node;
+        if (const std::string* key = node->eraseAt(path[level - 1].index))
+            keys.push_back(key);
+        if (node->childCount() > 0)
+            break;
+        nodes.push_back(node);
+        held.markObsolete(node->lock);
+        _index->stats.addInnerNodes(path.size() - level, -1);
+    }
+    PmseInnerNode* root = _index->root.load(std::memory_order_relaxed);
+    PmseInnerNode* newRoot = root;
+    for (level = 0; newRoot && level < path.size() && newRoot == path[level].node &&
+                           newRoot->childCount() <= 1; level++) {
+        PmseInnerNode* node = newRoot;
+        newRoot = node->aboveLeaves || node->childCount() == 0
+            ? nullptr : node->children[0].load(std::memory_order_relaxed);
+        if (node->childCount() == 1) {
+            node->count.store(0, std::memory_order_relaxed);  // child moves up
+            nodes.push_back(node);
+            held.markObsolete(node->lock);
+            _index->stats.addInnerNodes(path.size() - 1 - level, -1);
+        }
+    }
+    if (newRoot != root)
+        _index->root.store(newRoot, std::memory_order_release);
+
+    _index->stats.innerNodesRemoved.fetch_add(nodes.size(), std::memory_order_relaxed);
+    uint64_t epoch = PmseEpochs::retire();
+    for (auto node : nodes)
+        _index->retiredNodes.emplace_back(epoch, node);
+    for (auto key : keys)
+        _index->retiredKeys.emplace_back(epoch, key);
+    _index->retiredLeaves.emplace_back(epoch, leaf);
+}
+
+/*
+ * Appends entries of leaf to its left neighbour, which has room for them,
+ * and empties the leaf. Entries are cut to the prefix of neighbour,
+ * overflow allocations of leaf are freed.
+ */
+void PmseTree::moveEntries(persistent_ptr<PmseTreeNode> from, persistent_ptr<PmseTreeNode> to) {
+    for (uint64_t position = 0; position < from->num_keys; position++) {
+        uint64_t slot = from->slotOrder()[position];
+        IndexKeyEntry_PM& value = from->keys()[slot];
+        std::string entry = from->entryString(value);
+        fitPrefix(to, entry);
+        std::string stored = entry.substr(to->prefixSize) + from->typeBits(value).toString();
+        appendSlot(to, makeSlot(stored, value.entrySize, value.keySize), from->fingerprints()[slot]);
+        freeEntry(value);
+    }
+    from->bitmap = 0;
+    from->num_keys = 0;
+}
+
+/*
+ * Removes leaf of descent when it is empty or fits into its left
+ * neighbour under the same inner node. Posting leaves are not merged,
+ * they go back into slots once they shrink. Like writers it waits only for
+ * the leaf, neighbours and inner nodes up to root are tried. Leaf which
+ * was busy is left for the next rebalance.
+ */
+bool PmseTree::mergeLeaf(pool_base pop, Descent& descent, uint64_t mergeEntries) {
+    auto busy = [this] {
+        _index->underfullLeaves.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    };
+    auto node = descent.leaf;
+    stdx::unique_lock<PmseLatch> leafLock(_index->latch(node));
+    if (!validLeaf(descent))
+        return busy();
+    const bool merge = node->num_keys > 0;
+    if (merge && descent.path.back().index == 0)
+        return false;
+    stdx::unique_lock<PmseLatch> previousLock;
+    if (node->previous && !tryLatch(node->previous, {leafLock.mutex()}, previousLock))
+        return busy();
+    if (merge && (node->posting || node->previous->posting ||
+                  node->previous->num_keys + node->num_keys > mergeEntries))
+        return false;
+    stdx::unique_lock<PmseLatch> nextLock;
+    if (node->next && !tryLatch(node->next, {leafLock.mutex(), previousLock.mutex()}, nextLock))
+        return busy();
+    HeldLocks held;
+    for (auto& step : descent.path) {
+        if (!held.upgrade(step.node->lock, step.version))
+            return busy();
+    }
+    if (!held.upgrade(_index->rootLock, descent.rootVersion))
+        return busy();
+
+    auto left = node->previous;
+    const uint64_t moved = node->num_keys;
+    stdx::lock_guard<stdx::mutex> retiredLock(_index->retiredMutex);
+    transaction::exec_tx(pop, [this, &node, &left, merge] {
+        if (merge)
+            moveEntries(node, left);
+        unlinkLeaf(node);
+    });
+    PmseTreeStats& stats = _index->stats;
+    if (merge) {
+        const PathEntry& parent = descent.path.back();
+        parent.node->counts[parent.index - 1].fetch_add(moved, std::memory_order_relaxed);
+        stats.leafMerges.fetch_add(1, std::memory_order_relaxed);
+    }
+    stats.leaves.fetch_sub(1, std::memory_order_relaxed);
+    stats.leavesRemoved.fetch_add(1, std::memory_order_relaxed);
+    removeLeafFromParent(descent.path, held, node);
+    return true;
+}
+
+/*
+ * Moves leaf of descent to new allocation when it does not follow its
+ * previous leaf in the pool. Allocations made one after another in key
+ * order are often, though not always, adjacent, so range scans tend to
+ * read nearby media. Only the
+ * parent changes, entries with their overflow allocations go along.
+ */
+bool PmseTree::relocateLeaf(pool_base pop, Descent& descent) {
+    auto node = descent.leaf;
+    stdx::unique_lock<PmseLatch> leafLock(_index->latch(node));
+    if (!validLeaf(descent) || !node->previous)
+        return false;
+    uint64_t offset = node.raw().off;
+    uint64_t previousOffset = node->previous.raw().off;
+    if (offset > previousOffset && offset - previousOffset < 2 * _root->nodeSize)
+        return false;
+    stdx::unique_lock<PmseLatch> previousLock;
+    if (!tryLatch(node->previous, {leafLock.mutex()}, previousLock))
+        return false;
+    stdx::unique_lock<PmseLatch> nextLock;
+    if (node->next && !tryLatch(node->next, {leafLock.mutex(), previousLock.mutex()}, nextLock))
+        return false;
+    HeldLocks held;
+    const PathEntry& parent = descent.path.back();
+    if (!held.upgrade(parent.node->lock, parent.version))
+        return false;
+
+    persistent_ptr<PmseTreeNode> copy;
+    stdx::lock_guard<stdx::mutex> retiredLock(_index->retiredMutex);
+    transaction::exec_tx(pop, [this, &node, &copy] {
+        copy = allocateLeaf();
+        memcpy(static_cast<void*>(copy.get()), node.get(), _root->nodeSize);
+        node->previous->next = copy;
+        if (node->next)
+            node->next->previous = copy;
+        else
+            _root->last = copy;
+        node->num_keys = 0;
+        node->next = _root->retired;
+        _root->retired = node;
+    });
+    parent.node->leaves[parent.index].store(copy.raw().off, std::memory_order_relaxed);
+    _index->stats.leafRelocations.fetch_add(1, std::memory_order_relaxed);
+    _index->retiredLeaves.emplace_back(PmseEpochs::retire(), node);
+    return true;
+}
+
+/*
+ * Leaves are visited by their child index on each level, descending
+ * again for every leaf, so the walk continues past changes made by
+ * writers. Visit returns true when it removed the leaf, its follower
+ * then takes its position. Nothing is visited in tree of one leaf.
+ * Caller holds epoch guard.
+ */
+template <typename Visit>
+void PmseTree::walkLeaves(Visit visit) {
+    std::vector<size_t> position;
+    while (true) {
+        Descent descent;
+        size_t level = 0;
+        auto byPosition = [&position, &level](const PmseInnerNode* node) {
+            size_t n = node->childCount();
+            size_t i = level < position.size() ? position[level] : 0;
+            level++;
+            return n > 0 ? std::min(i, n - 1) : 0;
+        };
+        do {
+            level = 0;
+        } while (!descendBy(byPosition, descent));
+        if (descent.path.empty())
+            return;
+        position.clear();
+        for (auto& step : descent.path)
+            position.push_back(step.index);
+        if (visit(descent))
+            continue;
+        size_t up = position.size();
+        while (up > 0 && position[up - 1] + 1 >= descent.path[up - 1].node->childCount())
+            up--;
+        if (up == 0)
+            return;
+        position.resize(up);
+        position.back()++;
+    }
+}
+
+uint64_t PmseTree::rebalance(pool_base pop, uint64_t mergeEntries) {
+    _index->underfullLeaves.store(0, std::memory_order_relaxed);
+    uint64_t removed = 0;
+    {
+        PmseEpochs::Guard guard;
+        walkLeaves([this, &pop, mergeEntries, &removed](Descent& descent) {
+            if (!mergeLeaf(pop, descent, mergeEntries))
+                return false;
+            removed++;
+            return true;
+        });
+    }
+    reclaim(pop);
+    if (removed > 0)
+        LOG(1) << "Index: rebalance removed " << removed << " leaves";
+    return removed;
+}
+
+void PmseTree::compact(pool_base pop, uint64_t mergeEntries) {
+    uint64_t merged = rebalance(pop, mergeEntries);
+    uint64_t relocated = 0;
+    {
+        PmseEpochs::Guard guard;
+        walkLeaves([this, &pop, &relocated](Descent& descent) {
+            if (relocateLeaf(pop, descent))
+                relocated++;
+            return false;
+        });
+    }
+    reclaim(pop);
+    const PmseTreeStats& stats = _index->stats;
+    _index->compactedChurn.store(stats.leafSplits.load() + stats.leavesRemoved.load());
+    _index->compactedAt.store(curTimeMillis64());
+    log() << "Index: compaction removed " << merged << " and relocated " << relocated << " leaves";
+}
+
+/* Leaf holding single entry */
+persistent_ptr<PmseTreeNode> PmseTree::makeLeaf(const PmseKey& key, uint8_t fp) {
+    auto n = allocateLeaf();
+    fitPrefix(n, key.entry());
+    appendSlot(n, makeEntry(key, n->prefixSize), fp);
+    return n;
+}
+
+/*
+ * Binary search over slot order for first position not below entry.
+ * Leaf prefix is compared once, slots only hold the rest. Posting leaf
+ * is searched by RecordId once entry has its key.
+ */
+uint64_t PmseTree::insertionPosition(persistent_ptr<PmseTreeNode> node, StringData entry) {
+    StringData prefix = node->entriesPrefix();
+    int cmp = entry.substr(0, prefix.size()).compare(prefix);
+    if (cmp < 0 || (cmp == 0 && node->posting && entry.size() == prefix.size()))
+        return 0;
+    if (cmp > 0)
+        return node->num_keys;
+    if (node->posting)
+        return node->posting->lowerBound(recordIdOf(entry));
+    StringData rest = entry.substr(node->prefixSize);
+    uint64_t low = 0;
+    uint64_t high = node->num_keys;
+    while (low < high) {
+        uint64_t middle = (low + high) / 2;
+        if (rest.compare(node->suffix(node->entryAt(middle))) > 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+/*
+ * Slot holding given bytes, overflow allocation is made in current
+ * transaction.
+ */
+IndexKeyEntry_PM PmseTree::makeSlot(StringData stored, uint64_t entrySize, uint64_t keySize) {
+    IndexKeyEntry_PM value;
+    memset(&value, 0, sizeof(value));
+    value.size = stored.size();
+    value.entrySize = entrySize;
+    value.keySize = keySize;
+    char* data = value.bytes;
+    if (!value.isInline()) {
+        PMEMoid oid = pmemobj_tx_alloc(value.size, 1);
+        if (OID_IS_NULL(oid))
+            throw pmem::transaction_alloc_error("cannot allocate index entry");
+        memcpy(value.bytes, &oid, sizeof(oid));
+        data = static_cast<char*>(pmemobj_direct(oid));
+    }
+    memcpy(data, stored.rawData(), stored.size());
+    return value;
+}
+
+/*
+ * Slot content for key in leaf with given prefix. TypeBits are left out
+ * when all zero, which is common.
+ */
+IndexKeyEntry_PM PmseTree::makeEntry(const PmseKey& key, uint64_t prefixSize) {
+    const KeyString::TypeBits& typeBits = key.ks.getTypeBits();
+    std::string stored = key.entry().substr(prefixSize).toString();
+    if (!typeBits.isAllZeros())
+        stored.append(typeBits.getBuffer(), typeBits.getSize());
+    return makeSlot(stored, key.ks.getSize(), key.keySize);
+}
+
+void PmseTree::freeEntry(const IndexKeyEntry_PM& slot) {
+    if (!slot.isInline())
+        pmemobj_tx_free(slot.overflow());
+}
+
+/*
+ * Makes leaf prefix common with entry about to be inserted. Empty leaf
+ * takes as much of entry as fits. When prefix gets shorter, the cut part
+ * is moved back to all slots.
+ */
+void PmseTree::fitPrefix(persistent_ptr<PmseTreeNode> node, StringData entry) {
+    if (node->num_keys == 0) {
+        uint64_t length = std::min<uint64_t>(node->prefixCapacity, entry.size());
+        if (length > 0) {
+            pmemobj_tx_add_range_direct(node->prefix(), length);
+            memcpy(node->prefix(), entry.rawData(), length);
+        }
+        node->prefixSize = length;
+        return;
+    }
+    uint64_t common = commonPrefix(node->prefixData(), entry);
+    if (common == node->prefixSize)
+        return;
+    StringData moved = node->prefixData().substr(common);
+    for (uint64_t slots = node->bitmap; slots; slots &= slots - 1) {
+        IndexKeyEntry_PM& slot = node->keys()[countTrailingZeros64(slots)];
+        std::string stored = moved.toString() + StringData(slot.data(), slot.size).toString();
+        IndexKeyEntry_PM value = makeSlot(stored, slot.entrySize, slot.keySize);
+        freeEntry(slot);
+        pmemobj_tx_add_range_direct(&slot, sizeof(slot));
+        slot = value;
+    }
+    node->prefixSize = common;
+}
+
+/*
+ * Fills slot which is not valid, so nothing reads it until its bit is set.
+ * It is persisted directly instead of being added to undo log.
+ */
+void PmseTree::writeFreeSlot(persistent_ptr<PmseTreeNode> node, uint64_t slot,
+                             const IndexKeyEntry_PM& value, uint8_t fp) {
+    auto pop = pool_by_vptr(node.get());
+    memcpy(static_cast<void*>(&node->keys()[slot]), &value, sizeof(value));
+    node->fingerprints()[slot] = fp;
+    pop.persist(&node->keys()[slot], sizeof(IndexKeyEntry_PM));
+    pop.persist(&node->fingerprints()[slot], sizeof(uint8_t));
+}
+
+/*
+ * Adds entry after all others, used while leaves are filled in key order.
+ * Position past the last one is not read, so it is persisted directly.
+ */
+void PmseTree::appendSlot(persistent_ptr<PmseTreeNode> node, const IndexKeyEntry_PM& value, uint8_t fp) {
+    uint64_t slot = countTrailingZeros64(~node->bitmap);
+    writeFreeSlot(node, slot, value, fp);
+    node->slotOrder()[node->num_keys] = slot;
+    pool_by_vptr(node.get()).persist(&node->slotOrder()[node->num_keys], sizeof(uint8_t));
+    node->bitmap = node->bitmap | (1ULL << slot);
+    node->num_keys = node->num_keys + 1;
+}
+
+/*
+ * Insert key into free slot and link it into slot order.
+ */
+Status PmseTree::insertKeyIntoLeaf(persistent_ptr<PmseTreeNode> node,
+                                   const PmseKey& key, uint8_t fp) {
+    uint64_t position = insertionPosition(node, key.entry());
+    uint64_t slot = countTrailingZeros64(~node->bitmap);
+
+    writeFreeSlot(node, slot, makeEntry(key, node->prefixSize), fp);
+    snapshotSlotOrder(node);
+    memmove(node->slotOrder() + position + 1, node->slotOrder() + position,
+            node->num_keys - position);
+    node->slotOrder()[position] = slot;
+    node->bitmap = node->bitmap | (1ULL << slot);
+    node->num_keys = node->num_keys + 1;
+    return Status::OK();
+}
+
+/* Finds the appropriate place to
+ * split a node that is too big into two.
+ */
+uint64_t PmseTree::cut(uint64_t length) {
+    if (length % 2 == 0)
+        return length / 2;
+    else
+        return length / 2 + 1;
+}
+
+/*
+ * Split leaf and insert value, returns new right leaf. Upper half is
+ * copied to new leaf, lower half stays in its slots.
+ */
+persistent_ptr<PmseTreeNode> PmseTree::splitFullNodeAndInsert(persistent_ptr<PmseTreeNode> node,
+                                                              const PmseKey& key, uint8_t fp) {
+    const uint8_t insertedSlot = MAX_LEAF_SLOTS;  // marks new entry in order below
+    const uint64_t length = node->num_keys + 1;
+    uint64_t i, j;
+    uint64_t insertion_index = insertionPosition(node, key.entry());
+    uint64_t split = cut(length);
+    persistent_ptr<PmseTreeNode> new_leaf = allocateLeaf();
+
+    /*
+     * Slots in key order including inserted key
+     */
+    uint8_t order[MAX_LEAF_SLOTS + 1];
+    for (i = 0, j = 0; i < node->num_keys; i++, j++) {
+        if (j == insertion_index)
+            j++;
+        order[j] = node->slotOrder()[i];
+    }
+    order[insertion_index] = insertedSlot;
+
+    IndexKeyEntry_PM inserted = makeEntry(key, node->prefixSize);
+    auto source = [&](uint8_t slot) -> IndexKeyEntry_PM& {
+        return slot == insertedSlot ? inserted : node->keys()[slot];
+    };
+
+    /*
+     * Upper half gets own prefix, common part of its first and last
+     * entry, which is at least the old one. Lower half keeps its prefix.
+     */
+    std::string first = node->entryString(source(order[split]));
+    std::string last = node->entryString(source(order[length - 1]));
+    uint64_t prefixSize = std::min<uint64_t>(commonPrefix(first, last), new_leaf->prefixCapacity);
+    uint64_t cutSize = prefixSize - node->prefixSize;
+    memcpy(new_leaf->prefix(), first.data(), prefixSize);
+    new_leaf->prefixSize = prefixSize;
+
+    /*
+     * Copy upper half to new node, it was allocated in this transaction
+     * and is persisted on commit
+     */
+    uint64_t bitmap = node->bitmap;
+    for (i = split, j = 0; i < length; i++, j++) {
+        IndexKeyEntry_PM& entry = source(order[i]);
+        if (cutSize == 0) {
+            new_leaf->keys()[j] = entry;
+        } else {
+            new_leaf->keys()[j] = makeSlot(StringData(entry.data(), entry.size).substr(cutSize),
+                                           entry.entrySize, entry.keySize);
+            freeEntry(entry);
+        }
+        if (order[i] == insertedSlot) {
+            new_leaf->fingerprints()[j] = fp;
+        } else {
+            new_leaf->fingerprints()[j] = node->fingerprints()[order[i]];
+            bitmap &= ~(1ULL << order[i]);
+        }
+        new_leaf->slotOrder()[j] = j;
+    }
+    new_leaf->num_keys = j;
+    new_leaf->bitmap = (1ULL << j) - 1;
+
+    /*
+     * Lower half keeps its slots. Slot freed above may be reused for
+     * inserted key, so it is written through undo log here.
+     */
+    snapshotSlotOrder(node);
+    for (i = 0; i < split; i++) {
+        if (order[i] == insertedSlot) {
+            uint64_t slot = countTrailingZeros64(~bitmap);
+            pmemobj_tx_add_range_direct(&node->keys()[slot], sizeof(IndexKeyEntry_PM));
+            node->keys()[slot] = inserted;
+            pmemobj_tx_add_range_direct(&node->fingerprints()[slot], sizeof(uint8_t));
+            node->fingerprints()[slot] = fp;
+            bitmap |= 1ULL << slot;
+            order[i] = slot;
+        }
+        node->slotOrder()[i] = order[i];
+    }
+    node->bitmap = bitmap;
+    node->num_keys = split;
+
+    linkLeafAfter(node, new_leaf);
+    return new_leaf;
+}
+
+/*
+ * Update pointers next, previous
+ */
+void PmseTree::linkLeafAfter(persistent_ptr<PmseTreeNode> node, persistent_ptr<PmseTreeNode> new_leaf) {
+    new_leaf->next = node->next;
+    if (node->next) {
+        node->next->previous = new_leaf;
+    }
+    node->next = new_leaf;
+    new_leaf->previous = node;
+    if (node == _root->last)
+        _root->last = new_leaf;
+}
+
+/* Entries of leaf of one key by RecordId, from slots or posting list */
+std::vector<PmsePosting> PmseTree::readPosting(persistent_ptr<PmseTreeNode> node) {
+    std::vector<PmsePosting> entries;
+    entries.reserve(node->num_keys + 1);
+    for (uint64_t position = 0; position < node->num_keys; position++) {
+        int64_t recordId = node->posting ? node->posting->recordIdAt(position)
+                                         : recordIdOf(node->entryStringAt(position));
+        entries.push_back({recordId, node->typeBitsAt(position).toString()});
+    }
+    return entries;
+}
+
+/*
+ * Writes posting list of leaf from entries sorted by RecordId. List is
+ * rewritten in place when it fits and only bytes which changed are
+ * logged, so appending RecordIds logs little. Otherwise new list with
+ * room to grow replaces it. Caller sets num_keys.
+ */
+void PmseTree::writePosting(persistent_ptr<PmseTreeNode> node, StringData key,
+                            const std::vector<PmsePosting>& entries) {
+    std::vector<const std::string*> variants;
+    std::vector<uint64_t> variantOf;
+    variantOf.reserve(entries.size());
+    for (auto& e : entries) {
+        uint64_t variant = 0;
+        while (variant < variants.size() && *variants[variant] != e.typeBits)
+            variant++;
+        if (variant == variants.size())
+            variants.push_back(&e.typeBits);
+        variantOf.push_back(variant);
+    }
+    const uint64_t base = entries.front().recordId;
+    uint64_t range = static_cast<uint64_t>(entries.back().recordId) - base;
+    uint8_t width = 1;
+    while (width < sizeof(range) && range >> (8 * width) != 0)
+        width *= 2;
+    uint8_t variantWidth = variants.size() == 1 ? 0 : variants.size() <= 256 ? 1 : 2;
+
+    std::string image = key.toString();
+    for (auto variant : variants) {
+        uint16_t length = variant->size();
+        image.append(reinterpret_cast<const char*>(&length), sizeof(length));
+        image.append(*variant);
+    }
+    uint64_t variantBytes = image.size() - key.size();
+    for (uint64_t i = 0; i < entries.size(); i++) {
+        uint64_t offset = static_cast<uint64_t>(entries[i].recordId) - base;
+        image.append(reinterpret_cast<const char*>(&offset), width);
+        image.append(reinterpret_cast<const char*>(&variantOf[i]), variantWidth);
+    }
+
+    persistent_ptr<PmsePostingList> list = node->posting;
+    if (list && list->capacity >= image.size()) {
+        uint64_t unchanged = commonPrefix(StringData(list->data(), list->used()), image);
+        if (unchanged < image.size()) {
+            pmemobj_tx_add_range_direct(list->data() + unchanged, image.size() - unchanged);
+            memcpy(list->data() + unchanged, image.data() + unchanged, image.size() - unchanged);
+        }
+    } else {
+        uint64_t capacity = image.size() + image.size() / 2;
+        PMEMoid oid = pmemobj_tx_alloc(sizeof(PmsePostingList) + capacity, 0);
+        if (OID_IS_NULL(oid))
+            throw pmem::transaction_alloc_error("cannot allocate posting list");
+        if (list)
+            pmemobj_tx_free(list.raw());
+        list = persistent_ptr<PmsePostingList>(oid);
+        list->capacity = capacity;
+        memcpy(list->data(), image.data(), image.size());
+        node->posting = list;
+    }
+    list->size = entries.size();
+    list->base = static_cast<int64_t>(base);
+    list->keySize = key.size();
+    list->variants = variants.size();
+    list->variantBytes = variantBytes;
+    list->width = width;
+    list->variantWidth = variantWidth;
+}
+
+/*
+ * Adds entry to posting leaf with its key. Full leaf holding only that
+ * key becomes posting leaf, its slots are freed.
+ */
+void PmseTree::addToPosting(persistent_ptr<PmseTreeNode> node, const PmseKey& key) {
+    std::vector<PmsePosting> entries = readPosting(node);
+    if (!node->posting) {
+        for (uint64_t slots = node->bitmap; slots; slots &= slots - 1)
+            freeEntry(node->keys()[countTrailingZeros64(slots)]);
+        node->bitmap = 0;
+        node->prefixSize = 0;
+    }
+    insertPosting(entries, key.recordId, storedTypeBits(key));
+    writePosting(node, key.key(), entries);
+    node->num_keys = entries.size();
+}
+
+/*
+ * Posting list shrunk to half a leaf goes back into slots, so rebalance
+ * may merge the leaf again. Empty leaf is left to rebalance.
+ */
+void PmseTree::removeFromPosting(persistent_ptr<PmseTreeNode> node, uint64_t position) {
+    std::string key = node->posting->key().toString();
+    std::vector<PmsePosting> entries = readPosting(node);
+    entries.erase(entries.begin() + position);
+    if (entries.size() > node->capacity / 2) {
+        writePosting(node, key, entries);
+        node->num_keys = entries.size();
+        return;
+    }
+    pmemobj_tx_free(node->posting.raw());
+    node->posting = nullptr;
+    node->num_keys = 0;
+    if (!entries.empty())
+        fillSlots(node, key, entries);
+}
+
+/*
+ * Writes entries of one key into empty leaf which has room for them.
+ * Prefix is common part of first and last entry, like in bulk load.
+ */
+void PmseTree::fillSlots(persistent_ptr<PmseTreeNode> node, StringData key,
+                         const std::vector<PmsePosting>& entries) {
+    std::string first = key.toString() + recordIdString(entries.front().recordId);
+    std::string last = key.toString() + recordIdString(entries.back().recordId);
+    uint64_t prefixSize = std::min<uint64_t>(commonPrefix(first, last), node->prefixCapacity);
+    if (prefixSize > 0) {
+        pmemobj_tx_add_range_direct(node->prefix(), prefixSize);
+        memcpy(node->prefix(), first.data(), prefixSize);
+    }
+    node->prefixSize = prefixSize;
+    uint8_t fp = _index->fingerprint(key);
+    for (auto& e : entries) {
+        std::string entry = key.toString() + recordIdString(e.recordId);
+        appendSlot(node, makeSlot(entry.substr(prefixSize) + e.typeBits, entry.size(), key.size()), fp);
+    }
+}
+
+/*
+ * Splits posting leaf for entry it cannot take, returns new right leaf.
+ * KeyStrings of keys with the same number of fields are prefix free, so
+ * entry of other key sorts before or after the whole list and gets leaf
+ * of its own on that side. Full list is split in halves.
+ */
+persistent_ptr<PmseTreeNode> PmseTree::splitPostingAndInsert(persistent_ptr<PmseTreeNode> node,
+                                                             const PmseKey& key, uint8_t fp) {
+    std::string listKey = node->posting->key().toString();
+    persistent_ptr<PmseTreeNode> new_leaf;
+    if (key.key() == listKey) {
+        std::vector<PmsePosting> lower = readPosting(node);
+        insertPosting(lower, key.recordId, storedTypeBits(key));
+        std::vector<PmsePosting> upper(lower.begin() + lower.size() / 2, lower.end());
+        lower.resize(lower.size() / 2);
+        new_leaf = allocateLeaf();
+        writePosting(new_leaf, listKey, upper);
+        new_leaf->num_keys = upper.size();
+        writePosting(node, listKey, lower);
+        node->num_keys = lower.size();
+    } else if (key.entry().compare(listKey) > 0) {
+        new_leaf = makeLeaf(key, fp);
+    } else {
+        new_leaf = allocateLeaf();
+        new_leaf->posting = node->posting;
+        new_leaf->num_keys = node->num_keys;
+        node->posting = nullptr;
+        node->num_keys = 0;
+        fitPrefix(node, key.entry());
+        appendSlot(node, makeEntry(key, node->prefixSize), fp);
+    }
+    linkLeafAfter(node, new_leaf);
+    return new_leaf;
+}
+
+/*
+ * Adds separator of split leaf to volatile inner nodes, splitting them
+ * up the path when they overflow. Caller locked the nodes which change.
+ * New nodes are complete before they are linked. Counts of changed nodes
+ * are set from their children, ancestors above get the inserted entry.
+ */
+void PmseTree::insertIntoNodeParent(std::vector<PathEntry>& path, persistent_ptr<PmseTreeNode> left,
+                                    const std::string* separator, persistent_ptr<PmseTreeNode> right) {
+    PmseTreeStats& stats = _index->stats;
+    if (path.empty()) {
+        auto root = new PmseInnerNode(true);
+        root->append(nullptr, nullptr, left.raw().off, left->num_keys);
+        root->append(separator, nullptr, right.raw().off, right->num_keys);
+        stats.addInnerNodes(0, 1);
+        _index->root.store(root, std::memory_order_release);
+        return;
+    }
+    PmseInnerNode* node = path.back().node;
+    node->counts[path.back().index].store(left->num_keys, std::memory_order_relaxed);
+    node->insertAt(path.back().index, separator, nullptr, right.raw().off, right->num_keys);
+
+    for (size_t level = 0; node->childCount() > INNER_NODE_ORDER + 1; level++) {
+        auto sibling = new PmseInnerNode(node->aboveLeaves);
+        const std::string* up = node->splitTo(sibling, (node->childCount() - 1) / 2);
+        stats.addInnerNodes(level, 1);
+        stats.innerNodeSplits.fetch_add(1, std::memory_order_relaxed);
+        path.pop_back();
+        if (path.empty()) {
+            auto root = new PmseInnerNode(false);
+            root->append(nullptr, node, 0, node->total());
+            root->append(up, sibling, 0, sibling->total());
+            stats.addInnerNodes(level + 1, 1);
+            _index->root.store(root, std::memory_order_release);
+            return;
+        }
+        PmseInnerNode* child = node;
+        node = path.back().node;
+        node->counts[path.back().index].store(child->total(), std::memory_order_relaxed);
+        node->insertAt(path.back().index, up, sibling, 0, sibling->total());
+    }
+    addCount(path, path.size() - 1, 1);
+}
+
+/* Hash table grows once the entry is in and latches are released */
+Status PmseTree::insert(pool_base pop, IndexKeyEntry& entry,
+                        const BSONObj& ordering, bool dupsAllowed) {
+    Status status = insertEntry(pop, entry, dupsAllowed);
+    if (status.isOK() && _root->hash) {
+        try {
+            growHash(pop);
+        } catch (std::exception &e) {
+            log() << "Index: " << e.what();
+        }
+    }
+    return status;
+}
+
+/*
+ * Entry of index with hash table goes to its bucket in the transaction
+ * which changes leaf. Bucket latch is taken after leaf latch.
+ */
+Status PmseTree::insertEntry(pool_base pop, IndexKeyEntry& entry, bool dupsAllowed) {
+    Status status = Status::OK();
+    PmseKey key(entry, _index->ordering);
+    uint8_t fp = _index->fingerprint(key.key());
+    uint64_t hash = _root->hash ? tableHash(*_index, key.key()) : 0;
+    PmseTreeStats& stats = _index->stats;
+    PmseEpochs::Guard guard;
+    uint64_t failedLatches = 0;
+    bool lostLatch = false;
+    try {
+        for (bool retry = false; true; retry = true) {
+            if (retry)
+                stats.restarts.fetch_add(1, std::memory_order_relaxed);
+            if (lostLatch) {
+                backoff(++failedLatches);
+                lostLatch = false;
+            }
+            Descent descent;
+            if (!descend(key.entry(), descent))
+                continue;
+            HeldLocks held;
+            if (!descent.leaf) {
+                /* First leaf of empty tree, guarded as parent of root */
+                if (!held.upgrade(_index->rootLock, descent.rootVersion))
+                    continue;
+                stdx::unique_lock<PmseLatch> bucketLock;
+                auto bucket = lockBucket(hash, bucketLock);
+                transaction::exec_tx(pop, [this, &key, fp, bucket, hash] {
+                    _root->first = makeLeaf(key, fp);
+                    _root->last = _root->first;
+                    if (bucket)
+                        addToHash(bucket, hash, withTypeBits(key), key.ks.getSize(), key.keySize);
+                });
+                _index->entries.fetch_add(1, std::memory_order_relaxed);
+                stats.keyBytes.fetch_add(key.ks.getSize(), std::memory_order_relaxed);
+                stats.leaves.fetch_add(1, std::memory_order_relaxed);
+                return Status::OK();
+            }
+            auto node = descent.leaf;
+            stdx::unique_lock<PmseLatch> leafLock(_index->latch(node));
+            if (!validLeaf(descent))
+                continue;
+            if (!dupsAllowed) {
+                status = checkDuplicate(node, key, fp, entry);
+                if (status.isOK() && !checkNeighbourDuplicates(node, key, fp, entry, status)) {
+                    lostLatch = true;
+                    continue;
+                }
+                if (!status.isOK())
+                    return status;
+            }
+            /*
+             * Duplicates of key filling leaf move to posting list, which
+             * takes further ones until it is full. Leaf stays in place.
+             */
+            const bool toPosting = _index->postingLists && !node->posting &&
+                node->num_keys == node->capacity && node->keyEqualsAt(0, key.key()) &&
+                node->keyEqualsAt(node->num_keys - 1, key.key());
+            const bool intoPosting = node->posting && node->num_keys < MAX_POSTING_ENTRIES &&
+                node->posting->key() == key.key();
+            if ((!node->posting && node->num_keys < node->capacity) || toPosting || intoPosting) {
+                stdx::unique_lock<PmseLatch> bucketLock;
+                auto bucket = lockBucket(hash, bucketLock);
+                transaction::exec_tx(pop, [this, &status, &node, &key, fp, bucket, hash, toPosting,
+                                           intoPosting] {
+                    if (toPosting || intoPosting) {
+                        addToPosting(node, key);
+                    } else {
+                        fitPrefix(node, key.entry());
+                        status = insertKeyIntoLeaf(node, key, fp);
+                    }
+                    if (bucket && status.isOK())
+                        addToHash(bucket, hash, withTypeBits(key), key.ks.getSize(), key.keySize);
+                });
+                if (status.isOK()) {
+                    _index->entries.fetch_add(1, std::memory_order_relaxed);
+                    stats.keyBytes.fetch_add(key.ks.getSize(), std::memory_order_relaxed);
+                    addCount(descent.path, descent.path.size(), 1);
+                    if (toPosting)
+                        stats.postingLeaves.fetch_add(1, std::memory_order_relaxed);
+                }
+                return status;
+            }
+
+            /*
+             * Leaf has to be split. Only inner nodes which change are
+             * locked, next leaf is only tried as its holder may wait for
+             * this one.
+             */
+            stdx::unique_lock<PmseLatch> nextLock;
+            if (!lockForSplit(descent, held) ||
+                (node->next && !tryLatch(node->next, {leafLock.mutex()}, nextLock))) {
+                lostLatch = true;
+                continue;
+            }
+            persistent_ptr<PmseTreeNode> new_leaf;
+            stdx::unique_lock<PmseLatch> bucketLock;
+            auto bucket = lockBucket(hash, bucketLock);
+            transaction::exec_tx(pop, [this, &node, &key, fp, &new_leaf, bucket, hash] {
+                if (node->posting) {
+                    new_leaf = splitPostingAndInsert(node, key, fp);
+                } else {
+                    fitPrefix(node, key.entry());
+                    new_leaf = splitFullNodeAndInsert(node, key, fp);
+                }
+                if (bucket)
+                    addToHash(bucket, hash, withTypeBits(key), key.ks.getSize(), key.keySize);
+            });
+            insertIntoNodeParent(descent.path, node,
+                                 new std::string(shortestSeparator(
+                                     node->entryStringAt(node->num_keys - 1),
+                                     new_leaf->entryStringAt(0))),
+                                 new_leaf);
+            if (node->posting && new_leaf->posting)
+                stats.postingLeaves.fetch_add(1, std::memory_order_relaxed);
+            _index->entries.fetch_add(1, std::memory_order_relaxed);
+            stats.keyBytes.fetch_add(key.ks.getSize(), std::memory_order_relaxed);
+            stats.leaves.fetch_add(1, std::memory_order_relaxed);
+            stats.leafSplits.fetch_add(1, std::memory_order_relaxed);
+            return Status::OK();
+        }
+    } catch (std::exception &e) {
+        log() << "Index: " << e.what();
+        return Status(ErrorCodes::CommandFailed, e.what());
+    }
+}
+
+/*
+ * Bucket of hash with its latch held, none when index has no hash table.
+ * Shape changes only under latch of bucket being split, so bucket is
+ * right when shape is the same once latch is taken.
+ */
+persistent_ptr<PmseHashEntry>* PmseTree::lockBucket(uint64_t hash, stdx::unique_lock<PmseLatch>& lock) {
+    if (!_root->hash)
+        return nullptr;
+    while (true) {
+        uint64_t shape = _index->hashShape.load(std::memory_order_acquire);
+        uint64_t bucket = PmseTreeIndex::bucketOf(hash, shape);
+        lock = stdx::unique_lock<PmseLatch>(_index->bucketLatch(bucket));
+        if (_index->hashShape.load(std::memory_order_acquire) == shape)
+            return &_root->hash->bucket(bucket);
+        lock.unlock();
+    }
+}
+
+/* Has to be called in transaction */
+void PmseTree::addToHash(persistent_ptr<PmseHashEntry>* bucket, uint64_t hash, StringData stored,
+                         uint64_t entrySize, uint64_t keySize) {
+    PMEMoid oid = pmemobj_tx_alloc(sizeof(PmseHashEntry) + stored.size(), 0);
+    if (OID_IS_NULL(oid))
+        throw pmem::transaction_alloc_error("cannot allocate hash table entry");
+    persistent_ptr<PmseHashEntry> added(oid);
+    added->next = *bucket;
+    added->hash = hash;
+    added->size = stored.size();
+    added->entrySize = entrySize;
+    added->keySize = keySize;
+    added->reserved = 0;
+    memcpy(const_cast<char*>(added->data()), stored.rawData(), stored.size());
+    *bucket = added;
+}
+
+/* Has to be called in transaction */
+void PmseTree::removeFromHash(persistent_ptr<PmseHashEntry>* bucket, const PmseKey& key) {
+    StringData whole = key.entry();
+    for (persistent_ptr<PmseHashEntry>* link = bucket; *link; link = &(*link)->next) {
+        persistent_ptr<PmseHashEntry> entry = *link;
+        if (entry->entry() == whole) {
+            *link = entry->next;
+            pmemobj_tx_free(entry.raw());
+            return;
+        }
+    }
+}
+
+bool PmseTree::findEqual(StringData key, bool lowest, std::string* entry, std::string* typeBits) {
+    uint64_t hash = tableHash(*_index, key);
+    PmseLatch* latch;
+    uint64_t bucket;
+    while (true) {
+        uint64_t shape = _index->hashShape.load(std::memory_order_acquire);
+        bucket = PmseTreeIndex::bucketOf(hash, shape);
+        latch = &_index->bucketLatch(bucket);
+        latch->lock_shared();
+        if (_index->hashShape.load(std::memory_order_acquire) == shape)
+            break;
+        latch->unlock_shared();
+    }
+    bool found = false;
+    for (auto candidate = _root->hash->bucket(bucket); candidate; candidate = candidate->next) {
+        if (candidate->hash != hash || candidate->keySize != key.size() ||
+            memcmp(candidate->data(), key.rawData(), key.size()) != 0)
+            continue;
+        StringData whole = candidate->entry();
+        if (!found || (lowest ? whole < StringData(*entry) : whole > StringData(*entry))) {
+            *entry = whole.toString();
+            *typeBits = candidate->typeBits().toString();
+            found = true;
+        }
+    }
+    latch->unlock_shared();
+    return found;
+}
+
+/*
+ * Splits next bucket of linear hashing in one transaction. Its entries
+ * which belong to the next level move to new bucket at the table end.
+ * Latches of both buckets are held, they may share stripe.
+ */
+void PmseTree::splitBucket(pool_base pop) {
+    uint64_t shape = _index->hashShape.load(std::memory_order_relaxed);
+    uint64_t level = shape >> 32;
+    uint64_t from = shape & 0xffffffffULL;
+    uint64_t to = from + (HASH_BASE_BUCKETS << level);
+    uint64_t next = to + 1 == HASH_BASE_BUCKETS << (level + 1) ? (level + 1) << 32 : shape + 1;
+    PmseLatch& fromLatch = _index->bucketLatch(from);
+    PmseLatch& toLatch = _index->bucketLatch(to);
+    stdx::unique_lock<PmseLatch> lock(fromLatch);
+    stdx::unique_lock<PmseLatch> toLock;
+    if (&toLatch != &fromLatch)
+        toLock = stdx::unique_lock<PmseLatch>(toLatch);
+    transaction::exec_tx(pop, [this, level, from, to, next] {
+        uint64_t segment, offset;
+        PmseHashTable::locate(to, &segment, &offset);
+        if (!_root->hash->segments[segment])
+            _root->hash->segments[segment] = make_persistent<persistent_ptr<PmseHashEntry>[]>(
+                HASH_BASE_BUCKETS << level);
+        uint64_t mask = (HASH_BASE_BUCKETS << (level + 1)) - 1;
+        persistent_ptr<PmseHashEntry> entry = _root->hash->bucket(from);
+        _root->hash->bucket(from) = nullptr;
+        while (entry) {
+            persistent_ptr<PmseHashEntry> following = entry->next;
+            persistent_ptr<PmseHashEntry>& head = _root->hash->bucket((entry->hash & mask) == from ? from : to);
+            entry->next = head;
+            head = entry;
+            entry = following;
+        }
+        _root->hash->level = next >> 32;
+        _root->hash->split = next & 0xffffffffULL;
+    });
+    _index->hashShape.store(next, std::memory_order_release);
+}
+
+/* Splits buckets while chains are longer than HASH_LOAD, writer busy with it is not waited for */
+void PmseTree::growHash(pool_base pop) {
+    stdx::unique_lock<stdx::mutex> lock(_index->hashSplitMutex, stdx::try_to_lock);
+    if (!lock)
+        return;
+    while (true) {
+        uint64_t shape = _index->hashShape.load(std::memory_order_relaxed);
+        uint64_t level = shape >> 32;
+        uint64_t buckets = (HASH_BASE_BUCKETS << level) + (shape & 0xffffffffULL);
+        if (level >= HASH_MAX_LEVEL ||
+            static_cast<uint64_t>(std::max<int64_t>(_index->entries.load(), 0)) <= HASH_LOAD * buckets)
+            return;
+        splitBucket(pop);
+    }
+}
+
+/* Frees all entries of hash table, one transaction per bucket */
+void PmseTree::clearHash(pool_base pop) {
+    uint64_t buckets = (HASH_BASE_BUCKETS << _root->hash->level) + _root->hash->split;
+    for (uint64_t bucket = 0; bucket < buckets; bucket++) {
+        if (!_root->hash->bucket(bucket))
+            continue;
+        transaction::exec_tx(pop, [this, bucket] {
+            persistent_ptr<PmseHashEntry>& head = _root->hash->bucket(bucket);
+            while (head) {
+                auto entry = head;
+                head = entry->next;
+                pmemobj_tx_free(entry.raw());
+            }
+        });
+    }
+}
+
+/*
+ * Adds entries of all leaves to empty hash table, one transaction per
+ * leaf. Table is marked complete at the end, until then lookups go to
+ * leaves and open starts the fill over.
+ */
+void PmseTree::fillHash(pool_base pop) {
+    for (auto leaf = _root->first; leaf; leaf = leaf->next) {
+        transaction::exec_tx(pop, [this, &leaf] {
+            for (uint64_t i = 0; i < leaf->num_keys; i++) {
+                std::string stored = leaf->entryStringAt(i);
+                uint64_t entrySize = stored.size();
+                uint64_t keySize = leaf->keySizeAt(i);
+                uint64_t hash = tableHash(*_index, StringData(stored).substr(0, keySize));
+                stored.append(leaf->typeBitsAt(i).toString());
+                stdx::unique_lock<PmseLatch> bucketLock;
+                auto bucket = lockBucket(hash, bucketLock);
+                addToHash(bucket, hash, stored, entrySize, keySize);
+            }
+        });
+        growHash(pop);
+    }
+    transaction::exec_tx(pop, [this] {
+        _root->hash->complete = true;
+    });
 }
 
 uint64_t PmseTree::countElements() {
-    if (!isEmpty()) {
-        auto leaf = _first;
-        uint64_t counter = 0;
-        while (leaf) {
-            counter += leaf->num_keys;
-            leaf = leaf->next;
+    PmseEpochs::Guard guard;
+    uint64_t counter = 0;
+    auto leaf = lockEnd(false);
+    while (leaf) {
+        counter += leaf->num_keys;
+        auto next = leaf->next;
+        if (next)
+            _index->latch(next).lock_shared();
+        _index->latch(leaf).unlock_shared();
+        leaf = next;
+    }
+    return counter;
+}
+
+uint64_t PmseTree::numEntries() const {
+    return std::max<int64_t>(_index->entries.load(std::memory_order_relaxed), 0);
+}
+
+boost::optional<IndexKeyEntry> PmseTree::entryAtRank(uint64_t rank) {
+    PmseEpochs::Guard guard;
+    while (true) {
+        uint64_t position = rank;
+        Descent descent;
+        if (!descendToRank(position, descent))
+            continue;
+        if (!descent.leaf)
+            return boost::none;
+        auto leaf = descent.leaf;
+        _index->latch(leaf).lock_shared();
+        if (!validLeaf(descent)) {
+            _index->latch(leaf).unlock_shared();
+            continue;
         }
-        return counter;
+        /* Empty leaves waiting for rebalance are stepped over */
+        while (leaf->num_keys == 0 && leaf->next) {
+            auto next = leaf->next;
+            _index->latch(next).lock_shared();
+            _index->latch(leaf).unlock_shared();
+            leaf = next;
+        }
+        if (leaf->num_keys == 0) {
+            _index->latch(leaf).unlock_shared();
+            return boost::none;
+        }
+        position = std::min<uint64_t>(position, leaf->num_keys - 1);
+        std::string entry = leaf->entryStringAt(position);
+        std::string typeBits = leaf->typeBitsAt(position).toString();
+        uint64_t keySize = leaf->keySizeAt(position);
+        _index->latch(leaf).unlock_shared();
+        return _index->decode(entry, typeBits, keySize);
+    }
+}
+
+void PmseTree::appendStats(BSONObjBuilder* output, double scale) {
+    const PmseTreeStats& stats = _index->stats;
+    long long leaves = std::max<int64_t>(stats.leaves.load(std::memory_order_relaxed), 0);
+    long long innerNodes = 0;
+    std::vector<long long> levels;
+    for (auto& level : stats.innerNodes) {
+        long long nodes = std::max<int64_t>(level.load(std::memory_order_relaxed), 0);
+        if (nodes == 0)
+            break;
+        levels.push_back(nodes);
+        innerNodes += nodes;
+    }
+    uint64_t latchWaits = 0;
+    for (auto& latch : _index->latches)
+        latchWaits += latch.waits();
+    uint64_t innerBytes = innerNodes * sizeof(PmseInnerNode);
+    {
+        PmseEpochs::Guard guard;
+        if (const PmseInnerNode* root = _index->root.load(std::memory_order_acquire))
+            innerBytes += separatorBytes(root);
+    }
+
+    output->appendNumber("nodeSize", static_cast<long long>(_root->nodeSize));
+    output->appendNumber("height", static_cast<long long>(leaves > 0 ? levels.size() + 1 : 0));
+    output->appendNumber("leaves", leaves);
+    output->appendNumber("postingLeaves", static_cast<long long>(
+        std::max<int64_t>(stats.postingLeaves.load(std::memory_order_relaxed), 0)));
+    {
+        BSONArrayBuilder perLevel(output->subarrayStart("innerNodesPerLevel"));
+        for (auto nodes : levels)
+            perLevel.append(nodes);
     }
-    return 0;
+    output->appendNumber("entries", static_cast<long long>(numEntries()));
+    output->append("averageLeafFill",
+                   leaves > 0 ? static_cast<double>(numEntries()) / (leaves * _index->capacity) : 0.0);
+    output->appendNumber("keyBytes", static_cast<long long>(
+        std::max<int64_t>(stats.keyBytes.load(std::memory_order_relaxed), 0) / scale));
+    output->appendNumber("leafBytes", static_cast<long long>(leaves * _root->nodeSize / scale));
+    output->appendNumber("innerNodeBytes", static_cast<long long>(innerBytes / scale));
+    output->appendNumber("leafSplits", static_cast<long long>(stats.leafSplits.load()));
+    output->appendNumber("innerNodeSplits", static_cast<long long>(stats.innerNodeSplits.load()));
+    output->appendNumber("leavesRemoved", static_cast<long long>(stats.leavesRemoved.load()));
+    output->appendNumber("innerNodesRemoved", static_cast<long long>(stats.innerNodesRemoved.load()));
+    output->appendNumber("leafMerges", static_cast<long long>(stats.leafMerges.load()));
+    output->appendNumber("leafRelocations", static_cast<long long>(stats.leafRelocations.load()));
+    output->appendNumber("optimisticRestarts", static_cast<long long>(stats.restarts.load()));
+    output->appendNumber("leafLatchWaits", static_cast<long long>(latchWaits));
 }
 
 bool PmseTree::isEmpty() {
-    return _first == nullptr;
+    return _root->first == nullptr;
+}
+
+PmseTreeBuilder::PmseTreeBuilder(PmseTree* tree, pool_base pop,
+                                 int fillFactor, int threads)
+    : _tree(tree), _pop(pop) {
+    fillFactor = std::min(std::max(fillFactor, 1), 100);
+    _leafEntries = std::max<uint64_t>(1, _tree->_index->capacity * fillFactor / 100);
+    _threads = std::min<size_t>(std::max(threads, 1), MAX_BUILD_THREADS);
+}
+
+PmseTreeBuilder::~PmseTreeBuilder() {
+    if (_committed)
+        return;
+    try {
+        stopWriters(false);
+        _tree->freeBulkLeaves(_pop);
+    } catch (std::exception &e) {
+        log() << "Index: bulk load leaves left for next open: " << e.what();
+    }
+}
+
+Status PmseTreeBuilder::add(const IndexKeyEntry& entry, bool dupsAllowed) {
+    PmseKey key(entry, _tree->_index->ordering);
+    if (!_lastEntry.empty()) {
+        if (key.entry().compare(_lastEntry) <= 0) {
+            return Status(ErrorCodes::InternalError,
+                          "expected ascending (key, RecordId) order in bulk builder");
+        }
+        if (!dupsAllowed && key.key() == StringData(_lastEntry).substr(0, _lastKeySize)) {
+            StringBuilder sb;
+            sb << "E11000 duplicate key error ";
+            sb << "dup key: " << entry.key.toString();
+            return Status(ErrorCodes::DuplicateKey, sb.str());
+        }
+    }
+    /* Leaf holding one key only grows into posting list while the key repeats */
+    if (_current.size() >= _leafEntries &&
+        (_current.size() == MAX_POSTING_ENTRIES || !sameKey(_current.front(), key.key())))
+        closeLeaf();
+    const KeyString::TypeBits& typeBits = key.ks.getTypeBits();
+    _current.push_back({key.entry().toString(),
+                        typeBits.isAllZeros() ? std::string()
+                                              : std::string(typeBits.getBuffer(), typeBits.getSize()),
+                        key.keySize, _tree->_index->fingerprint(key.key())});
+    _lastEntry = _current.back().entry;
+    _lastKeySize = key.keySize;
+    _keyBytes += _lastEntry.size();
+    if (_current.size() == _leafEntries &&
+        !(_tree->_index->postingLists && sameKey(_current.front(), key.key())))
+        closeLeaf();
+    return Status::OK();
+}
+
+bool PmseTreeBuilder::sameKey(const Entry& entry, StringData key) {
+    return StringData(entry.entry).substr(0, entry.keySize) == key;
+}
+
+/* Separator of leaf is known once its first entry is */
+void PmseTreeBuilder::closeLeaf() {
+    _separators.push_back(_separators.empty() ? std::string()
+                                              : shortestSeparator(_lastClosed, _current.front().entry));
+    _lastClosed = _current.back().entry;
+    _batch.push_back(std::move(_current));
+    _current.clear();
+    if (_batch.size() == BULK_LEAVES_PER_TX)
+        submitBatch();
+}
+
+/*
+ * Single thread writes batches itself. Otherwise they are queued for
+ * writers, at most two per writer to bound memory of pending entries.
+ */
+void PmseTreeBuilder::submitBatch() {
+    if (!_tree->_root->bulkChains) {
+        transaction::exec_tx(_pop, [this] {
+            _tree->_root->bulkChains = make_persistent<PmseBulkChains>();
+        });
+        for (size_t t = 0; _threads > 1 && t < _threads; t++) {
+            _writers.emplace_back(&PmseTreeBuilder::writeBatches, this, t);
+        }
+    }
+    if (_threads == 1) {
+        _written.push_back(writeBatch(0, _batch));
+        _batch.clear();
+        return;
+    }
+    stdx::unique_lock<stdx::mutex> lock(_mutex);
+    _taken.wait(lock, [this] { return _error || _queue.size() < 2 * _threads; });
+    if (_error)
+        std::rethrow_exception(_error);
+    _queue.emplace_back(_written.size(), std::move(_batch));
+    _written.emplace_back();
+    _batch.clear();
+    _queued.notify_one();
+}
+
+/* Writers finish queued batches only when asked to drain */
+void PmseTreeBuilder::stopWriters(bool drain) {
+    {
+        stdx::lock_guard<stdx::mutex> lock(_mutex);
+        _closed = true;
+        if (!drain)
+            _queue.clear();
+    }
+    _queued.notify_all();
+    for (auto& writer : _writers) {
+        writer.join();
+    }
+    _writers.clear();
+}
+
+/* Writer thread, stops all writers on first error */
+void PmseTreeBuilder::writeBatches(size_t chain) {
+    stdx::unique_lock<stdx::mutex> lock(_mutex);
+    while (true) {
+        _queued.wait(lock, [this] { return _closed || !_queue.empty(); });
+        if (_queue.empty())
+            return;
+        auto job = std::move(_queue.front());
+        _queue.pop_front();
+        _taken.notify_one();
+        lock.unlock();
+        std::vector<persistent_ptr<PmseTreeNode>> leaves;
+        try {
+            leaves = writeBatch(chain, job.second);
+        } catch (...) {
+            lock.lock();
+            if (!_error)
+                _error = std::current_exception();
+            _closed = true;
+            _queue.clear();
+            _queued.notify_all();
+            _taken.notify_all();
+            return;
+        }
+        lock.lock();
+        _written[job.first] = std::move(leaves);
+    }
+}
+
+/*
+ * Leaves are allocated in this transaction, so they are written without
+ * snapshots and persisted on commit. Batch is pushed in front of chain
+ * of the writer, only its head is logged.
+ */
+std::vector<persistent_ptr<PmseTreeNode>> PmseTreeBuilder::writeBatch(size_t chain,
+                                                                      const Batch& batch) {
+    std::vector<persistent_ptr<PmseTreeNode>> written;
+    transaction::exec_tx(_pop, [this, chain, &batch, &written] {
+        written.clear();
+        persistent_ptr<PmseTreeNode> previous = nullptr;
+        for (auto& entries : batch) {
+            auto leaf = _tree->allocateLeaf();
+            leaf->num_keys = entries.size();
+            if (entries.size() > leaf->capacity) {
+                /* Entries of one key which do not fit in slots */
+                std::vector<PmsePosting> postings;
+                for (auto& e : entries)
+                    postings.push_back({recordIdOf(e.entry), e.typeBits});
+                const Entry& first = entries.front();
+                _tree->writePosting(leaf, StringData(first.entry).substr(0, first.keySize), postings);
+            } else {
+                uint64_t prefixSize = std::min<uint64_t>(
+                    commonPrefix(entries.front().entry, entries.back().entry), leaf->prefixCapacity);
+                memcpy(leaf->prefix(), entries.front().entry.data(), prefixSize);
+                leaf->prefixSize = prefixSize;
+                for (uint64_t j = 0; j < entries.size(); j++) {
+                    const Entry& e = entries[j];
+                    leaf->keys()[j] = _tree->makeSlot(e.entry.substr(prefixSize) + e.typeBits,
+                                                      e.entry.size(), e.keySize);
+                    leaf->fingerprints()[j] = e.fp;
+                    leaf->slotOrder()[j] = j;
+                }
+                leaf->bitmap = entries.size() == MAX_LEAF_SLOTS ? ~0ULL : (1ULL << entries.size()) - 1;
+            }
+            leaf->previous = previous;
+            if (previous)
+                previous->next = leaf;
+            previous = leaf;
+            written.push_back(leaf);
+        }
+        persistent_ptr<PmseTreeNode>& head = _tree->_root->bulkChains->heads[chain];
+        previous->next = head;
+        head = written.front();
+    });
+    return written;
+}
+
+/*
+ * Publishes loaded leaves in one transaction, which relinks neighbouring
+ * batches. Foreground index build holds collection exclusively, so tree
+ * is still empty.
+ */
+void PmseTreeBuilder::commit() {
+    if (!_current.empty())
+        closeLeaf();
+    if (!_batch.empty())
+        submitBatch();
+    stopWriters(true);
+    if (_error)
+        std::rethrow_exception(_error);
+    std::vector<persistent_ptr<PmseTreeNode>> leaves;
+    int64_t entries = 0;
+    int64_t postings = 0;
+    for (auto& written : _written) {
+        leaves.insert(leaves.end(), written.begin(), written.end());
+        for (auto& leaf : written) {
+            entries += leaf->num_keys;
+            if (leaf->posting)
+                postings++;
+        }
+    }
+    if (leaves.empty()) {
+        _committed = true;
+        return;
+    }
+    PmseTreeIndex* index = _tree->_index.get();
+    std::unique_ptr<PmseInnerNode> root(leaves.size() > 1 ? buildInnerNodes(leaves, _separators)
+                                                          : nullptr);
+    PmseTree::HeldLocks held;
+    held.lock(index->rootLock);
+    invariant(!_tree->_root->first);
+    transaction::exec_tx(_pop, [this, &leaves] {
+        for (size_t k = 1; k < _written.size(); k++) {
+            _written[k - 1].back()->next = _written[k].front();
+            _written[k].front()->previous = _written[k - 1].back();
+        }
+        leaves.back()->next = nullptr;
+        _tree->_root->first = leaves.front();
+        _tree->_root->last = leaves.back();
+        delete_persistent<PmseBulkChains>(_tree->_root->bulkChains);
+        _tree->_root->bulkChains = nullptr;
+        if (_tree->_root->hash)
+            _tree->_root->hash->complete = false;
+    });
+    index->stats.reset(root.get(), leaves.size(), postings, _keyBytes);
+    index->root.store(root.release(), std::memory_order_release);
+    index->entries.store(entries);
+    _committed = true;
+    /* Lookups go to leaves until the table is complete, open finishes interrupted fill */
+    if (_tree->_root->hash)
+        _tree->fillHash(_pop);
 }
 
 }  // namespace mongo
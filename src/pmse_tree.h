@@ -44,131 +44,890 @@
 #include <libpmemobj++/shared_mutex.hpp>
 #include <libpmemobj++/mutex.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
 #include "mongo/db/storage/sorted_data_interface.h"
+#include "mongo/db/storage/key_string.h"
 #include "mongo/db/index/index_descriptor.h"
+#include "mongo/stdx/condition_variable.h"
+#include "mongo/stdx/mutex.h"
+#include "mongo/stdx/thread.h"
 
 using namespace pmem::obj;
 
 namespace mongo {
 
-const uint64_t TREE_ORDER = 7;  // number of elements in internal node
+const uint64_t TREE_ORDER = 7;  // number of elements in node of format 0
+const uint64_t INNER_NODE_ORDER = 64;  // number of separators in volatile inner node
+const uint64_t NODE_LINE_SIZE = 256;  // internal write unit of persistent memory media
+const uint64_t CACHE_LINE_SIZE = 64;
+const uint64_t MIN_NODE_SIZE = NODE_LINE_SIZE;
+const uint64_t MAX_NODE_SIZE = 8 * NODE_LINE_SIZE;
+const uint64_t MAX_LEAF_SLOTS = 64;  // valid slots are one bitmap word
+const uint64_t INLINE_ENTRY_SIZE = 32;  // longer entries go to overflow allocation
+const uint64_t MAX_BUILD_THREADS = 64;  // writers of one bulk load
+const uint64_t MAX_POSTING_ENTRIES = 4096;  // RecordIds in one posting list
 const int64_t BSON_MIN_SIZE = 5;
 
+/*
+ * 0 - persistent inner nodes, keys are BSON in separate allocations
+ * 1 - only leaves persistent, one block of per index size holding
+ *     KeyString entries in unsorted slots
+ */
+const uint64_t TREE_FORMAT_VERSION = 1;
+
 const uint64_t MIN_END = 1;
 const uint64_t MAX_END = 2;
 
+/*
+ * Index entry in leaf slot: KeyString of key with RecordId appended,
+ * which orders like (key, RecordId) pairs under memcmp, followed by
+ * TypeBits needed to decode the key. Leaf prefix is not repeated, slot
+ * stores only the rest of entry and TypeBits. Up to INLINE_ENTRY_SIZE
+ * bytes are kept in the slot, longer ones in overflow allocation owned
+ * by the slot. Fields are plain, writers add slots to undo log.
+ */
 struct IndexKeyEntry_PM {
- public:
-    static int64_t compareEntries(IndexKeyEntry& leftEntry, IndexKeyEntry_PM& rightEntry, const BSONObj& ordering);
+    bool isInline() const {
+        return size <= INLINE_ENTRY_SIZE;
+    }
+
+    PMEMoid overflow() const {
+        PMEMoid oid;
+        memcpy(&oid, bytes, sizeof(oid));
+        return oid;
+    }
+
+    const char* data() const {
+        return isInline() ? bytes : static_cast<const char*>(pmemobj_direct(overflow()));
+    }
+
+    uint16_t size;  // stored bytes, without leaf prefix and with TypeBits
+    uint16_t entrySize;  // whole entry including leaf prefix
+    uint16_t keySize;  // key part of whole entry
+    uint16_t reserved;
+    char bytes[INLINE_ENTRY_SIZE];  // entry or PMEMoid of overflow allocation
+};
+
+/* Slot of format 0, key is separately allocated BSON */
+struct PmseLegacyEntry {
+    BSONObj getBSON() {
+        return BSONObj(data.get());
+    }
 
-    BSONObj getBSON();
     persistent_ptr<char> data;
     p<int64_t> loc;
 };
 
-struct PmseTreeNode {
-    PmseTreeNode() : num_keys(0) {}
-
-    explicit PmseTreeNode(bool node_leaf)
-        : num_keys(0) {
-        keys = make_persistent<IndexKeyEntry_PM[TREE_ORDER]>();
-        if (node_leaf) {
-            is_leaf = true;
-        } else {
-            for (uint64_t i = 0; i < TREE_ORDER; i++) {
-                children_array[i] = nullptr;
-            }
-        }
-        next = nullptr;
-        previous = nullptr;
-    }
-
-    p<uint64_t> num_keys = 0;
-    persistent_ptr<IndexKeyEntry_PM[TREE_ORDER]> keys;
-    persistent_ptr<PmseTreeNode> children_array[TREE_ORDER + 1]; /* Exist only for internal nodes */
-    persistent_ptr<PmseTreeNode> next = nullptr;
-    persistent_ptr<PmseTreeNode> previous = nullptr;
-    persistent_ptr<PmseTreeNode> parent = nullptr;
-    p<bool> is_leaf = false;
+/*
+ * Entry encoded for search and insertion, built from key and RecordId.
+ */
+struct PmseKey {
+    PmseKey(const IndexKeyEntry& entry, const Ordering& ordering)
+        : ks(KeyString::Version::V1, entry.key, ordering), recordId(entry.loc.repr()) {
+        keySize = ks.getSize();
+        ks.appendRecordId(entry.loc);
+    }
+
+    StringData entry() const {
+        return StringData(ks.getBuffer(), ks.getSize());
+    }
+
+    StringData key() const {
+        return StringData(ks.getBuffer(), keySize);
+    }
+
+    KeyString ks;
+    size_t keySize;
+    int64_t recordId;
+};
+
+/* Node of format 0, only read when tree is converted */
+struct PmseLegacyTreeNode {
+    p<uint64_t> num_keys;
+    persistent_ptr<PmseLegacyEntry[TREE_ORDER]> keys;
+    persistent_ptr<PmseLegacyTreeNode> children_array[TREE_ORDER + 1];
+    persistent_ptr<PmseLegacyTreeNode> next;
+    persistent_ptr<PmseLegacyTreeNode> previous;
+    persistent_ptr<PmseLegacyTreeNode> parent;
+    p<bool> is_leaf;
     pmem::obj::shared_mutex _pmutex;
 };
 
+/* Entry of posting list as read into DRAM */
+struct PmsePosting {
+    int64_t recordId;
+    std::string typeBits;  // empty when all zero
+};
+
+/*
+ * RecordIds of leaf holding only entries of one key, moved out of line
+ * once duplicates of the key fill the leaf. Key is stored once, followed
+ * by table of distinct TypeBits of its entries, each with 16 bit length,
+ * and one record per entry: RecordId as offset from the lowest one, then
+ * index of its TypeBits when there is more than one. Records have fixed
+ * width and are sorted by RecordId. RecordIds of index entries are
+ * positive, so they sort like their KeyStrings. The list is a single
+ * allocation rewritten in transaction.
+ */
+struct PmsePostingList {
+    const char* data() const {
+        return reinterpret_cast<const char*>(this + 1);
+    }
+
+    char* data() {
+        return reinterpret_cast<char*>(this + 1);
+    }
+
+    StringData key() const {
+        return StringData(data(), keySize);
+    }
+
+    uint64_t stride() const {
+        return width + variantWidth;
+    }
+
+    const char* records() const {
+        return data() + keySize + variantBytes;
+    }
+
+    /* Bytes used after header */
+    uint64_t used() const {
+        return keySize + variantBytes + size * stride();
+    }
+
+    int64_t recordIdAt(uint64_t position) const;
+
+    StringData typeBitsAt(uint64_t position) const;
+
+    /* First position whose RecordId is not below recordId */
+    uint64_t lowerBound(int64_t recordId) const;
+
+    p<uint32_t> capacity;  // bytes after header
+    p<uint32_t> size;  // entries
+    p<int64_t> base;  // lowest RecordId
+    p<uint16_t> keySize;
+    p<uint16_t> variants;  // distinct TypeBits
+    p<uint16_t> variantBytes;
+    p<uint8_t> width;  // bytes of RecordId offset, little endian
+    p<uint8_t> variantWidth;  // bytes of TypeBits index, 0 with one variant
+};
+
+/*
+ * Leaf of the tree, a single allocation of node size chosen for the index.
+ * Header is followed by fingerprints, slot order, prefix area and slots,
+ * there are capacity slots. Keys stay in the slot where they were
+ * inserted. Slot is valid when its bit is set in bitmap, slot order lists
+ * valid slots in key order. First prefixSize bytes are common to all
+ * entries of the leaf and are cut from slots.
+ *
+ * Posting leaf keeps entries of one key in posting list instead, its
+ * bitmap and prefix are empty and num_keys counts RecordIds of the list.
+ * Accessors by position serve both kinds of leaves.
+ */
+struct PmseTreeNode {
+    /* Number of slots fitting in node of given size */
+    static uint64_t capacityFor(uint64_t nodeSize);
+
+    /* Space for common prefix, grows with node */
+    static uint64_t prefixCapacityFor(uint64_t nodeSize) {
+        return nodeSize / 16;
+    }
+
+    /* Byte arrays are padded to whole words */
+    static uint64_t arrayLength(uint64_t capacity) {
+        return (capacity + 7) & ~7ULL;
+    }
+
+    uint8_t* fingerprints() {
+        return reinterpret_cast<uint8_t*>(this + 1);
+    }
+
+    uint8_t* slotOrder() {
+        return fingerprints() + arrayLength(capacity);
+    }
+
+    char* prefix() {
+        return reinterpret_cast<char*>(slotOrder() + arrayLength(capacity));
+    }
+
+    IndexKeyEntry_PM* keys() {
+        return reinterpret_cast<IndexKeyEntry_PM*>(prefix() + arrayLength(prefixCapacity));
+    }
+
+    StringData prefixData() {
+        return StringData(prefix(), prefixSize);
+    }
+
+    /* Entry bytes stored in slot */
+    StringData suffix(const IndexKeyEntry_PM& slot) {
+        return StringData(slot.data(), slot.entrySize - prefixSize);
+    }
+
+    StringData typeBits(const IndexKeyEntry_PM& slot) {
+        return StringData(slot.data() + slot.entrySize - prefixSize,
+                          slot.size - (slot.entrySize - prefixSize));
+    }
+
+    /* Whole entry with prefix */
+    std::string entryString(const IndexKeyEntry_PM& slot) {
+        return prefixData().toString() + suffix(slot).toString();
+    }
+
+    /* Like comparing whole entry with other, prefix is compared once */
+    int compareEntry(const IndexKeyEntry_PM& slot, StringData other) {
+        int cmp = prefixData().compare(other.substr(0, prefixSize));
+        if (cmp != 0)
+            return cmp;
+        return suffix(slot).compare(other.substr(prefixSize));
+    }
+
+    bool entryEquals(const IndexKeyEntry_PM& slot, StringData entry) {
+        return headEquals(slot, entry, slot.entrySize);
+    }
+
+    /* Key without RecordId equals key, which is KeyString of key alone */
+    bool keyEquals(const IndexKeyEntry_PM& slot, StringData key) {
+        return headEquals(slot, key, slot.keySize);
+    }
+
+    /* First length bytes of whole entry equal data of that length */
+    bool headEquals(const IndexKeyEntry_PM& slot, StringData data, uint64_t length) {
+        if (data.size() != length)
+            return false;
+        uint64_t inPrefix = std::min<uint64_t>(prefixSize, length);
+        return memcmp(prefix(), data.rawData(), inPrefix) == 0 &&
+               memcmp(slot.data(), data.rawData() + inPrefix, length - inPrefix) == 0;
+    }
+
+    /* Entry at given position in key order */
+    IndexKeyEntry_PM& entryAt(uint64_t position) {
+        return keys()[slotOrder()[position]];
+    }
+
+    uint64_t positionOf(uint64_t slot) {
+        uint64_t position = 0;
+        while (slotOrder()[position] != slot)
+            position++;
+        return position;
+    }
+
+    /* Bytes all entries start with, key of posting leaf */
+    StringData entriesPrefix() {
+        return posting ? posting->key() : prefixData();
+    }
+
+    std::string entryStringAt(uint64_t position);
+    StringData typeBitsAt(uint64_t position);
+    uint64_t keySizeAt(uint64_t position);
+    uint64_t entrySizeAt(uint64_t position);
+    int compareAt(uint64_t position, StringData other);
+    bool entryEqualsAt(uint64_t position, StringData entry);
+    bool keyEqualsAt(uint64_t position, StringData key);
+
+    p<uint64_t> num_keys;
+    p<uint64_t> bitmap;
+    p<uint32_t> capacity;
+    p<uint16_t> prefixCapacity;
+    p<uint16_t> prefixSize;
+    persistent_ptr<PmseTreeNode> next;
+    persistent_ptr<PmseTreeNode> previous;
+    persistent_ptr<PmsePostingList> posting;  // only in posting leaf
+};
+
+/*
+ * Reader-writer spin latch of leaves. Readers wait only while a writer
+ * holds the latch, so a reader may take it again. Padded to cache line.
+ * Version counts writer unlocks, so leaves of the stripe are unchanged
+ * while it stays the same. Waits count locks not taken at first try.
+ */
+class PmseLatch {
+ public:
+    void lock();
+    void lock_shared();
+
+    bool try_lock() {
+        uint32_t free = 0;
+        return _state.compare_exchange_strong(free, WRITER, std::memory_order_acquire);
+    }
+
+    bool try_lock_shared() {
+        uint32_t state = _state.load(std::memory_order_relaxed);
+        return !(state & WRITER) &&
+            _state.compare_exchange_weak(state, state + 1, std::memory_order_acquire);
+    }
+
+    void unlock() {
+        _version.fetch_add(1, std::memory_order_relaxed);
+        _state.store(0, std::memory_order_release);
+    }
+
+    void unlock_shared() {
+        _state.fetch_sub(1, std::memory_order_release);
+    }
+
+    uint64_t version() const {
+        return _version.load(std::memory_order_acquire);
+    }
+
+    uint64_t waits() const {
+        return _waits.load(std::memory_order_relaxed);
+    }
+
+ private:
+    static const uint32_t WRITER = 1u << 31;
+    std::atomic<uint32_t> _state{0};  // WRITER or number of readers
+    std::atomic<uint32_t> _waits{0};
+    std::atomic<uint64_t> _version{0};
+    char _padding[CACHE_LINE_SIZE - 2 * sizeof(uint64_t)];
+};
+
+const uint64_t LEAF_LATCH_BITS = 10;
+const uint64_t MAX_INNER_LEVELS = 16;  // far above height reachable with inner node order
+const uint64_t HASH_BASE_BUCKETS = 1024;  // buckets of hash table at level 0
+const uint64_t HASH_MAX_LEVEL = 21;  // bucket numbers stay below 32 bits
+const uint64_t HASH_SEGMENTS = HASH_MAX_LEVEL + 2;
+const uint64_t HASH_LOAD = 2;  // entries per bucket on average before bucket is split
+
+/*
+ * Entry of hash table chained in its bucket. Header and whole entry with
+ * TypeBits are one allocation of exact size, so a copy costs no more
+ * than the entry itself.
+ */
+struct PmseHashEntry {
+    const char* data() const {
+        return reinterpret_cast<const char*>(this + 1);
+    }
+
+    StringData entry() const {
+        return StringData(data(), entrySize);
+    }
+
+    StringData typeBits() const {
+        return StringData(data() + entrySize, size - entrySize);
+    }
+
+    persistent_ptr<PmseHashEntry> next;
+    p<uint64_t> hash;  // of KeyString of key alone
+    uint16_t size;  // stored bytes with TypeBits
+    uint16_t entrySize;
+    uint16_t keySize;
+    uint16_t reserved;
+};
+
+/*
+ * Persistent linear hash table of index entries, kept next to leaves for
+ * equality lookups. Table of level l has HASH_BASE_BUCKETS << l buckets
+ * and buckets below split are already split into l + 1. Segment 0 holds
+ * first HASH_BASE_BUCKETS buckets, segment k > 0 buckets added at level
+ * k - 1. Segments never move, so table grows by one bucket split.
+ */
+struct PmseHashTable {
+    static void locate(uint64_t bucket, uint64_t* segment, uint64_t* offset);
+
+    persistent_ptr<PmseHashEntry>& bucket(uint64_t bucket);
+
+    p<uint64_t> level;
+    p<uint64_t> split;
+    p<bool> complete;  // holds all entries of leaves, cleared while bulk load fills it
+    persistent_ptr<persistent_ptr<PmseHashEntry>[]> segments[HASH_SEGMENTS];
+};
+
+/*
+ * Epoch based reclamation of memory which readers reach without locks.
+ * A thread announces global epoch while inside a guard, memory retired
+ * at epoch e is freed once every announced epoch is above e. Guards may
+ * be nested.
+ */
+class PmseEpochs {
+ public:
+    class Guard {
+     public:
+        Guard();
+        ~Guard();
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+
+    /* Epoch to store with memory unlinked by caller */
+    static uint64_t retire();
+
+    /* Memory retired at epoch below this is not reachable by any reader */
+    static uint64_t safe();
+};
+
+/*
+ * Version lock for optimistic lock coupling. Readers take version and
+ * validate it after reading, writers lock by setting the lowest bit,
+ * which only succeeds from version the writer has read. Node removed
+ * from tree is marked obsolete and readers restart when they see it.
+ */
+class PmseVersionLock {
+ public:
+    static const uint64_t LOCKED = 1;
+    static const uint64_t OBSOLETE = 2;
+
+    /* Version once no writer holds lock, has OBSOLETE set for removed node */
+    uint64_t stable() const;
+
+    /* Reads since version was taken saw consistent state */
+    bool validate(uint64_t version) const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return _version.load(std::memory_order_relaxed) == version;
+    }
+
+    /* Locks only when nothing changed since version was taken */
+    bool upgrade(uint64_t version) {
+        return _version.compare_exchange_strong(version, version | LOCKED,
+                                                std::memory_order_acquire);
+    }
+
+    void unlock() {
+        _version.fetch_add(OBSOLETE + LOCKED, std::memory_order_release);
+    }
+
+    void unlockObsolete() {
+        _version.fetch_add(LOCKED, std::memory_order_release);
+    }
+
+ private:
+    std::atomic<uint64_t> _version{0};
+};
+
+/*
+ * Inner node kept in DRAM. Entries >= keys[i] are under child i + 1.
+ * Nodes directly above leaves hold offsets of leaves, others children.
+ * Readers do not lock, so fields are atomic and arrays are fixed; one
+ * spare separator holds overflow until node is split. Separators are
+ * immutable and owned by node until retired.
+ */
+struct PmseInnerNode {
+    explicit PmseInnerNode(bool aboveLeaves);
+    ~PmseInnerNode();
+
+    size_t childCount() const {
+        return count.load(std::memory_order_relaxed);
+    }
+
+    /* Entries below all children */
+    uint64_t total() const;
+
+    /* Adds child at the end, separator is ignored for the first one */
+    void append(const std::string* key, PmseInnerNode* child, uint64_t leaf, uint64_t entries);
+
+    /* Adds separator at index and child after it, caller holds lock */
+    void insertAt(size_t index, const std::string* key, PmseInnerNode* child, uint64_t leaf,
+                  uint64_t entries);
+
+    /* Drops child at index with separator before it, returns that separator */
+    const std::string* eraseAt(size_t index);
+
+    /* Moves children above split to empty sibling, returns separator between */
+    const std::string* splitTo(PmseInnerNode* sibling, size_t split);
+
+    const bool aboveLeaves;
+    PmseVersionLock lock;
+    std::atomic<size_t> count{0};  // children, separators are one less
+    std::atomic<const std::string*> keys[INNER_NODE_ORDER + 1];  // shortest separators
+    std::atomic<PmseInnerNode*> children[INNER_NODE_ORDER + 2];
+    std::atomic<uint64_t> leaves[INNER_NODE_ORDER + 2];
+    /*
+     * Entries below each child. Writers not splitting add to them without
+     * locks, so an add racing with split of the node may land next to its
+     * child, which only skews sampling.
+     */
+    std::atomic<int64_t> counts[INNER_NODE_ORDER + 2];
+};
+
+/*
+ * Shape and activity of tree for collStats. Set when inner nodes are
+ * built, then updated by writers once their change is done, so reading
+ * is cheap. Leaf latch waits are counted by latches.
+ */
+struct PmseTreeStats {
+    std::atomic<int64_t> leaves{0};
+    std::atomic<int64_t> postingLeaves{0};
+    std::atomic<int64_t> keyBytes{0};  // KeyStrings with RecordIds of all entries
+    std::atomic<int64_t> innerNodes[MAX_INNER_LEVELS];  // by level, 0 is right above leaves
+    std::atomic<uint64_t> leafSplits{0};
+    std::atomic<uint64_t> innerNodeSplits{0};
+    std::atomic<uint64_t> leavesRemoved{0};
+    std::atomic<uint64_t> innerNodesRemoved{0};
+    std::atomic<uint64_t> leafMerges{0};  // leaves moved into left neighbour by rebalance
+    std::atomic<uint64_t> leafRelocations{0};  // leaves copied to new allocations by compaction
+    std::atomic<uint64_t> restarts{0};  // optimistic descents started over
+
+    PmseTreeStats() {
+        for (auto& level : innerNodes)
+            level.store(0, std::memory_order_relaxed);
+    }
+
+    /* Shape of tree built from leaves, before it is shared */
+    void reset(const PmseInnerNode* root, int64_t leafCount, int64_t postingCount, int64_t entryBytes);
+
+    void addInnerNodes(size_t level, int64_t delta) {
+        innerNodes[std::min<size_t>(level, MAX_INNER_LEVELS - 1)].fetch_add(delta, std::memory_order_relaxed);
+    }
+};
+
+/*
+ * Volatile part of the tree, built from leaves when index is opened.
+ * Lives as long as pool entry, so it survives closing idle pool.
+ * Inner nodes use optimistic lock coupling, rootLock plays parent of
+ * root. Memory unlinked from tree waits in retired lists until no
+ * reader may still see it.
+ */
+struct PmseTreeIndex {
+    explicit PmseTreeIndex(const BSONObj& keyPattern)
+        : ordering(Ordering::make(keyPattern)) {}
+    ~PmseTreeIndex();
+
+    /*
+     * One byte hash of KeyString of key without RecordId, so keys equal
+     * in comparison (e.g. 1 and 1.0) get the same value.
+     */
+    uint8_t fingerprint(StringData key) const;
+
+    /* Hash of KeyString of key alone, fingerprint is folded from it */
+    uint64_t keyHash(StringData key) const;
+
+    /* Entry at position decoded with TypeBits stored in slot */
+    IndexKeyEntry entryAt(PmseTreeNode& node, uint64_t position, bool wantKey = true) const;
+
+    /*
+     * Whole entry (KeyString with RecordId) decoded, TypeBits empty when
+     * all zero. Without wantKey only RecordId is decoded, key is empty.
+     */
+    IndexKeyEntry decode(StringData entry, StringData typeBits, uint64_t keySize,
+                         bool wantKey = true) const;
+
+    persistent_ptr<PmseTreeNode> leaf(uint64_t offset) const {
+        return persistent_ptr<PmseTreeNode>(PMEMoid{poolUuid, offset});
+    }
+
+    /*
+     * Latch of leaf, striped by offset so leaves stay free of locks.
+     * Leaves may share latch, writer holding one does not take it again.
+     */
+    PmseLatch& latch(persistent_ptr<PmseTreeNode> leaf) {
+        return latches[(leaf.raw().off * 0x9E3779B97F4A7C15ULL) >> (64 - LEAF_LATCH_BITS)];
+    }
+
+    /* Bucket of hash table with given shape, level in upper and split in lower half */
+    static uint64_t bucketOf(uint64_t hash, uint64_t shape);
+
+    PmseLatch& bucketLatch(uint64_t bucket) {
+        return bucketLatches[(bucket * 0x9E3779B97F4A7C15ULL) >> (64 - LEAF_LATCH_BITS)];
+    }
+
+    /* Frees retired inner nodes and separators no reader can see */
+    void reclaim();
+
+    /* Leaves were split or removed since last compaction, done at least interval ago */
+    bool compactionDue(unsigned long long intervalMillis) const;
+
+    const Ordering ordering;
+    uint64_t capacity = 0;  // slots in leaf
+    uint64_t prefixCapacity = 0;
+    unsigned allocClass = 0;  // aligned allocation class of leaves, 0 if not available
+    uint64_t poolUuid = 0;
+    std::atomic<PmseInnerNode*> root{nullptr};  // null while tree has at most one leaf
+    std::atomic<int64_t> entries{0};  // in all leaves, exact
+    uint64_t mergeEntries = 0;  // neighbour leaves holding together at most this many are merged
+    bool postingLists = false;  // full leaves of one key become posting leaves, not for unique indexes
+    std::atomic<uint64_t> underfullLeaves{0};  // removals leaving leaf at or below mergeEntries
+    std::atomic<uint64_t> compactedChurn{0};  // leaf splits and removals at last compaction
+    std::atomic<unsigned long long> compactedAt{0};  // time of last compaction in millis
+    PmseTreeStats stats;
+    PmseVersionLock rootLock;
+    stdx::mutex retiredMutex;
+    std::deque<std::pair<uint64_t, PmseInnerNode*>> retiredNodes;
+    std::deque<std::pair<uint64_t, const std::string*>> retiredKeys;
+    std::deque<std::pair<uint64_t, persistent_ptr<PmseTreeNode>>> retiredLeaves;
+    PmseLatch latches[1 << LEAF_LATCH_BITS];
+    std::atomic<uint64_t> hashShape{0};  // level and split of hash table, changed under bucket latch
+    std::unique_ptr<PmseLatch[]> bucketLatches;  // only when index has hash table
+    stdx::mutex hashSplitMutex;  // one writer splits buckets at a time
+};
+
 struct CursorObject {
     persistent_ptr<PmseTreeNode> node;
     uint64_t index;
 };
 
+/*
+ * Leaves written by bulk load, one chain per writer thread, so writers
+ * commit their transactions without touching shared fields.
+ */
+struct PmseBulkChains {
+    persistent_ptr<PmseTreeNode> heads[MAX_BUILD_THREADS];
+};
+
+/*
+ * Root object of index pool. Fields of format 0 come first, so old
+ * pools open with the same root and get converted.
+ */
+struct PmseTreeRoot {
+    pmem::obj::mutex globalMutex;
+    persistent_ptr<PmseLegacyTreeNode> current;
+    persistent_ptr<PmseLegacyTreeNode> legacyRoot;  // format 0 only
+    persistent_ptr<PmseLegacyTreeNode> legacyFirst;  // format 0, emptied by conversion
+    persistent_ptr<PmseLegacyTreeNode> legacyLast;
+    BSONObj ordering;
+    p<uint64_t> version;
+    persistent_ptr<PmseTreeNode> first;
+    persistent_ptr<PmseTreeNode> last;
+    p<uint64_t> nodeSize;
+    persistent_ptr<PmseTreeNode> retired;  // removed leaves not freed yet, newest first
+    persistent_ptr<PmseBulkChains> bulkChains;  // leaves of bulk load not committed yet
+    persistent_ptr<PmseHashTable> hash;  // equality lookups, absent for most indexes
+};
+
+/*
+ * Tree over root of index pool, kept in DRAM with its volatile part for
+ * as long as pool entry lives. Holds no pointer into pool other than
+ * persistent ones, so it survives closing idle pool.
+ */
 class PmseTree {
     friend class PmseCursor;
+    friend class PmseTreeBuilder;
 
  public:
+    PmseTree(persistent_ptr<PmseTreeRoot> root, const BSONObj& keyPattern)
+        : _root(root), _index(new PmseTreeIndex(keyPattern)) {}
+
+    PmseTreeIndex& index() {
+        return *_index;
+    }
+
     Status insert(pool_base pop, IndexKeyEntry& entry,
                   const BSONObj& _ordering, bool dupsAllowed);
     bool remove(pool_base pop, IndexKeyEntry& entry,
                 bool dupsAllowed, const BSONObj& _ordering);
 
+    /* Counts entries leaf by leaf */
     uint64_t countElements();
 
+    uint64_t numEntries() const;
+
+    /*
+     * Entry at about given rank, found by subtree counts of inner nodes,
+     * none for empty tree. Uniform rank gives sample.
+     */
+    boost::optional<IndexKeyEntry> entryAtRank(uint64_t rank);
+
+    /* Shape and activity counters, sizes divided by scale */
+    void appendStats(BSONObjBuilder* output, double scale);
+
     bool isEmpty();
 
+    /* Index keeps complete hash table of its entries next to leaves */
+    bool hasHashTable() const {
+        return _root->hash != nullptr && _root->hash->complete;
+    }
+
+    /*
+     * Lowest (highest without lowest) whole entry whose key equals key,
+     * KeyString of key alone, with its TypeBits. Found in hash table in
+     * constant time, caller checks hasHashTable. False when key is absent.
+     */
+    bool findEqual(StringData key, bool lowest, std::string* entry, std::string* typeBits);
+
+    /*
+     * Deletes only remove slots, so leaves may get underfull or empty.
+     * This merges leaf into its left neighbour under the same inner node
+     * when both together hold at most mergeEntries entries and drops
+     * empty leaves. Run in background, returns number of removed leaves.
+     */
+    uint64_t rebalance(pool_base pop, uint64_t mergeEntries);
+
+    /*
+     * Online compaction: rebalance with given merge limit, then leaves
+     * not following their previous leaf in the pool are copied to new
+     * allocations made in key order. Adjacency of the copies is up to
+     * the allocator and not guaranteed. Each step is one transaction over
+     * one leaf and its neighbours under the locks writers take, so reads
+     * and writes go on. Removed leaves are freed once no reader sees them.
+     */
+    void compact(pool_base pop, uint64_t mergeEntries);
+
+    /*
+     * Converts old format and rebuilds inner nodes from leaves. Has to
+     * be called once per process before tree is used. Node size
+     * is used when tree has none yet, hash table is created when asked
+     * for while tree has no leaves.
+     */
+    void open(pool_base pop, uint64_t nodeSize, bool hashTable);
+
+    /*
+     * Allocation classes live only while pool is open, so this has to be
+     * repeated whenever pool is reopened.
+     */
+    void registerAllocClass(pool_base pop);
+
+    /* Rounds requested node size to media lines within allowed range */
+    static uint64_t alignNodeSize(int64_t requested);
+
+    /*
+     * Bitmask of valid slots in leaf holding key with given fingerprint.
+     * Only these slots need full comparison.
+     */
+    static uint64_t matchFingerprints(persistent_ptr<PmseTreeNode> node, uint8_t fp);
+
  private:
-    pmem::obj::mutex globalMutex;
-    void unlockTree(std::list<pmem::obj::shared_mutex*>& locks);
-    bool nodeIsSafeForOperation(persistent_ptr<PmseTreeNode> node, bool insert);
+    /* Inner node on the way to leaf, with child taken and version read */
+    struct PathEntry {
+        PmseInnerNode* node;
+        size_t index;
+        uint64_t version;
+    };
+
+    /* Result of optimistic descent, checked by validLeaf once leaf is locked */
+    struct Descent {
+        std::vector<PathEntry> path;
+        uint64_t rootVersion = 0;
+        persistent_ptr<PmseTreeNode> leaf;
+    };
+
+    class HeldLocks;
+
+    Status insertEntry(pool_base pop, IndexKeyEntry& entry, bool dupsAllowed);
+    template <typename ChildOf>
+    bool descendBy(ChildOf childOf, Descent& descent);
+    bool descend(StringData entry, Descent& descent);
+    bool descendToRank(uint64_t& rank, Descent& descent);
+    void addCount(const std::vector<PathEntry>& path, size_t levels, int64_t delta);
+    bool validLeaf(const Descent& descent);
+    bool lockForSplit(const Descent& descent, HeldLocks& held);
+    persistent_ptr<PmseTreeNode> lockLeaf(StringData entry);
+    persistent_ptr<PmseTreeNode> lockEnd(bool last);
+    bool tryLatch(persistent_ptr<PmseTreeNode> leaf, std::initializer_list<const PmseLatch*> held,
+                  stdx::unique_lock<PmseLatch>& lock);
+    void reclaim(pool_base pop);
+    uint64_t insertionPosition(persistent_ptr<PmseTreeNode> node, StringData entry);
+    uint64_t findEntry(persistent_ptr<PmseTreeNode> node, const PmseKey& key, uint8_t fp);
+    std::vector<PmsePosting> readPosting(persistent_ptr<PmseTreeNode> node);
+    void writePosting(persistent_ptr<PmseTreeNode> node, StringData key,
+                      const std::vector<PmsePosting>& entries);
+    void addToPosting(persistent_ptr<PmseTreeNode> node, const PmseKey& key);
+    void removeFromPosting(persistent_ptr<PmseTreeNode> node, uint64_t position);
+    void fillSlots(persistent_ptr<PmseTreeNode> node, StringData key,
+                   const std::vector<PmsePosting>& entries);
+    persistent_ptr<PmseTreeNode> splitPostingAndInsert(persistent_ptr<PmseTreeNode> node,
+                                                       const PmseKey& key, uint8_t fp);
+    Status checkDuplicate(persistent_ptr<PmseTreeNode> node, const PmseKey& key,
+                          uint8_t fp, const IndexKeyEntry& entry);
+    bool checkNeighbourDuplicates(persistent_ptr<PmseTreeNode> node, const PmseKey& key,
+                                  uint8_t fp, const IndexKeyEntry& entry, Status& status);
     uint64_t cut(uint64_t length);
-    int64_t getNeighborIndex(persistent_ptr<PmseTreeNode> node);
-    persistent_ptr<PmseTreeNode> coalesceNodes(
-                    pool_base pop, persistent_ptr<PmseTreeNode> root,
-                    persistent_ptr<PmseTreeNode> n,
-                    persistent_ptr<PmseTreeNode> neighbor,
-                    int64_t neighbor_index, IndexKeyEntry_PM k_prime);
-    persistent_ptr<PmseTreeNode> redistributeNodes(
-                    pool_base pop, persistent_ptr<PmseTreeNode> root,
-                    persistent_ptr<PmseTreeNode> n,
-                    persistent_ptr<PmseTreeNode> neighbor,
-                    int64_t neighbor_index, int64_t k_prime_index,
-                    IndexKeyEntry_PM k_prime);
-    persistent_ptr<PmseTreeNode> makeTreeRoot(IndexKeyEntry& key);
-    Status insertKeyIntoLeaf(persistent_ptr<PmseTreeNode> node, IndexKeyEntry& entry,
-                             const BSONObj& _ordering);
-    persistent_ptr<PmseTreeNode> locateLeafWithKeyPM(
-                    persistent_ptr<PmseTreeNode> node, IndexKeyEntry& entry,
-                    const BSONObj& _ordering, std::list<pmem::obj::shared_mutex*>& locks,
-                    persistent_ptr<PmseTreeNode>& lockNode, bool insert);
-    persistent_ptr<PmseTreeNode> splitFullNodeAndInsert(
-                    pool_base pop, persistent_ptr<PmseTreeNode> node,
-                    IndexKeyEntry& entry, const BSONObj& _ordering,
-                    std::list<pmem::obj::shared_mutex*>& locks);
-    persistent_ptr<PmseTreeNode> insertIntoNodeParent(
-                    pool_base pop, persistent_ptr<PmseTreeNode> root,
-                    persistent_ptr<PmseTreeNode> node, IndexKeyEntry_PM& new_key,
-                    persistent_ptr<PmseTreeNode> new_leaf);
-    persistent_ptr<PmseTreeNode> allocateNewRoot(
-                    pool_base pop, persistent_ptr<PmseTreeNode> left,
-                    IndexKeyEntry_PM& new_key, persistent_ptr<PmseTreeNode> right);
-    uint64_t getLeftIndex(persistent_ptr<PmseTreeNode> parent,
-                          persistent_ptr<PmseTreeNode> left);
-    persistent_ptr<PmseTreeNode> insertKeyIntoNode(
-                    pool_base pop, persistent_ptr<PmseTreeNode> root,
-                    persistent_ptr<PmseTreeNode> parent, uint64_t left_index,
-                    IndexKeyEntry_PM& new_key, persistent_ptr<PmseTreeNode> right);
-    persistent_ptr<PmseTreeNode> insertToNodeAfterSplit(
-                    pool_base pop, persistent_ptr<PmseTreeNode> root,
-                    persistent_ptr<PmseTreeNode> old_node, uint64_t left_index,
-                    IndexKeyEntry_PM& new_key, persistent_ptr<PmseTreeNode> right);
-    persistent_ptr<PmseTreeNode> adjustRoot(persistent_ptr<PmseTreeNode> root);
-    persistent_ptr<PmseTreeNode> deleteEntry(pool_base pop, IndexKeyEntry& key,
-                                             persistent_ptr<PmseTreeNode> node,
-                                             uint64_t index);
-    persistent_ptr<PmseTreeNode> removeEntryFromNode(
-                    IndexKeyEntry& key, persistent_ptr<PmseTreeNode> node,
-                    uint64_t index);
-
-    persistent_ptr<PmseTreeNode> _current;
-    persistent_ptr<PmseTreeNode> _root;
-    persistent_ptr<PmseTreeNode> _first;
-    persistent_ptr<PmseTreeNode> _last;
-    BSONObj _ordering;
+    persistent_ptr<PmseTreeNode> allocateLeaf();
+    IndexKeyEntry_PM makeSlot(StringData stored, uint64_t entrySize, uint64_t keySize);
+    IndexKeyEntry_PM makeEntry(const PmseKey& key, uint64_t prefixSize);
+    void freeEntry(const IndexKeyEntry_PM& slot);
+    void fitPrefix(persistent_ptr<PmseTreeNode> node, StringData entry);
+    void writeFreeSlot(persistent_ptr<PmseTreeNode> node, uint64_t slot,
+                       const IndexKeyEntry_PM& value, uint8_t fp);
+    void appendSlot(persistent_ptr<PmseTreeNode> node, const IndexKeyEntry_PM& value, uint8_t fp);
+    persistent_ptr<PmseTreeNode> makeLeaf(const PmseKey& key, uint8_t fp);
+    Status insertKeyIntoLeaf(persistent_ptr<PmseTreeNode> node, const PmseKey& key, uint8_t fp);
+    persistent_ptr<PmseTreeNode> splitFullNodeAndInsert(persistent_ptr<PmseTreeNode> node,
+                                                        const PmseKey& key, uint8_t fp);
+    void linkLeafAfter(persistent_ptr<PmseTreeNode> node, persistent_ptr<PmseTreeNode> new_leaf);
+    void insertIntoNodeParent(std::vector<PathEntry>& path, persistent_ptr<PmseTreeNode> left,
+                              const std::string* separator, persistent_ptr<PmseTreeNode> right);
+    void removeEntryFromNode(persistent_ptr<PmseTreeNode> node, uint64_t slot);
+    void unlinkLeaf(persistent_ptr<PmseTreeNode> node);
+    void removeLeafFromParent(std::vector<PathEntry>& path, HeldLocks& held,
+                              persistent_ptr<PmseTreeNode> leaf);
+    void moveEntries(persistent_ptr<PmseTreeNode> from, persistent_ptr<PmseTreeNode> to);
+    bool mergeLeaf(pool_base pop, Descent& descent, uint64_t mergeEntries);
+    bool relocateLeaf(pool_base pop, Descent& descent);
+    template <typename Visit>
+    void walkLeaves(Visit visit);
+    void freeLegacyNodes(pool_base pop);
+    void appendConverted(PmseLegacyEntry& old);
+    void convertLegacyLeaf();
+    void freeBulkLeaves(pool_base pop);
+    void rebuildInnerNodes();
+    persistent_ptr<PmseHashEntry>* lockBucket(uint64_t hash, stdx::unique_lock<PmseLatch>& lock);
+    void addToHash(persistent_ptr<PmseHashEntry>* bucket, uint64_t hash, StringData stored,
+                   uint64_t entrySize, uint64_t keySize);
+    void removeFromHash(persistent_ptr<PmseHashEntry>* bucket, const PmseKey& key);
+    void splitBucket(pool_base pop);
+    void growHash(pool_base pop);
+    void clearHash(pool_base pop);
+    void fillHash(pool_base pop);
+
+    persistent_ptr<PmseTreeRoot> _root;
+    std::unique_ptr<PmseTreeIndex> _index;
+};
+
+/*
+ * Loads empty tree from entries coming in key order. Leaves are filled
+ * up to fill factor (percent of capacity), leaf of one key keeps taking
+ * its duplicates into posting list. Leaves are written in batches of
+ * consecutive leaves, one transaction per batch. With more threads
+ * batches are written in parallel, each writer to its own chain. Leaves
+ * stay off the tree until commit stitches batches in key order and
+ * builds inner nodes, so nobody sees half built index. Leaves of load
+ * which did not commit are freed by destructor, after crash on open.
+ */
+class PmseTreeBuilder {
+ public:
+    PmseTreeBuilder(PmseTree* tree, pool_base pop, int fillFactor, int threads);
+    ~PmseTreeBuilder();
+
+    Status add(const IndexKeyEntry& entry, bool dupsAllowed);
+
+    void commit();
+
+ private:
+    struct Entry {
+        std::string entry;  // KeyString with RecordId
+        std::string typeBits;  // empty when all zero
+        uint64_t keySize;
+        uint8_t fp;
+    };
+
+    typedef std::vector<std::vector<Entry>> Batch;
+
+    static bool sameKey(const Entry& entry, StringData key);
+    void closeLeaf();
+    void submitBatch();
+    void stopWriters(bool drain);
+    void writeBatches(size_t chain);
+    std::vector<persistent_ptr<PmseTreeNode>> writeBatch(size_t chain, const Batch& batch);
+
+    PmseTree* _tree;
+    pool_base _pop;
+    uint64_t _leafEntries;
+    size_t _threads;
+    std::vector<Entry> _current;
+    Batch _batch;  // closed leaves not submitted yet
+    std::vector<std::string> _separators;  // one per leaf, first is empty
+    std::string _lastEntry;
+    uint64_t _lastKeySize = 0;
+    int64_t _keyBytes = 0;
+    std::string _lastClosed;  // last entry of previous leaf
+    bool _committed = false;
+
+    stdx::mutex _mutex;  // protects fields below
+    stdx::condition_variable _queued;
+    stdx::condition_variable _taken;
+    std::deque<std::pair<size_t, Batch>> _queue;  // batch number and leaves
+    std::vector<std::vector<persistent_ptr<PmseTreeNode>>> _written;  // by batch number
+    std::vector<stdx::thread> _writers;
+    std::exception_ptr _error;
+    bool _closed = false;
 };
 
 }  // namespace mongo